@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "httpserve.h"
+#include "accesslog.h"
+
+struct buffer {
+    pthread_mutex_t lock;           // against the flusher, the owner is the only writer
+    int used;                       // a live thread writes here
+    size_t len;
+    struct buffer *link;
+    char data[ACCESSLOG_BUFFER];
+};
+
+// Headers that change what the server answers. Cookie and Authorization are
+// left out: a log of them would be a log of credentials.
+static const char *const kept[] = {"Accept", "Accept-Encoding", "Accept-Language", "Content-Type", "Range",
+                                   "If-Range", "If-None-Match", "If-Modified-Since"};
+
+#define VALUE_MAX 512               // longer header values are cut
+
+static int logFd = -1;
+static pthread_mutex_t buffersLock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer *buffers;      // every buffer this process made, reused but never freed
+static pid_t ownerPid;              // the process the buffers belong to, prefork workers start their own
+static pthread_key_t bufferKey;     // gives a buffer back when its thread ends
+static __thread struct buffer *mine;
+
+static void give_back(void *arg) {
+    struct buffer *b = arg;
+    __atomic_store_n(&b->used, 0, __ATOMIC_RELEASE);//what it holds goes out with the next flush
+}
+
+static void flush(struct buffer *b) {//caller holds b->lock
+    const char *p = b->data;
+    size_t left = b->len;
+    while (left > 0) {
+        ssize_t n = write(logFd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("writing access log");
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    b->len = 0;
+}
+
+static void flush_all(void) {
+    if (ownerPid != getpid()) return;//a forked copy: the records are the parent's to write, and the lock may be held for good
+    pthread_mutex_lock(&buffersLock);
+    for (struct buffer *b = buffers; b; b = b->link) {
+        pthread_mutex_lock(&b->lock);
+        if (b->len > 0) flush(b);
+        pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_unlock(&buffersLock);
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        nanosleep(&(struct timespec){1, 0}, NULL);
+        flush_all();
+    }
+    return NULL;
+}
+
+static void start_flusher(void) {//caller holds buffersLock
+    if (spawn_detached(flusher_main, NULL) != 0) logMsg("no access log flusher, records wait for a full buffer");
+}
+
+int accesslog_open(const char *file) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || pthread_key_create(&bufferKey, give_back) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {//a new log: the header first, later runs append behind it
+        char head[12];
+        uint32_t size = sizeof(struct accesslog_record);
+        memcpy(head, ACCESSLOG_MAGIC, 8);
+        memcpy(head + 8, &size, sizeof(size));
+        if (write(fd, head, sizeof(head)) != sizeof(head)) {
+            close(fd);
+            return -1;
+        }
+    }
+    logFd = fd;
+    atexit(flush_all);//a graceful stop or a worker exiting keeps everything
+    return 0;
+}
+
+int accesslog_enabled(void) {
+    return logFd >= 0;
+}
+
+struct accesslog_record *accesslog_request(const char *method, const char *target, const char *headers) {
+    size_t pathLen = strnlen(target, REQUEST_SIZE);
+    char lines[sizeof(kept) / sizeof(kept[0]) * (VALUE_MAX + 32)];
+    size_t headersLen = 0;
+    char value[VALUE_MAX];
+
+    for (size_t i = 0; i < sizeof(kept) / sizeof(kept[0]); i++) {
+        if (get_header(headers, kept[i], value, sizeof(value))) {
+            headersLen += snprintf(lines + headersLen, sizeof(lines) - headersLen, "%s: %s\r\n", kept[i], value);
+        }
+    }
+
+    size_t size = (sizeof(struct accesslog_record) + pathLen + headersLen + 7) & ~(size_t)7;
+    struct accesslog_record *r = calloc(1, size);
+    if (!r) return NULL;
+    r->size = size;
+    r->pathLen = pathLen;
+    r->headersLen = headersLen;
+    strncpy(r->method, method, sizeof(r->method) - 1);
+    if (get_header(headers, "Content-Length", value, sizeof(value))) r->requestBody = strtoull(value, NULL, 10);
+    memcpy(r + 1, target, pathLen);
+    memcpy((char *)(r + 1) + pathLen, lines, headersLen);
+    return r;
+}
+
+static struct buffer *my_buffer(void) {//claimed from a thread that ended, or new
+    pid_t pid = getpid();
+    if (mine && ownerPid == pid) return mine;
+    pthread_mutex_lock(&buffersLock);
+    if (ownerPid != pid) {//first record in this process: what was inherited stays with the parent
+        buffers = NULL;
+        mine = NULL;
+        ownerPid = pid;
+        start_flusher();
+    }
+    for (struct buffer *b = buffers; b && !mine; b = b->link) {
+        if (__atomic_exchange_n(&b->used, 1, __ATOMIC_ACQUIRE) == 0) mine = b;
+    }
+    if (!mine && (mine = calloc(1, sizeof(*mine)))) {
+        pthread_mutex_init(&mine->lock, NULL);
+        mine->used = 1;
+        mine->link = buffers;
+        buffers = mine;
+    }
+    pthread_mutex_unlock(&buffersLock);
+    if (mine) pthread_setspecific(bufferKey, mine);
+    return mine;
+}
+
+void accesslog_write(const struct accesslog_record *r) {
+    struct buffer *b = my_buffer();
+    if (!b || r->size > sizeof(b->data)) return;
+    pthread_mutex_lock(&b->lock);
+    if (b->len + r->size > sizeof(b->data)) flush(b);//whole records only, appends from several processes interleave cleanly
+    memcpy(b->data + b->len, r, r->size);
+    b->len += r->size;
+    pthread_mutex_unlock(&b->lock);
+}
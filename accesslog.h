@@ -0,0 +1,48 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+
+// Binary access log, for replaying real traffic against a later build (see
+// replay.c). Every request that gets as far as a method and a target is
+// written when it ends: what was asked, with the headers that change the
+// answer, and what went back. Records collect in a buffer per thread that is
+// appended to the file when full and once a second, so a server killed
+// outright loses at most the last second.
+//
+// The file starts with the 8-byte magic and the size of struct
+// accesslog_record as a uint32_t; records follow in the order they ended,
+// host byte order.
+
+#define ACCESSLOG_MAGIC "HSALOG01"
+
+// Per-thread buffer, written out whole
+#define ACCESSLOG_BUFFER (64 * 1024)
+
+// Followed by pathLen bytes of request target, then headersLen bytes of
+// "Name: value\r\n" lines, then zeros up to size
+struct accesslog_record {
+    uint64_t start;             // CLOCK_REALTIME ns the connection was accepted, or the request began
+    uint64_t duration;          // ns from start until the response was out
+    uint64_t requestBody;       // Content-Length of the request
+    uint64_t responseBody;      // bytes sent after the response header
+    uint32_t size;              // of the record with its strings, a multiple of 8
+    uint16_t status;            // 0 when the response did not pass through the server (CGI writing to the client)
+    uint16_t pathLen;
+    uint16_t headersLen;
+    char method[14];            // NUL padded
+};
+
+// Append to file, created if need be. Returns 0, or -1 with errno set.
+int accesslog_open(const char *file);
+
+int accesslog_enabled(void);
+
+// A record for method and target with the replayable headers picked out of
+// headers; malloc()ed, NULL if memory ran out
+struct accesslog_record *accesslog_request(const char *method, const char *target, const char *headers);
+
+// Queue r (start, duration, status and responseBody filled in) for the file
+void accesslog_write(const struct accesslog_record *r);
+
+#endif // ACCESSLOG_H
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "httpserve.h"
+#include "admit.h"
+
+// Two gates in front of the handlers. The in-flight cap bounds how much
+// accepted work can pile up at all; CoDel (RFC 8289) watches how long
+// connections sit in the queue before a worker picks them up and, once
+// that delay has stayed above target for a full interval, sheds at a rate
+// that grows with the square root of the drop count until the queue drains.
+// Shed clients get a 503 that was rendered once at startup.
+
+#define NS_PER_MS 1000000ULL
+#define TARGET_NS (ADMIT_TARGET_MS * NS_PER_MS)
+#define INTERVAL_NS (ADMIT_INTERVAL_MS * NS_PER_MS)
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+static const char overloaded[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Retry-After: " STR(ADMIT_RETRY_AFTER) "\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "503 Server Overload\n";
+
+static int maxInflight;
+static int inflight;
+
+static struct {//CoDel state, shared by every worker that dequeues
+    pthread_mutex_t lock;
+    uint64_t firstAbove;     // when the delay will have been above target for an interval, 0 if below
+    uint64_t dropNext;
+    unsigned count;          // drops in this dropping state
+    unsigned lastCount;
+    int dropping;
+} C = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void admit_init(int max) {
+    maxInflight = max;
+}
+
+uint64_t admit_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int admit_accept(void) {
+    int now = __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+    if (maxInflight > 0 && now > maxInflight) {
+        __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+void admit_done(void) {
+    __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned isqrt(unsigned n) {
+    unsigned r = 0, bit = 1u << 30;
+    while (bit > n) bit >>= 2;
+    while (bit) {
+        if (n >= r + bit) {
+            n -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+static uint64_t control_law(uint64_t t, unsigned count) {//next drop comes sooner the longer the queue stands
+    return t + INTERVAL_NS / (isqrt(count) ? isqrt(count) : 1);
+}
+
+int admit_dequeue(uint64_t acceptedAt) {
+    uint64_t now = admit_now();
+    uint64_t sojourn = now - acceptedAt;
+    int shed = 0, okToDrop = 0;
+
+    pthread_mutex_lock(&C.lock);
+    if (sojourn < TARGET_NS) {
+        C.firstAbove = 0;
+    } else if (C.firstAbove == 0) {
+        C.firstAbove = now + INTERVAL_NS;
+    } else if (now >= C.firstAbove) {
+        okToDrop = 1;
+    }
+
+    if (C.dropping) {
+        if (!okToDrop) {
+            C.dropping = 0;
+        } else if (now >= C.dropNext) {
+            shed = 1;
+            C.count++;
+            C.dropNext = control_law(C.dropNext, C.count);
+        }
+    } else if (okToDrop) {//enter the dropping state, resuming the old rate if it was recent
+        shed = 1;
+        C.dropping = 1;
+        unsigned delta = C.count - C.lastCount;
+        C.count = delta > 1 && now - C.dropNext < 16 * INTERVAL_NS ? delta : 1;
+        C.lastCount = C.count;
+        C.dropNext = control_law(now, C.count);
+    }
+    int entered = shed && C.count == 1;
+    pthread_mutex_unlock(&C.lock);
+
+    if (entered) {
+        char lgbuff[96];
+        snprintf(lgbuff, sizeof(lgbuff), "overloaded: queue delay %llu ms, shedding", (unsigned long long)(sojourn / NS_PER_MS));
+        logMsg(lgbuff);
+    }
+    return shed ? -1 : 0;
+}
+
+void admit_shed(int client_sock) {
+    admit_refuse(client_sock, overloaded, sizeof(overloaded) - 1);
+}
+
+void admit_refuse(int client_sock, const char *response, int len) {
+    char discard[REQUEST_SIZE];
+
+    send(client_sock, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(client_sock, SHUT_WR);
+    while (recv(client_sock, discard, sizeof(discard), MSG_DONTWAIT) > 0) {//unread bytes would turn close() into a reset that eats the 503
+    }
+    close(client_sock);
+}
@@ -0,0 +1,36 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdint.h>
+
+// CoDel parameters: shed once connections have waited longer than
+// ADMIT_TARGET_MS to be picked up for a whole ADMIT_INTERVAL_MS
+#define ADMIT_TARGET_MS 5
+#define ADMIT_INTERVAL_MS 100
+
+// Seconds sent in Retry-After with a shed request
+#define ADMIT_RETRY_AFTER 1
+
+// Cap on connections accepted and not yet closed, 0 for none
+void admit_init(int maxInflight);
+
+// Monotonic clock in nanoseconds, for stamping accepted connections
+uint64_t admit_now(void);
+
+// At accept: 0 to admit, -1 when the in-flight cap is reached and the
+// connection has to be shed. Every admitted connection ends with admit_done().
+int admit_accept(void);
+void admit_done(void);
+
+// When a queued connection is picked up: 0 to serve it, -1 when the queue
+// has been standing too long (CoDel) and this one should be shed.
+int admit_dequeue(uint64_t acceptedAt);
+
+// Answer with the pre-rendered 503 and close, without reading the request
+void admit_shed(int client_sock);
+
+// Same for any short canned response: send it, half-close, discard what the
+// client sent so close() does not reset the connection, close
+void admit_refuse(int client_sock, const char *response, int len);
+
+#endif // ADMIT_H
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "httpserve.h"
+#include "docroot.h"
+#include "router.h"
+#include "outq.h"
+#include "fileinfo.h"
+#include "autoindex.h"
+
+enum { FORMAT_HTML, FORMAT_JSON, FORMATS };
+
+struct entry {
+    const char *name;               // in the listing's names block
+    struct stat st;
+};
+
+struct page {                       // rendered once, shared by every response sending it
+    int refs;                       // the listing's plus one per response in flight
+    size_t len;
+    char *body;
+};
+
+struct listing {
+    char *path;                     // request path, with the trailing slash
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int wd;                         // inotify watch, -1 where none could be set
+    int stale;                      // inotify saw a change
+    struct entry *entries;          // sorted by name
+    size_t count;
+    char *names;
+    struct page **pages;            // FORMATS per page, rendered when first asked for
+    size_t pageCount;
+    unsigned long used;             // LRU tick
+    struct listing *next;
+};
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY | \
+                    IN_DELETE_SELF | IN_MOVE_SELF)
+
+// One lock for the lot. A rescan holds other listings back while it runs,
+// which also keeps a burst of hits on a changed directory to a single scan.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct listing *listings;
+static int listingCount;
+static unsigned long tick;
+static int notifyFd = -1;
+static int enabled;
+
+void autoindex_enable(void) {
+    notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);//without it every hit compares the mtime
+    enabled = 1;
+}
+
+int autoindex_enabled(void) {
+    return enabled;
+}
+
+static void page_put(void *arg) {
+    struct page *p = arg;
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free(p->body);
+    free(p);
+}
+
+static int watched(int wd) {//caller holds lock: by a listing still linked
+    for (struct listing *l = listings; l; l = l->next) {
+        if (l->wd == wd) return 1;
+    }
+    return 0;
+}
+
+static void drop(struct listing *l) {//caller holds lock and has unlinked l
+    if (l->wd >= 0 && !watched(l->wd)) inotify_rm_watch(notifyFd, l->wd);//one watch per inode, another path to it may share it
+    for (size_t i = 0; i < FORMATS * l->pageCount; i++) {
+        if (l->pages[i]) page_put(l->pages[i]);
+    }
+    free(l->pages);
+    free(l->entries);
+    free(l->names);
+    free(l->path);
+    free(l);
+    listingCount--;
+}
+
+static void unlink_listing(struct listing *l) {
+    for (struct listing **pp = &listings; *pp; pp = &(*pp)->next) {
+        if (*pp == l) {
+            *pp = l->next;
+            drop(l);
+            return;
+        }
+    }
+}
+
+static void drain_events(void) {//mark what inotify reported on as stale
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while (notifyFd >= 0 && (n = read(notifyFd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const void *)p;
+            for (struct listing *l = listings; l; l = l->next) {
+                if (l->wd != ev->wd) continue;
+                l->stale = 1;
+                if (ev->mask & IN_IGNORED) l->wd = -1;//the watch is gone with the directory
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((const struct entry *)a)->name, ((const struct entry *)b)->name);
+}
+
+static struct listing *scan(int dirFd, const char *path, const struct stat *st) {//NULL with errno set
+    struct listing *l = calloc(1, sizeof(*l));
+    if (!l || !(l->path = strdup(path))) {
+        free(l);
+        return NULL;
+    }
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    l->mtime = st->st_mtim;
+    l->wd = -1;
+    listingCount++;//drop() counts it out again
+
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirFd);
+    if (notifyFd >= 0) l->wd = inotify_add_watch(notifyFd, proc, WATCH_MASK);//before reading: a change from here on marks it
+
+    int fd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);//a descriptor of its own, readdir moves the offset
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        drop(l);
+        errno = err;
+        return NULL;
+    }
+
+    size_t cap = 0, namesLen = 0, namesCap = 0;
+    size_t *offsets = NULL;//names move while the block grows, pointers are set at the end
+    struct dirent *de;
+    int failed = 0;
+    while (!failed && (de = readdir(d))) {
+        if (de->d_name[0] == '.') continue;//dotfiles, upload temporaries, "." and ".."
+        struct stat est;
+        if (fstatat(fd, de->d_name, &est, 0) < 0) continue;//dangling symlink, or gone already
+
+        size_t len = strlen(de->d_name) + 1;
+        if (l->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct entry *e = realloc(l->entries, cap * sizeof(*e));
+            size_t *o = realloc(offsets, cap * sizeof(*o));
+            if (e) l->entries = e;
+            if (o) offsets = o;
+            if (!e || !o) failed = 1;
+        }
+        if (namesLen + len > namesCap) {
+            namesCap = namesCap ? namesCap * 2 : 4096;
+            while (namesCap < namesLen + len) namesCap *= 2;
+            char *grown = realloc(l->names, namesCap);
+            if (grown) l->names = grown;
+            else failed = 1;
+        }
+        if (failed) break;
+        memcpy(l->names + namesLen, de->d_name, len);
+        offsets[l->count] = namesLen;
+        l->entries[l->count++].st = est;
+        namesLen += len;
+    }
+    closedir(d);
+
+    for (size_t i = 0; i < l->count; i++) l->entries[i].name = l->names + offsets[i];
+    free(offsets);
+    qsort(l->entries, l->count, sizeof(*l->entries), by_name);
+
+    l->pageCount = l->count ? (l->count + AUTOINDEX_PAGE - 1) / AUTOINDEX_PAGE : 1;//an empty directory still has its page
+    if (failed || !(l->pages = calloc(FORMATS * l->pageCount, sizeof(*l->pages)))) {
+        drop(l);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return l;
+}
+
+static void html_text(FILE *out, const char *s) {
+    for (; *s; s++) {
+        switch (*s) {
+        case '&': fputs("&amp;", out); break;
+        case '<': fputs("&lt;", out); break;
+        case '>': fputs("&gt;", out); break;
+        case '"': fputs("&quot;", out); break;
+        default: fputc(*s, out);
+        }
+    }
+}
+
+static void href(FILE *out, const char *s) {//percent-encoded, so names with '?', '#' or spaces still link
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~", c)) fputc(c, out);
+        else fprintf(out, "%%%02X", c);
+    }
+}
+
+static void render_html(FILE *out, const struct listing *l, size_t page) {
+    fputs("<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ", out);
+    html_text(out, l->path);
+    fputs("</title></head><body>\n<h1>Index of ", out);
+    html_text(out, l->path);
+    fputs("</h1>\n<table>\n<tr><th>Name</th><th>Size</th><th>Modified</th><th>Permissions</th></tr>\n", out);
+    if (strcmp(l->path, "/") != 0) fputs("<tr><td><a href=\"../\">../</a></td><td></td><td></td><td></td></tr>\n", out);
+
+    size_t first = (page - 1) * AUTOINDEX_PAGE, last = first + AUTOINDEX_PAGE < l->count ? first + AUTOINDEX_PAGE : l->count;
+    for (size_t i = first; i < last; i++) {
+        const struct entry *e = &l->entries[i];
+        int dir = S_ISDIR(e->st.st_mode);
+        char size[32], modified[32], permissions[11];
+        struct tm tm;
+        if (dir) strcpy(size, "-");
+        else fileinfo_size(e->st.st_size, 1, size, sizeof(size));
+        strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", gmtime_r(&e->st.st_mtime, &tm));
+        fileinfo_permissions(e->st.st_mode, permissions);
+
+        fputs("<tr><td><a href=\"", out);
+        href(out, e->name);
+        fputs(dir ? "/\">" : "\">", out);
+        html_text(out, e->name);
+        fprintf(out, "%s</a></td><td>%s</td><td>%s</td><td>%s</td></tr>\n", dir ? "/" : "", size, modified, permissions);
+    }
+    fprintf(out, "</table>\n<p>%zu entries, page %zu of %zu", l->count, page, l->pageCount);
+    if (page > 1) fprintf(out, " <a href=\"?page=%zu\">previous</a>", page - 1);
+    if (page < l->pageCount) fprintf(out, " <a href=\"?page=%zu\">next</a>", page + 1);
+    fputs("</p>\n</body></html>\n", out);
+}
+
+static void render_json(FILE *out, const struct listing *l, size_t page) {
+    char buf[2048];
+    fileinfo_escape(buf, sizeof(buf), l->path);
+    fprintf(out, "{\"path\":\"%s\",\"page\":%zu,\"pages\":%zu,\"total\":%zu,\"entries\":[", buf, page, l->pageCount,
+            l->count);
+
+    size_t first = (page - 1) * AUTOINDEX_PAGE, last = first + AUTOINDEX_PAGE < l->count ? first + AUTOINDEX_PAGE : l->count;
+    for (size_t i = first; i < last; i++) {
+        fileinfo_json(buf, sizeof(buf), l->entries[i].name, &l->entries[i].st);
+        fprintf(out, "%s\n%s", i > first ? "," : "", buf);
+    }
+    fputs("]}\n", out);
+}
+
+static struct page *render(const struct listing *l, size_t page, int format) {
+    struct page *p = calloc(1, sizeof(*p));
+    FILE *out = p ? open_memstream(&p->body, &p->len) : NULL;
+    if (!out) {
+        free(p);
+        return NULL;
+    }
+    if (format == FORMAT_JSON) render_json(out, l, page);
+    else render_html(out, l, page);
+    if (fclose(out) != 0) {
+        free(p->body);
+        free(p);
+        return NULL;
+    }
+    p->refs = 1;//the listing's
+    return p;
+}
+
+static struct listing *lookup(int dirFd, const char *path, const struct stat *st) {//caller holds lock
+    drain_events();
+    struct listing *l = listings;
+    while (l && strcmp(l->path, path) != 0) l = l->next;
+
+    if (l && !l->stale && l->dev == st->st_dev && l->ino == st->st_ino &&
+        (l->wd >= 0 || (l->mtime.tv_sec == st->st_mtim.tv_sec && l->mtime.tv_nsec == st->st_mtim.tv_nsec))) {
+        return l;
+    }
+    if (l) unlink_listing(l);//old watch first, the rescan sets its own
+
+    if (!(l = scan(dirFd, path, st))) return NULL;
+    l->next = listings;
+    listings = l;
+    while (listingCount > AUTOINDEX_DIRS) {//least recently listed goes
+        struct listing *oldest = listings;
+        for (struct listing *o = listings; o; o = o->next) {
+            if (o->used < oldest->used) oldest = o;
+        }
+        if (oldest == l) break;
+        unlink_listing(oldest);
+    }
+    return l;
+}
+
+static size_t query_page(const char *query) {//1 without one, 0 when it is not a page number
+    for (const char *p = query; p; p = strchr(p, '&')) {
+        if (*p == '&') p++;
+        if (strncmp(p, "page=", 5) != 0) continue;
+        char *end;
+        unsigned long long n = strtoull(p + 5, &end, 10);
+        return (*end == '\0' || *end == '&') && n > 0 ? (size_t)n : 0;
+    }
+    return 1;
+}
+
+static int wants_json(const struct request *req) {
+    char accept[256];
+    if (req->query && strstr(req->query, "format=json")) return 1;
+    if (req->query && strstr(req->query, "format=html")) return 0;
+    return get_header(req->headers, "Accept", accept, sizeof(accept)) && strstr(accept, "application/json");
+}
+
+static void respond(int sock, const char *response) {
+    outq_send(sock, response, strlen(response));
+}
+
+int autoindex_serve(const struct request *req) {
+    size_t pathLen = strlen(req->path);
+    if (!enabled || docroot_fd() < 0 || strcmp(req->path, "/") == 0) return 0;//"/" is index.html
+    if (get_mime_type(req->path) && req->path[pathLen - 1] != '/') return 0;//named like a file: not worth a lookup
+
+    int err;
+    struct docroot_entry *dir = docroot_get(req->path, &err);
+    if (!dir) return 0;
+    if (!S_ISDIR(dir->st.st_mode)) {
+        docroot_put(dir);
+        return 0;
+    }
+
+    if (req->path[pathLen - 1] != '/') {//relative links in the listing need the slash
+        char response[REQUEST_SIZE + 128];
+        size_t targetLen = strcspn(req->target, "?");
+        snprintf(response, sizeof(response), "HTTP/1.1 301 Moved Permanently\r\nLocation: %.*s/%s\r\nContent-Length: 0\r\n\r\n",
+                 (int)targetLen, req->target, req->target + targetLen);
+        respond(req->sock, response);
+        docroot_put(dir);
+        return 1;
+    }
+
+    struct stat st;
+    size_t page = query_page(req->query);
+    int format = wants_json(req) ? FORMAT_JSON : FORMAT_HTML;
+    if (fstat(dir->fd, &st) < 0) {//what the docroot cache has may be a second old
+        docroot_put(dir);
+        respond(req->sock, "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct listing *l = lookup(dir->fd, req->path, &st);
+    int scanErr = l ? 0 : errno;
+    struct page *p = NULL;
+    if (l && page >= 1 && page <= l->pageCount) {
+        l->used = ++tick;
+        struct page **slot = &l->pages[(page - 1) * FORMATS + format];
+        if (!*slot) *slot = render(l, page, format);
+        if ((p = *slot)) __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);//kept while it goes out, even if the listing is dropped
+    }
+    size_t pageCount = l ? l->pageCount : 0;
+    pthread_mutex_unlock(&lock);
+    docroot_put(dir);
+
+    if (!p) {
+        if (l && (page < 1 || page > pageCount)) respond(req->sock, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        else if (scanErr == EACCES) respond(req->sock, "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n");
+        else respond(req->sock, "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+        return 1;
+    }
+
+    char head[256];
+    int headLen = snprintf(head, sizeof(head),
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: %s\r\n"
+                           "Content-Length: %zu\r\n"
+                           "Cache-Control: no-cache\r\n"
+                           "Vary: Accept\r\n"
+                           "\r\n",
+                           format == FORMAT_JSON ? "application/json" : "text/html; charset=utf-8", p->len);
+    struct outq q;
+    outq_init(&q, req->sock);
+    outq_copy(&q, head, headLen);
+    if (req->method == ROUTER_HEAD) page_put(p);
+    else outq_mem(&q, p->body, p->len, page_put, p);
+    outq_finish(&q);
+    return 1;
+}
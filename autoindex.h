@@ -0,0 +1,31 @@
+#ifndef AUTOINDEX_H
+#define AUTOINDEX_H
+
+struct request;
+
+// Directory listings for GET and HEAD on a directory beneath the document
+// root, with --autoindex. A directory is read and every entry stat()ed once;
+// the sorted entries stay in memory with the pages rendered from them, and
+// later hits only check that nothing changed: inotify on the directory, or
+// its mtime where no watch could be set (that catches entries added,
+// removed or renamed, not a file changing size in place). Dotfiles are left
+// out.
+//
+// ?page=N (from 1) picks AUTOINDEX_PAGE entries in name order. HTML by
+// default, JSON with ?format=json or an Accept naming application/json:
+// {"path", "page", "pages", "total", "entries": [...]}, each entry as
+// inspect --json prints a file (fileinfo.h).
+
+#define AUTOINDEX_PAGE 1000
+
+// Directories kept, the least recently listed goes first
+#define AUTOINDEX_DIRS 64
+
+void autoindex_enable(void);
+int autoindex_enabled(void);
+
+// Answer req if its path is a directory, a redirect to path/ if the slash is
+// missing. Returns 1 if it did, 0 to leave req to the file handlers.
+int autoindex_serve(const struct request *req);
+
+#endif // AUTOINDEX_H
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "httpserve.h"
+#include "wheel.h"
+#include "co.h"
+#include "cgicache.h"
+
+struct cgicache_slot {
+    char *key;
+    uint64_t hash;
+    struct cgicache_response *resp;     // latest run that may be served, NULL if none
+    time_t expires;                     // monotonic seconds
+    int filling;                        // a run is under way
+    int cacheable;                      // the last run said so: worth waiting for
+    int waiters;
+    unsigned generation;                // completed runs, waiters watch it move
+    struct cgicache_slot *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    struct cgicache_slot *buckets[CGICACHE_BUCKETS];
+    int slots;
+    size_t bytes, maxBytes;
+} C = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, 0, 0};
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t hash_key(const char *key) {//FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (; *key; key++) h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+    return h;
+}
+
+void cgicache_init(size_t maxBytes) {
+    C.maxBytes = maxBytes;
+}
+
+int cgicache_enabled(void) {
+    return C.maxBytes > 0;
+}
+
+// The whole value of the one name line in headers: *len 0 and NULL if there
+// is none, -1 if the name repeats (a second Cookie line would be left out)
+static const char *key_value(const char *headers, const char *name, int *len) {
+    size_t nameLen = strlen(name);
+    const char *found = NULL;
+    *len = 0;
+    for (const char *line = headers; line && *line && *line != '\r' && *line != '\n';) {
+        if (strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':') {
+            if (found) {
+                *len = -1;
+                return NULL;
+            }
+            found = line + nameLen + 1;
+            while (*found == ' ' || *found == '\t') found++;
+            size_t n = strcspn(found, "\r\n");
+            while (n > 0 && (found[n - 1] == ' ' || found[n - 1] == '\t')) n--;
+            *len = n;
+        }
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    return found;
+}
+
+int cgicache_key(char *out, size_t room, const char *method, const char *path, const char *headers) {
+    static const char *const names[] = CGICACHE_KEY_HEADERS;
+    int len = snprintf(out, room, "%s %s", method, path);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]) && len >= 0 && (size_t)len < room; i++) {
+        int valueLen;
+        const char *value = key_value(headers, names[i], &valueLen);
+        if (valueLen < 0) return -1;//repeated: two users could differ only in the line left out
+        if (value) len += snprintf(out + len, room - len, "\n%s: %.*s", names[i], valueLen, value);
+    }
+    return len >= 0 && (size_t)len < room ? len : -1;//never cut: a longer value would share the key of its prefix
+}
+
+void cgicache_release(struct cgicache_response *resp) {
+    if (!resp || __atomic_sub_fetch(&resp->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    close(resp->fd);
+    free(resp);
+}
+
+static void drop_response(struct cgicache_slot *s) {//lock held
+    if (!s->resp) return;
+    C.bytes -= s->resp->size;
+    cgicache_release(s->resp);
+    s->resp = NULL;
+}
+
+static void evict(time_t now) {//lock held: expired responses go, and slots nobody uses
+    for (int i = 0; i < CGICACHE_BUCKETS; i++) {
+        for (struct cgicache_slot **p = &C.buckets[i]; *p;) {
+            struct cgicache_slot *s = *p;
+            if (s->filling || s->waiters || now < s->expires) {
+                p = &s->next;
+                continue;
+            }
+            drop_response(s);
+            *p = s->next;
+            free(s->key);
+            free(s);
+            C.slots--;
+        }
+    }
+}
+
+static struct cgicache_slot *find(const char *key, uint64_t hash) {//lock held
+    for (struct cgicache_slot *s = C.buckets[hash % CGICACHE_BUCKETS]; s; s = s->next) {
+        if (s->hash == hash && strcmp(s->key, key) == 0) return s;
+    }
+    return NULL;
+}
+
+int cgicache_lookup(const char *key, struct cgicache_response **resp, struct cgicache_slot **slot) {
+    uint64_t hash = hash_key(key);
+    time_t now = now_secs();
+    *resp = NULL;
+    *slot = NULL;
+
+    pthread_mutex_lock(&C.lock);
+    struct cgicache_slot *s = find(key, hash);
+    if (!s) {
+        if (C.slots >= CGICACHE_SLOTS) evict(now);
+        if (C.slots >= CGICACHE_SLOTS || !(s = calloc(1, sizeof(*s))) || !(s->key = strdup(key))) {
+            free(s);
+            pthread_mutex_unlock(&C.lock);
+            return CGICACHE_BYPASS;
+        }
+        s->hash = hash;
+        s->next = C.buckets[hash % CGICACHE_BUCKETS];
+        C.buckets[hash % CGICACHE_BUCKETS] = s;
+        C.slots++;
+    }
+
+    if (s->resp && now < s->expires) {
+        __atomic_add_fetch(&s->resp->refs, 1, __ATOMIC_RELAXED);
+        *resp = s->resp;
+        pthread_mutex_unlock(&C.lock);
+        return CGICACHE_HIT;
+    }
+    if (!s->filling) {//stale or never run: this request runs the script
+        s->filling = 1;
+        *slot = s;
+        pthread_mutex_unlock(&C.lock);
+        return CGICACHE_FILL;
+    }
+    if (!s->cacheable) {//a POST nobody said is safe to share: never coalesced
+        pthread_mutex_unlock(&C.lock);
+        return CGICACHE_BYPASS;
+    }
+
+    unsigned generation = s->generation;//same request already running: wait for its output
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CGICACHE_WAIT_SECS;
+    s->waiters++;
+    int err = 0;
+    while (s->generation == generation && err != ETIMEDOUT) {
+        if (co_active()) {//the run may be a coroutine of this very thread: yield to it and look again
+            pthread_mutex_unlock(&C.lock);
+            co_sleep(WHEEL_TICK_MS);
+            pthread_mutex_lock(&C.lock);
+            if (now_secs() - now >= CGICACHE_WAIT_SECS) err = ETIMEDOUT;
+        } else {
+            err = pthread_cond_timedwait(&C.filled, &C.lock, &deadline);
+        }
+    }
+    s->waiters--;
+
+    int rc = CGICACHE_BYPASS;
+    if (s->generation != generation && s->resp) {//the run we waited for left something to share
+        __atomic_add_fetch(&s->resp->refs, 1, __ATOMIC_RELAXED);
+        *resp = s->resp;
+        rc = CGICACHE_HIT;
+    }
+    pthread_mutex_unlock(&C.lock);
+    return rc;
+}
+
+struct cgicache_response *cgicache_fill(struct cgicache_slot *slot, int fd, off_t size, int ttl) {
+    struct cgicache_response *resp = NULL;
+    if (fd >= 0 && (resp = malloc(sizeof(*resp)))) {
+        resp->fd = fd;
+        resp->size = size;
+        resp->refs = 1;//the caller's
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    time_t now = now_secs();
+
+    pthread_mutex_lock(&C.lock);
+    drop_response(slot);
+    slot->cacheable = resp && ttl > 0 && size <= CGICACHE_ENTRY_MAX;
+    if (slot->cacheable) {
+        if (C.bytes + size > C.maxBytes) evict(now);
+        if (C.bytes + size > C.maxBytes) ttl = 0;//no room: only the requests already waiting get it
+        __atomic_add_fetch(&resp->refs, 1, __ATOMIC_RELAXED);
+        slot->resp = resp;
+        C.bytes += size;
+    }
+    slot->expires = now + ttl;
+    slot->filling = 0;
+    slot->generation++;
+    pthread_cond_broadcast(&C.filled);
+    pthread_mutex_unlock(&C.lock);
+    return resp;
+}
+
+int cgicache_ttl(const char *head) {
+    const char *headers = head;
+    if (strncmp(head, "HTTP/", 5) == 0) {//full status line, or straight into CGI headers
+        headers = strchr(head, '\n');
+        headers = headers ? headers + 1 : "";
+    }
+
+    char value[256];
+    if (!get_header(headers, "Cache-Control", value, sizeof(value))) return 0;//dynamic output is only kept on request
+
+    int ttl = 0, shared = -1;
+    for (char *saveptr, *tok = strtok_r(value, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        while (*tok == ' ' || *tok == '\t') tok++;
+        if (strncasecmp(tok, "no-store", 8) == 0 || strncasecmp(tok, "private", 7) == 0 || strncasecmp(tok, "no-cache", 8) == 0) return 0;
+        if (strncasecmp(tok, "max-age=", 8) == 0) ttl = atoi(tok + 8);
+        else if (strncasecmp(tok, "s-maxage=", 9) == 0) shared = atoi(tok + 9);//meant for shared caches like this one
+    }
+    if (shared >= 0) ttl = shared;
+    return ttl > 0 ? ttl : 0;
+}
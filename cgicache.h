@@ -0,0 +1,63 @@
+#ifndef CGICACHE_H
+#define CGICACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Micro-cache for CGI output. A script opts in per response with
+// Cache-Control: max-age (or s-maxage). Once a request is known to be
+// cacheable, identical requests arriving while it is refreshed wait for that
+// one run instead of starting their own.
+
+// Hash buckets, and most distinct requests tracked at once
+#define CGICACHE_BUCKETS 1024
+#define CGICACHE_SLOTS 4096
+
+// Largest response kept, and how long a request waits on someone else's run
+#define CGICACHE_ENTRY_MAX (1024 * 1024)
+#define CGICACHE_WAIT_SECS 30
+
+// Request headers that are part of the key besides method and path
+#define CGICACHE_KEY_HEADERS {"Accept", "Accept-Encoding", "Accept-Language", "Authorization", "Cookie"}
+
+// A complete response, head included, in a memfd. Shared between requests,
+// so only positional I/O (sendfile with an offset, pread) may be used on fd.
+struct cgicache_response {
+    int fd;
+    off_t size;
+    int refs;
+};
+
+struct cgicache_slot;
+
+enum { CGICACHE_HIT, CGICACHE_FILL, CGICACHE_BYPASS };
+
+// Cap on the bytes of cached responses; 0 leaves the cache off
+void cgicache_init(size_t maxBytes);
+int cgicache_enabled(void);
+
+// Build the key of a request into out, with the key headers' whole values.
+// Returns its length, or -1 if it does not fit or a key header appears more
+// than once, and the request should not be cached.
+int cgicache_key(char *out, size_t room, const char *method, const char *path, const char *headers);
+
+// CGICACHE_HIT with a referenced *resp to send: a fresh entry, or the result
+// of a concurrent run this request waited for. CGICACHE_FILL when the caller
+// has to run the script and hand the output to cgicache_fill(*slot, ...).
+// CGICACHE_BYPASS to run it without the cache: another run of a request not
+// known to be cacheable is under way, or the table is full.
+int cgicache_lookup(const char *key, struct cgicache_response **resp, struct cgicache_slot **slot);
+
+// Publish a run's output: fd (taken over; -1 if the run failed) holding
+// size bytes, kept and handed to waiting requests if ttl is positive.
+// Returns a referenced response for the caller to send, or NULL.
+struct cgicache_response *cgicache_fill(struct cgicache_slot *slot, int fd, off_t size, int ttl);
+
+// Drop a reference
+void cgicache_release(struct cgicache_response *resp);
+
+// Seconds a CGI response may be cached for according to its head; 0 if it
+// may not be (no Cache-Control, private, no-store or no-cache)
+int cgicache_ttl(const char *head);
+
+#endif // CGICACHE_H
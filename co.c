@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "wheel.h"
+#include "co.h"
+
+// x86-64 switches stacks by hand: six pushes, a pointer swap and six pops,
+// no signal mask syscall. Other machines fall back to swapcontext().
+#if defined(__x86_64__)
+#define CO_ASM 1
+#else
+#define CO_ASM 0
+#include <ucontext.h>
+#endif
+
+struct co {
+    struct timer timer;     // first, so a fired timer is the coroutine itself
+    void (*fn)(void *);
+    void *arg;
+    char *stack;            // mapping, guard page at its low end
+#if CO_ASM
+    void *sp;
+#else
+    ucontext_t ctx;
+#endif
+    void *local;            // co_local()
+    int timedOut;
+    int queued;
+    int done;
+    struct co *next;        // run queue
+};
+
+struct sched {
+    int ep;                 // descriptors coroutines wait on, one shot each
+    struct wheel wheel;     // their deadlines and sleeps
+    struct co *current;
+    struct co *runHead, *runTail;
+    int alive;
+#if CO_ASM
+    void *mainSp;
+#else
+    ucontext_t mainCtx;
+#endif
+    int freeCount;
+    char *freeStacks[CO_STACK_POOL];
+};
+
+static __thread struct sched *S;
+static __thread void *threadLocal;  // co_local() outside a coroutine
+static size_t pageSize;
+
+#if CO_ASM
+// Save callee-saved registers on this stack and its pointer in *save, then
+// pick up the other stack where it left off (or at entry() the first time)
+void co_switch(void **save, void *load);
+__asm__(".text\n"
+        ".globl co_switch\n"
+        ".hidden co_switch\n"
+        ".type co_switch, @function\n"
+        "co_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size co_switch, .-co_switch\n");
+#endif
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct sched *sched(void) {//this thread's, made on first use
+    if (S) return S;
+    struct sched *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    if ((s->ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(s);
+        return NULL;
+    }
+    wheel_init(&s->wheel, now_ms());
+    if (!pageSize) pageSize = sysconf(_SC_PAGESIZE);
+    return S = s;
+}
+
+static char *take_stack(void) {
+    if (S->freeCount > 0) return S->freeStacks[--S->freeCount];
+    char *m = mmap(NULL, CO_STACK_SIZE + pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (m == MAP_FAILED) return NULL;
+    mprotect(m, pageSize, PROT_NONE);//an overflow faults instead of running into the next stack
+    return m;
+}
+
+static void give_stack(char *m) {
+    if (S->freeCount < CO_STACK_POOL) S->freeStacks[S->freeCount++] = m;
+    else munmap(m, CO_STACK_SIZE + pageSize);
+}
+
+static void enqueue(struct co *c) {
+    if (c->queued) return;
+    c->queued = 1;
+    c->next = NULL;
+    if (S->runTail) S->runTail->next = c;
+    else S->runHead = c;
+    S->runTail = c;
+}
+
+static void to_scheduler(struct co *c) {
+#if CO_ASM
+    co_switch(&c->sp, S->mainSp);
+#else
+    swapcontext(&c->ctx, &S->mainCtx);
+#endif
+}
+
+static void resume(struct co *c) {//from the scheduler, until c yields or ends
+    S->current = c;
+#if CO_ASM
+    co_switch(&S->mainSp, c->sp);
+#else
+    swapcontext(&S->mainCtx, &c->ctx);
+#endif
+    S->current = NULL;
+    if (c->done) {//off its stack now, so the stack can go
+        give_stack(c->stack);
+        free(c);
+        S->alive--;
+    }
+}
+
+static void entry(void) {
+    struct co *c = S->current;
+    c->fn(c->arg);
+    c->done = 1;
+    to_scheduler(c);//never comes back
+}
+
+int co_spawn(void (*fn)(void *), void *arg) {
+    if (!sched()) return -1;
+    struct co *c = calloc(1, sizeof(*c));
+    if (!c || !(c->stack = take_stack())) {
+        free(c);
+        return -1;
+    }
+    c->fn = fn;
+    c->arg = arg;
+
+#if CO_ASM
+    uintptr_t top = (uintptr_t)(c->stack + pageSize + CO_STACK_SIZE) & ~(uintptr_t)15;
+    void **sp = (void **)top - 8;//six registers, entry() as the return address, and a slot that aligns entry's frame
+    memset(sp, 0, 8 * sizeof(*sp));
+    sp[6] = (void *)entry;
+    c->sp = sp;
+#else
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack + pageSize;
+    c->ctx.uc_stack.ss_size = CO_STACK_SIZE;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, entry, 0);
+#endif
+
+    S->alive++;
+    if (S->current) enqueue(c);
+    else resume(c);
+    return 0;
+}
+
+int co_active(void) {
+    return S && S->current;
+}
+
+int co_wait(int fd, short events, int timeoutMs) {
+    if (!co_active()) {
+        struct pollfd p = {fd, events, 0};
+        return poll(&p, 1, timeoutMs);
+    }
+
+    struct co *c = S->current;
+    struct epoll_event ev = {.events = EPOLLONESHOT, .data.ptr = c};
+    if (events & POLLIN) ev.events |= EPOLLIN;
+    if (events & POLLOUT) ev.events |= EPOLLOUT;
+    if (epoll_ctl(S->ep, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+
+    c->timedOut = 0;
+    if (timeoutMs >= 0) wheel_add(&S->wheel, &c->timer, now_ms() + timeoutMs);
+    to_scheduler(c);
+    wheel_del(&c->timer);
+    epoll_ctl(S->ep, EPOLL_CTL_DEL, fd, NULL);//the number may belong to someone else by the next wait
+    return c->timedOut ? 0 : 1;
+}
+
+ssize_t co_read(int fd, void *buf, size_t len, int timeoutMs) {
+    for (;;) {
+        ssize_t n = co_active() ? recv(fd, buf, len, MSG_DONTWAIT) : read(fd, buf, len);
+        if (n < 0 && errno == ENOTSOCK) n = read(fd, buf, len);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        if (!co_active() || (errno != EAGAIN && errno != EWOULDBLOCK)) return -1;
+
+        int ready = co_wait(fd, POLLIN, timeoutMs);
+        if (ready == 0) errno = ETIMEDOUT;
+        if (ready <= 0) return -1;
+    }
+}
+
+pid_t co_wait_child(pid_t pid, int *status) {
+#ifdef SYS_pidfd_open
+    if (co_active()) {
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd >= 0) {//readable once the child has exited, then waitpid() returns at once
+            co_wait(pidfd, POLLIN, -1);
+            close(pidfd);
+        }
+    }
+#endif
+    pid_t r;
+    do {
+        r = waitpid(pid, status, 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+void co_sleep(int ms) {
+    if (!co_active()) {
+        nanosleep(&(struct timespec){ms / 1000, (ms % 1000) * 1000000L}, NULL);
+        return;
+    }
+    struct co *c = S->current;
+    wheel_add(&S->wheel, &c->timer, now_ms() + ms);
+    to_scheduler(c);
+}
+
+void **co_local(void) {
+    return co_active() ? &S->current->local : &threadLocal;
+}
+
+int co_fd(void) {
+    return sched() ? S->ep : -1;
+}
+
+static void expired(struct timer *t) {
+    struct co *c = (struct co *)t;
+    c->timedOut = 1;
+    enqueue(c);
+}
+
+int co_run(void) {
+    if (!S) return 0;
+    struct epoll_event events[64];
+    int n;
+    do {//everything ready is queued before anything runs, so no event outlives its coroutine
+        n = epoll_wait(S->ep, events, 64, 0);
+        for (int i = 0; i < n; i++) enqueue(events[i].data.ptr);
+    } while (n == 64);
+    wheel_advance(&S->wheel, now_ms(), expired);
+
+    while (S->runHead) {
+        struct co *c = S->runHead;
+        S->runHead = c->next;
+        if (!S->runHead) S->runTail = NULL;
+        c->queued = 0;
+        resume(c);
+    }
+    return S->alive;
+}
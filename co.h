@@ -0,0 +1,52 @@
+#ifndef CO_H
+#define CO_H
+
+#include <sys/types.h>
+
+// Stackful coroutines for the blocking handlers. Each request runs its
+// straight-line handler code on a small pooled stack of its own. Where that
+// code would block (a full socket, a slow client, a CGI child), it yields to
+// its thread's scheduler instead, so one thread multiplexes many requests.
+// Outside a coroutine the same calls simply block, so handlers need not know
+// which engine runs them.
+
+// Stack of one coroutine, plus a guard page below it
+#define CO_STACK_SIZE (256 * 1024)
+
+// Free stacks a thread keeps for reuse
+#define CO_STACK_POOL 64
+
+// Run fn(arg) as a coroutine of this thread until it first yields; called
+// from within a coroutine it is only queued. Returns -1 if no stack could
+// be had.
+int co_spawn(void (*fn)(void *), void *arg);
+
+// 1 inside a coroutine
+int co_active(void);
+
+// Wait for events (POLLIN, POLLOUT) on fd for up to timeoutMs, -1 for no
+// limit. Returns 1 when ready, 0 on timeout, -1 on error, like poll().
+int co_wait(int fd, short events, int timeoutMs);
+
+// read() that waits for data with co_wait(), each wait bounded by timeoutMs;
+// fails with ETIMEDOUT once one runs out
+ssize_t co_read(int fd, void *buf, size_t len, int timeoutMs);
+
+// waitpid(pid, status, 0), waiting on a pidfd where the kernel has them
+pid_t co_wait_child(pid_t pid, int *status);
+
+// Sleep for ms milliseconds, to the next tick of the scheduler's wheel
+void co_sleep(int ms);
+
+// Pointer-sized slot private to the running coroutine, or to the thread
+// outside one: per-request state that would otherwise sit in a thread-local
+// and be overwritten by whichever coroutine runs next
+void **co_local(void);
+
+// Scheduler, for the engine that owns the thread: a descriptor that turns
+// readable when a waiting coroutine can go on, and a pass that resumes every
+// coroutine that can and returns how many are still alive
+int co_fd(void);
+int co_run(void);
+
+#endif // CO_H
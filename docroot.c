@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include "docroot.h"
+
+static int rootFd = -1;
+static int haveOpenat2 = 1;//cleared the first time the kernel says no
+static struct docroot_entry *cache[DOCROOT_SETS][DOCROOT_WAYS];
+static unsigned long tick;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned hash_path(const char *s) {//FNV-1a
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int has_dotdot(const char *rel) {//any ".." path segment
+    const char *p = rel;
+    while (*p) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return 1;
+        p = strchr(p, '/');
+        if (!p) break;
+        p++;
+    }
+    return 0;
+}
+
+static int open_beneath(const char *rel, int flags) {
+    if (haveOpenat2) {//kernel keeps the walk inside the root, symlinks included
+        struct open_how how = {0};
+        how.flags = flags | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+        int fd = syscall(__NR_openat2, rootFd, rel, &how, sizeof(how));
+        if (fd >= 0) return fd;
+        if (errno == EXDEV || errno == ELOOP) {
+            errno = EACCES;
+            return -1;
+        }
+        if (errno != ENOSYS && errno != EPERM) return -1;
+        haveOpenat2 = 0;//old kernel or seccomp filter, use the lexical check from now on
+    }
+
+    if (has_dotdot(rel)) {
+        errno = EACCES;
+        return -1;
+    }
+    return openat(rootFd, rel, flags | O_CLOEXEC);
+}
+
+static const char *relative_path(const char *path) {//"/a/b" -> "a/b", "/" -> "index.html"
+    while (*path == '/') path++;
+    return *path ? path : "index.html";
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void entry_unref(struct docroot_entry *entry) {//caller holds cacheLock
+    if (--entry->refs == 0) {
+        close(entry->fd);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+int docroot_open(const char *dir) {
+    rootFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return rootFd < 0 ? -1 : 0;
+}
+
+int docroot_fd(void) {
+    return rootFd;
+}
+
+struct docroot_entry *docroot_get(const char *path, int *err) {
+    unsigned set = hash_path(path) & (DOCROOT_SETS - 1);
+    const char *rel = relative_path(path);
+    time_t now = now_secs();
+    struct docroot_entry *entry = NULL;
+
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < DOCROOT_WAYS; i++) {
+        if (cache[set][i] && strcmp(cache[set][i]->key, path) == 0) {
+            entry = cache[set][i];
+            entry->refs++;
+            entry->used = ++tick;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    if (entry && now - __atomic_load_n(&entry->checked, __ATOMIC_RELAXED) < DOCROOT_RECHECK_SECS) return entry;//fresh hit, no syscalls at all
+
+    if (entry) {//stale hit: one walk to see whether the name still points at the same file
+        struct stat st;
+        int fd = open_beneath(rel, O_PATH);
+        int same = fd >= 0 && fstat(fd, &st) == 0 && same_file(&st, &entry->st);
+        if (fd >= 0) close(fd);
+
+        if (same) {
+            __atomic_store_n(&entry->checked, now, __ATOMIC_RELAXED);//read outside the lock by fresh hits
+            return entry;
+        }
+        docroot_put(entry);
+    }
+
+    int fd = open_beneath(rel, O_RDONLY);//miss or changed: resolve from scratch
+    if (fd < 0) {
+        *err = errno;
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->key = strdup(path)) || fstat(fd, &entry->st) < 0) {
+        *err = entry && entry->key ? errno : ENOMEM;
+        if (entry) free(entry->key);
+        free(entry);
+        close(fd);
+        return NULL;
+    }
+    entry->fd = fd;
+    entry->refs = 2;//one for the cache, one for the caller
+    entry->checked = now;
+
+    pthread_mutex_lock(&cacheLock);
+    int victim = 0;
+    for (int i = 0; i < DOCROOT_WAYS; i++) {//replace the same key, else an empty way, else the LRU way
+        if (cache[set][i] && strcmp(cache[set][i]->key, path) == 0) {
+            victim = i;
+            break;
+        }
+        if (!cache[set][i] || (cache[set][victim] && cache[set][i]->used < cache[set][victim]->used)) {
+            victim = i;
+        }
+    }
+    if (cache[set][victim]) entry_unref(cache[set][victim]);
+    cache[set][victim] = entry;
+    entry->used = ++tick;
+    pthread_mutex_unlock(&cacheLock);
+
+    return entry;
+}
+
+void docroot_put(struct docroot_entry *entry) {
+    pthread_mutex_lock(&cacheLock);
+    entry_unref(entry);
+    pthread_mutex_unlock(&cacheLock);
+}
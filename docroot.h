@@ -0,0 +1,42 @@
+#ifndef DOCROOT_H
+#define DOCROOT_H
+
+#include <sys/stat.h>
+#include <time.h>
+
+// Directory served to clients, opened once at startup
+#define DOCROOT_DIR "www"
+
+// Resolution cache geometry: sets of DOCROOT_WAYS entries each
+#define DOCROOT_SETS 256
+#define DOCROOT_WAYS 4
+
+// Seconds a cached resolution is trusted before it is checked against the tree again
+#define DOCROOT_RECHECK_SECS 1
+
+// A resolved file. fd is shared between requests, so only positional I/O
+// (pread, sendfile with an offset, mmap) may be used on it.
+struct docroot_entry {
+    char *key;          // request path this entry was resolved from
+    int fd;             // O_RDONLY descriptor for the file
+    struct stat st;     // stat taken when the entry was (re)validated
+    int refs;           // cache reference plus one per request using it
+    time_t checked;     // last validation, monotonic seconds
+    unsigned long used; // LRU tick
+};
+
+// Open and pin the document root. Returns 0 on success, -1 on error.
+int docroot_open(const char *dir);
+
+// Resolve a request path ("/" maps to index.html) beneath the document root.
+// Returns a referenced entry, or NULL with *err set to ENOENT, EACCES
+// (path escapes the root) or another errno value.
+struct docroot_entry *docroot_get(const char *path, int *err);
+
+// Drop a reference taken by docroot_get()
+void docroot_put(struct docroot_entry *entry);
+
+// Descriptor of the pinned document root
+int docroot_fd(void);
+
+#endif // DOCROOT_H
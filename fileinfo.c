@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <string.h>
+#include "fileinfo.h"
+
+const char *fileinfo_type(mode_t mode) {
+    if (S_ISREG(mode)) return "regular file";
+    if (S_ISDIR(mode)) return "directory";
+    if (S_ISCHR(mode)) return "character device";
+    if (S_ISBLK(mode)) return "block device";
+    if (S_ISFIFO(mode)) return "FIFO";
+    if (S_ISLNK(mode)) return "symbolic link";
+    if (S_ISSOCK(mode)) return "socket";
+    return "unknown";
+}
+
+void fileinfo_permissions(mode_t mode, char *out) {
+    static const mode_t bits[] = {S_IRUSR, S_IWUSR, S_IXUSR, S_IRGRP, S_IWGRP, S_IXGRP, S_IROTH, S_IWOTH, S_IXOTH};
+    out[0] = S_ISDIR(mode) ? 'd' : '-';
+    for (int i = 0; i < 9; i++) out[i + 1] = (mode & bits[i]) ? "rwx"[i % 3] : '-';
+    out[10] = '\0';
+}
+
+void fileinfo_size(long long size, int human, char *out, size_t len) {
+    static const char *units[] = {"B", "K", "M", "G", "T", "P", "E"};
+    if (!human) {
+        snprintf(out, len, "%lld", size);
+        return;
+    }
+    size_t div = 0;
+    while (size >= 1024 && div < sizeof(units) / sizeof(units[0]) - 1) {
+        size /= 1024;
+        div++;
+    }
+    if (div == 0) snprintf(out, len, "%lld%s", size, units[div]);//bytes need no decimal
+    else snprintf(out, len, "%.1f%s", (double)size, units[div]);
+}
+
+size_t fileinfo_escape(char *out, size_t len, const char *s) {
+    size_t n = 0;
+    for (; *s && n + 7 < len; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') n += snprintf(out + n, len - n, "\\%c", c);
+        else if (c < 0x20) n += snprintf(out + n, len - n, "\\u%04x", c);
+        else out[n++] = c;
+    }
+    if (len > 0) out[n < len ? n : len - 1] = '\0';
+    return n;
+}
+
+int fileinfo_json(char *out, size_t len, const char *name, const struct stat *st) {
+    char escaped[1024], permissions[11];
+    fileinfo_escape(escaped, sizeof(escaped), name);
+    fileinfo_permissions(st->st_mode, permissions);
+    return snprintf(out, len,
+                    "{\"filepath\":\"%s\",\"inode\":{\"number\":%llu,\"type\":\"%s\",\"permissions\":\"%s\","
+                    "\"linkCount\":%lu,\"uid\":%u,\"gid\":%u,\"size\":%lld,\"accessTime\":%lld,"
+                    "\"modificationTime\":%lld,\"statusChangeTime\":%lld}}",
+                    escaped, (unsigned long long)st->st_ino, fileinfo_type(st->st_mode), permissions,
+                    (unsigned long)st->st_nlink, st->st_uid, st->st_gid, (long long)st->st_size,
+                    (long long)st->st_atime, (long long)st->st_mtime, (long long)st->st_ctime);
+}
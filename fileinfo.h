@@ -0,0 +1,29 @@
+#ifndef FILEINFO_H
+#define FILEINFO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// How a file is described: the inspect tool (help.c) prints these, and so
+// do the server's directory listings. Nothing here keeps state, any thread
+// may call it.
+
+// "regular file", "directory", ... or "unknown"
+const char *fileinfo_type(mode_t mode);
+
+// ls-style "drwxr-xr-x" into out, which has room for 11
+void fileinfo_permissions(mode_t mode, char *out);
+
+// Bytes as digits, or scaled to the largest unit below 1024 ("12.0K") when
+// human is set
+void fileinfo_size(long long size, int human, char *out, size_t len);
+
+// s as the inside of a JSON string, cut to fit len; returns its length
+size_t fileinfo_escape(char *out, size_t len, const char *s);
+
+// One entry as a JSON object, the fields inspect --json prints; name is
+// escaped. Returns the length snprintf() would have written.
+int fileinfo_json(char *out, size_t len, const char *name, const struct stat *st);
+
+#endif // FILEINFO_H
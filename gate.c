@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "httpserve.h"
+#include "admit.h"
+#include "wheel.h"
+#include "gate.h"
+#include "tls.h"
+#include "trace.h"
+#include "co.h"
+
+// Connections wait here, costing a descriptor and a small record, until
+// their request head is complete; only then does an engine spend a thread
+// on them. Readiness is edge-triggered and the head is only peeked at, so
+// the handlers read the request exactly as if they had accepted it.
+// TLS handshakes run here too, non-blocking, so they cost no thread either.
+
+struct held {
+    struct timer timer;     // first, so a fired timer is the record itself
+    int fd;
+    int gotData;
+    uint64_t acceptedMs;
+    int secured;            // TLS handshake done
+    struct tls *tls;        // handshake state, NULL for cleartext
+};
+
+static struct {
+    int ep;
+    struct wheel wheel;
+    const struct gate_ops *ops;
+    int held;               // connections waiting for their head
+} G;
+
+static const char timedOut[] = "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void let_go(struct held *h) {//stop watching, the record goes away
+    epoll_ctl(G.ep, EPOLL_CTL_DEL, h->fd, NULL);
+    tls_drop(h->tls);
+    wheel_del(&h->timer);
+    G.held--;
+    free(h);
+}
+
+void gate_limits(int client_sock) {//the handlers block, so the kernel keeps these deadlines
+    struct timeval writeLimit = {GATE_WRITE_SECS, 0}, bodyLimit = {GATE_BODY_SECS, 0};
+    setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &writeLimit, sizeof(writeLimit));
+    setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &bodyLimit, sizeof(bodyLimit));
+}
+
+void gate_body_start(struct gate_body *b) {
+    b->startMs = now_ms();
+    b->got = 0;
+}
+
+int gate_body_wait(const struct gate_body *b, int client_sock) {
+    uint64_t deadline = b->startMs + GATE_BODY_SECS * 1000 + (uint64_t)b->got * 1000 / GATE_BODY_MIN_RATE, now = now_ms();
+    if (now >= deadline) return 0;
+    return co_wait(client_sock, POLLIN, deadline - now);//a coroutine yields meanwhile
+}
+
+void gate_timed_out(int client_sock) {
+    admit_refuse(client_sock, timedOut, sizeof(timedOut) - 1);
+}
+
+static void release(struct held *h) {
+    int fd = h->fd, served = fd;
+    struct tls *tls = h->tls;
+    h->tls = NULL;//the handlers own it now
+    let_go(h);
+    gate_limits(fd);
+    if (tls && (served = tls_release(fd, tls)) < 0) {
+        close(fd);
+        G.ops->expired(fd);
+        return;
+    }
+    trace_moved(fd, served);
+    G.ops->ready(served);
+}
+
+static void expire(struct timer *t) {
+    struct held *h = (struct held *)t;
+    int fd = h->fd, secure = tls_enabled();
+    let_go(h);
+    if (secure) close(fd);//a cleartext 408 means nothing to a TLS client
+    else gate_timed_out(fd);
+    G.ops->expired(fd);
+}
+
+static void fail(struct held *h) {//TLS that failed or ended before the request: nothing to answer
+    int fd = h->fd;
+    let_go(h);
+    close(fd);
+    G.ops->expired(fd);
+}
+
+static void check_head(struct held *h) {
+    char peek[REQUEST_SIZE];
+    ssize_t n;
+
+    if (tls_enabled() && !h->secured) {
+        if (!h->gotData) {//nothing for OpenSSL to do until the ClientHello arrives
+            n = recv(h->fd, peek, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+            if (n <= 0) {
+                fail(h);
+                return;
+            }
+            h->gotData = 1;//the handshake runs on the header deadline
+            wheel_add(&G.wheel, &h->timer, h->acceptedMs + GATE_HEADER_SECS * 1000);
+        }
+        int rc = tls_handshake(h->fd, &h->tls);
+        if (rc < 0) {
+            fail(h);
+            return;
+        }
+        if (rc == 0) return;
+        h->secured = 1;
+    }
+
+    if (h->tls) n = tls_peek(h->fd, h->tls, peek, sizeof(peek) - 1);
+    else n = recv(h->fd, peek, sizeof(peek) - 1, MSG_PEEK | MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {//closed or failed: the handler's read() sees it and cleans up
+        if (h->tls) fail(h);
+        else release(h);
+        return;
+    }
+    if (!h->gotData) {//first bytes: the idle deadline gives way to the header deadline
+        h->gotData = 1;
+        wheel_add(&G.wheel, &h->timer, h->acceptedMs + GATE_HEADER_SECS * 1000);
+    }
+    if (h->tls) {//a peek sees one record at a time, and clients send the head in one
+        release(h);
+    } else if (n == sizeof(peek) - 1 || memmem(peek, n, "\r\n\r\n", 4) || memmem(peek, n, "\n\n", 2)) {//as much as a handler reads at once
+        release(h);
+    }
+}
+
+static int accept_all(int server_sock) {//-1 on a fatal error
+    for (;;) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addrlen = sizeof(client_addr);
+        int client_sock = accept4(server_sock, (struct sockaddr *)&client_addr, &client_addrlen, SOCK_CLOEXEC);
+
+        if (client_sock < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;//queue empty, or a sibling got there first
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) {//leave the rest queued until descriptors free up
+                perror("error accepting");
+                return 0;
+            }
+            perror("error accepting");
+            return -1;
+        }
+
+        if (G.ops->accepted(client_sock, &client_addr) < 0) continue;
+        trace_accepted(client_sock);
+
+        struct held *h = calloc(1, sizeof(*h));
+        if (!h) {
+            close(client_sock);
+            G.ops->expired(client_sock);
+            continue;
+        }
+        h->fd = client_sock;
+        h->acceptedMs = now_ms();
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = h};
+        if (tls_enabled()) ev.events |= EPOLLOUT;//a handshake can stall on a full send buffer too
+        if (epoll_ctl(G.ep, EPOLL_CTL_ADD, client_sock, &ev) < 0) {//cannot watch it: hand it over as before
+            free(h);
+            G.ops->ready(client_sock);
+            continue;
+        }
+        G.held++;
+        wheel_add(&G.wheel, &h->timer, h->acceptedMs + GATE_IDLE_SECS * 1000);
+    }
+}
+
+int gate_serve(int server_sock, const struct gate_ops *ops) {
+    G.ops = ops;
+    G.held = 0;
+    G.ep = epoll_create1(EPOLL_CLOEXEC);
+    if (G.ep < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);//siblings in prefork share the queue
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(G.ep, EPOLL_CTL_ADD, server_sock, &ev);
+    if (ops->watch) {//its events only need the pass below
+        ev.data.ptr = &G;
+        epoll_ctl(G.ep, EPOLL_CTL_ADD, ops->watch(), &ev);
+    }
+    wheel_init(&G.wheel, now_ms());
+
+    int listening = 1, inflight = 0;
+    struct epoll_event events[64];
+
+    while (1) {
+        if (listening && server_draining()) {//new connections are the successor's now
+            epoll_ctl(G.ep, EPOLL_CTL_DEL, server_sock, NULL);
+            listening = 0;
+        }
+        if (!listening && G.held == 0 && inflight == 0) break;
+
+        int n = epoll_wait(G.ep, events, 64, WHEEL_TICK_MS);
+        server_tick();
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            close(G.ep);
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (listening && accept_all(server_sock) < 0) {
+                    close(G.ep);
+                    return -1;
+                }
+            } else if (events[i].data.ptr != &G) {
+                check_head(events[i].data.ptr);
+            }
+        }
+        wheel_advance(&G.wheel, now_ms(), expire);
+        if (ops->run) inflight = ops->run();
+    }
+
+    close(G.ep);
+    return 0;
+}
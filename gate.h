@@ -0,0 +1,71 @@
+#ifndef GATE_H
+#define GATE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Seconds a connection may stay silent after accept
+#define GATE_IDLE_SECS 5
+
+// Seconds from accept until the whole request head has to be in
+#define GATE_HEADER_SECS 10
+
+// Per-operation limits once a request is handed to the blocking handlers:
+// how long a send may wait for the client to make room, and how long a read
+// may wait for data
+#define GATE_WRITE_SECS 30
+#define GATE_BODY_SECS 30
+
+// Bytes a second a request body has to average once it has started, so a
+// client trickling a byte just inside every per-read limit still runs out
+// (gate_body below)
+#define GATE_BODY_MIN_RATE 1024
+
+// How an engine hooks into the gate
+struct gate_ops {
+    // A new connection: 0 to hold it until its head arrives, -1 when the
+    // engine already refused and closed it
+    int (*accepted)(int client_sock, const struct sockaddr_in *addr);
+
+    // The head is in (or the client gave up sending); the engine owns the
+    // socket from here, with write and body deadlines set on it
+    void (*ready)(int client_sock);
+
+    // The gate closed a held connection with a 408 after its deadline
+    void (*expired)(int client_sock);
+
+    // Optional, for engines that multiplex requests on the gate's thread: a
+    // descriptor to watch along with the held connections, and a pass run
+    // after every wakeup that returns how many requests are still in flight,
+    // which a draining gate waits for
+    int (*watch)(void);
+    int (*run)(void);
+};
+
+// Accept on server_sock and hold each connection on epoll, with idle and
+// header deadlines on a timer wheel, until its request head has arrived.
+// Slow or silent clients cost a descriptor, never a thread. Returns -1 if
+// accept() or epoll fail, 0 once draining has let every held connection go.
+int gate_serve(int server_sock, const struct gate_ops *ops);
+
+// For engines with their own event loop: set the write and body deadlines
+// on a socket about to go to the blocking handlers, and answer a client that
+// missed its header deadline with a 408 and close it
+void gate_limits(int client_sock);
+void gate_timed_out(int client_sock);
+
+// Deadline for the whole of a request body read by a handler: GATE_BODY_SECS
+// from gate_body_start(), plus a second for every GATE_BODY_MIN_RATE bytes
+// counted in got
+struct gate_body {
+    uint64_t startMs;
+    long long got;          // the caller adds what it read
+};
+
+void gate_body_start(struct gate_body *b);
+
+// Wait for more of the body on client_sock: 1 once it can be read, 0 when
+// the deadline has passed, -1 on error
+int gate_body_wait(const struct gate_body *b, int client_sock);
+
+#endif // GATE_H
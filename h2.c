@@ -0,0 +1,761 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "httpserve.h"
+#include "urlpath.h"
+#include "gate.h"
+#include "outq.h"
+#include "hpack.h"
+#include "upload.h"
+#include "proxy.h"
+#include "h2.h"
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN 24
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+
+enum { FRAME_DATA, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS, FRAME_PUSH_PROMISE,
+       FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION };
+enum { FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4, FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20 };
+enum { ERR_NONE, ERR_PROTOCOL, ERR_INTERNAL, ERR_FLOW_CONTROL, ERR_SETTINGS_TIMEOUT, ERR_STREAM_CLOSED,
+       ERR_FRAME_SIZE, ERR_REFUSED_STREAM, ERR_CANCEL, ERR_COMPRESSION, ERR_CONNECT, ERR_ENHANCE_YOUR_CALM,
+       ERR_INADEQUATE_SECURITY, ERR_HTTP_1_1_REQUIRED };
+
+struct stream {
+    uint32_t id;
+    int fd;                     // our end of the handler's socketpair
+    int64_t window;             // what the client lets us send on this stream
+    int headSent;
+    int remoteClosed;           // client sent END_STREAM
+    int readable;
+    int bufLen, bufOff;         // response head, then body read ahead of the window
+    char buf[H2_HEAD_MAX];
+};
+
+struct conn {
+    int sock;
+    struct outq q;
+    int closing;                // GOAWAY either way: no new streams
+    int goawaySent;
+    int64_t window;             // connection send window
+    int64_t initialWindow;      // client's SETTINGS_INITIAL_WINDOW_SIZE
+    size_t peerTableSize;       // client's SETTINGS_HEADER_TABLE_SIZE
+    uint32_t lastStream;
+    int prefaceLeft;            // bytes of the client preface not yet checked
+    time_t lastActive;
+    struct stream *streams[H2_MAX_STREAMS];
+    int streamCount;
+    struct hpack decoder, encoder;
+    uint32_t blockStream;       // header block being collected, 0 if none
+    int blockEndStream;
+    size_t blockLen;
+    uint8_t block[2 * H2_FRAME_MAX];
+    size_t inLen;
+    uint8_t in[2 * (H2_FRAME_MAX + 9)];
+    size_t outLen;
+    uint8_t out[H2_WRITE_BUF];
+};
+
+// A stream on its way to dispatch_request(), as the HTTP/1.1 request it stands for
+struct task {
+    int fd;
+    int len;
+    char buff[REQUEST_SIZE];
+};
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void frame_header(uint8_t *p, uint32_t len, uint8_t type, uint8_t flags, uint32_t id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id);
+}
+
+static int flush(struct conn *c) {//everything batched since the last poll goes out in one write
+    if (c->outLen == 0) return c->q.failed ? -1 : 0;
+    outq_mem(&c->q, c->out, c->outLen, NULL, NULL);
+    c->outLen = 0;
+    return outq_flush(&c->q);
+}
+
+static int emit(struct conn *c, uint8_t type, uint8_t flags, uint32_t id, const void *payload, uint32_t len) {
+    if (c->outLen + 9 + len > sizeof(c->out) && flush(c) < 0) return -1;
+    frame_header(c->out + c->outLen, len, type, flags, id);
+    if (len) memcpy(c->out + c->outLen + 9, payload, len);
+    c->outLen += 9 + len;
+    return 0;
+}
+
+static void emit_u32(struct conn *c, uint8_t type, uint32_t id, uint32_t v) {//RST_STREAM and WINDOW_UPDATE
+    uint8_t p[4];
+    put32(p, v);
+    emit(c, type, 0, id, p, 4);
+}
+
+static void go_away(struct conn *c, int code) {
+    if (c->goawaySent) return;
+    uint8_t p[8];
+    put32(p, c->lastStream);
+    put32(p + 4, code);
+    emit(c, FRAME_GOAWAY, 0, 0, p, 8);
+    c->goawaySent = 1;
+    c->closing = 1;
+}
+
+static struct stream *find(struct conn *c, uint32_t id) {
+    for (int i = 0; i < c->streamCount; i++) {
+        if (c->streams[i]->id == id) return c->streams[i];
+    }
+    return NULL;
+}
+
+static void drop_stream(struct conn *c, struct stream *s) {//the handler sees EPIPE if it is still writing
+    for (int i = 0; i < c->streamCount; i++) {
+        if (c->streams[i] != s) continue;
+        c->streams[i] = c->streams[--c->streamCount];
+        break;
+    }
+    close(s->fd);
+    free(s);
+}
+
+static void reset(struct conn *c, struct stream *s, int code) {
+    emit_u32(c, FRAME_RST_STREAM, s->id, code);
+    drop_stream(c, s);
+}
+
+static void *stream_main(void *arg) {
+    struct task *t = arg;
+    dispatch_request(t->fd, t->buff, t->len);//closes t->fd
+    free(t);
+    return NULL;
+}
+
+static int start_stream(struct conn *c, uint32_t id, struct task *t) {//takes t; -1 if the stream could not start
+    int pair[2];
+    struct stream *s = calloc(1, sizeof(*s));
+    if (!s || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        free(s);
+        free(t);
+        return -1;
+    }
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+    t->fd = pair[1];
+
+    if (spawn_detached(stream_main, t) != 0) {
+        close(pair[0]);
+        close(pair[1]);
+        free(s);
+        free(t);
+        return -1;
+    }
+
+    s->id = id;
+    s->fd = pair[0];
+    s->window = c->initialWindow;
+    c->streams[c->streamCount++] = s;
+    return 0;
+}
+
+// Request headers as they are decoded, before they become an HTTP/1.1 head
+struct request {
+    char method[16], path[2 * URLPATH_MAX], authority[256], cookie[1024];
+    size_t headersLen;
+    int bad, tooBig;
+    char headers[REQUEST_SIZE];
+};
+
+static int named(const char *name, size_t nameLen, const char *s) {
+    return strlen(s) == nameLen && memcmp(name, s, nameLen) == 0;
+}
+
+static void copy_field(struct request *r, char *dst, size_t room, const char *value, size_t valueLen) {
+    if (valueLen >= room) {
+        r->tooBig = 1;
+        return;
+    }
+    memcpy(dst, value, valueLen);
+    dst[valueLen] = '\0';
+}
+
+static int name_ok(const char *name, size_t nameLen) {//not NUL terminated; a leading ':' marks a pseudo-header
+    for (size_t i = 1; i < nameLen; i++) {
+        if (name[i] == '\r' || name[i] == '\n' || name[i] == ' ' || name[i] == ':' || name[i] == '\0') return 0;
+    }
+    return nameLen > 0;
+}
+
+static int on_field(void *arg, const char *name, size_t nameLen, const char *value, size_t valueLen) {
+    struct request *r = arg;
+    if (!name_ok(name, nameLen) || memchr(value, '\r', valueLen) || memchr(value, '\n', valueLen) || memchr(value, '\0', valueLen)) {//would forge lines in the HTTP/1.1 head
+        r->bad = 1;
+        return 0;
+    }
+
+    if (nameLen > 0 && name[0] == ':') {
+        if (named(name, nameLen, ":method")) copy_field(r, r->method, sizeof(r->method), value, valueLen);
+        else if (named(name, nameLen, ":path")) copy_field(r, r->path, sizeof(r->path), value, valueLen);
+        else if (named(name, nameLen, ":authority")) copy_field(r, r->authority, sizeof(r->authority), value, valueLen);
+        else if (!named(name, nameLen, ":scheme")) r->bad = 1;
+        return 0;
+    }
+    if (named(name, nameLen, "connection") || named(name, nameLen, "upgrade") || named(name, nameLen, "http2-settings") ||
+        named(name, nameLen, "keep-alive") || named(name, nameLen, "transfer-encoding")) {//connection-specific, not ours to pass on
+        return 0;
+    }
+    if (named(name, nameLen, "host")) {
+        if (!r->authority[0]) copy_field(r, r->authority, sizeof(r->authority), value, valueLen);
+        return 0;
+    }
+    if (named(name, nameLen, "cookie")) {//HTTP/2 may split it, handlers expect one line
+        size_t used = strlen(r->cookie);
+        if (used + valueLen + 3 > sizeof(r->cookie)) r->tooBig = 1;
+        else snprintf(r->cookie + used, sizeof(r->cookie) - used, "%s%.*s", used ? "; " : "", (int)valueLen, value);
+        return 0;
+    }
+
+    size_t need = nameLen + valueLen + 4;
+    if (r->headersLen + need >= sizeof(r->headers)) {
+        r->tooBig = 1;
+        return 0;
+    }
+    r->headersLen += snprintf(r->headers + r->headersLen, sizeof(r->headers) - r->headersLen, "%.*s: %.*s\r\n",
+                              (int)nameLen, name, (int)valueLen, value);
+    return 0;
+}
+
+static int build_request(struct request *r, struct task *t) {
+    if (r->bad || !r->method[0] || !r->path[0] || strpbrk(r->method, " \t") || strpbrk(r->path, " \t")) return ERR_PROTOCOL;
+    if (r->tooBig) return ERR_ENHANCE_YOUR_CALM;
+
+    int len = snprintf(t->buff, sizeof(t->buff), "%s %s HTTP/1.1\r\n", r->method, r->path);
+    if (r->authority[0]) len += snprintf(t->buff + len, sizeof(t->buff) - len, "Host: %s\r\n", r->authority);
+    if (r->cookie[0] && len < (int)sizeof(t->buff)) len += snprintf(t->buff + len, sizeof(t->buff) - len, "cookie: %s\r\n", r->cookie);
+    if (len < (int)sizeof(t->buff)) len += snprintf(t->buff + len, sizeof(t->buff) - len, "%s\r\n", r->headers);
+    if (len >= (int)sizeof(t->buff)) return ERR_ENHANCE_YOUR_CALM;//dispatch_request() needs room for a terminator
+    t->len = len;
+    return 0;
+}
+
+static int end_block(struct conn *c) {//a whole header block is in
+    uint32_t id = c->blockStream;
+    c->blockStream = 0;
+
+    struct request *r = malloc(sizeof(*r));
+    struct task *t = malloc(sizeof(*t));
+    if (!r || !t) {
+        free(r);
+        free(t);
+        return ERR_INTERNAL;
+    }
+    memset(r, 0, offsetof(struct request, headers));
+    r->headers[0] = '\0';
+
+    if (hpack_decode(&c->decoder, c->block, c->blockLen, on_field, r) < 0) {//the tables are out of step for good
+        free(r);
+        free(t);
+        return ERR_COMPRESSION;
+    }
+
+    struct stream *s = find(c, id);
+    if (s || c->closing || id <= c->lastStream) {//trailers, a stream we reset, or one opened after GOAWAY: decoded for the table's sake only
+        free(t);
+    } else {
+        c->lastStream = id;
+        int code = build_request(r, t);
+        if (!code && c->streamCount == H2_MAX_STREAMS) code = ERR_REFUSED_STREAM;
+        if (!code && (upload_wanted(t->buff) || (proxy_wanted(t->buff) && !c->blockEndStream))) {//streams carry no request body to the handler
+            code = ERR_HTTP_1_1_REQUIRED;
+        }
+        if (code) {
+            free(t);
+            emit_u32(c, FRAME_RST_STREAM, id, code);
+        } else if (start_stream(c, id, t) < 0) {
+            emit_u32(c, FRAME_RST_STREAM, id, ERR_REFUSED_STREAM);
+        } else {
+            c->streams[c->streamCount - 1]->remoteClosed = c->blockEndStream;
+        }
+    }
+    free(r);
+    return 0;
+}
+
+static int add_block(struct conn *c, const uint8_t *p, uint32_t len, uint8_t flags) {
+    if (c->blockLen + len > sizeof(c->block)) return ERR_ENHANCE_YOUR_CALM;
+    memcpy(c->block + c->blockLen, p, len);
+    c->blockLen += len;
+    return (flags & FLAG_END_HEADERS) ? end_block(c) : 0;
+}
+
+static int strip_padding(uint8_t flags, uint8_t **p, uint32_t *len) {
+    if (!(flags & FLAG_PADDED)) return 0;
+    if (*len < 1 || (*p)[0] >= *len) return -1;
+    *len -= 1 + (*p)[0];
+    (*p)++;
+    return 0;
+}
+
+static int apply_settings(struct conn *c, const uint8_t *p, uint32_t len) {
+    if (len % 6) return ERR_FRAME_SIZE;
+    for (uint32_t i = 0; i < len; i += 6) {
+        uint16_t key = p[i] << 8 | p[i + 1];
+        uint32_t v = get32(p + i + 2);
+        if (key == 0x1) {
+            c->peerTableSize = v;
+        } else if (key == 0x2) {
+            if (v > 1) return ERR_PROTOCOL;
+        } else if (key == 0x4) {//open streams move by the difference
+            if (v > MAX_WINDOW) return ERR_FLOW_CONTROL;
+            for (int j = 0; j < c->streamCount; j++) c->streams[j]->window += (int64_t)v - c->initialWindow;
+            c->initialWindow = v;
+        } else if (key == 0x5) {//we never send more than the minimum anyway
+            if (v < 16384 || v > 16777215) return ERR_PROTOCOL;
+        }
+    }
+    return 0;
+}
+
+static int on_frame(struct conn *c, uint8_t type, uint8_t flags, uint32_t id, uint8_t *p, uint32_t len) {
+    if (c->blockStream && (type != FRAME_CONTINUATION || id != c->blockStream)) return ERR_PROTOCOL;
+    struct stream *s;
+    int err;
+
+    switch (type) {
+    case FRAME_DATA: {
+        uint32_t counted = len;//padding counts against the window too
+        if (id == 0 || strip_padding(flags, &p, &len) < 0) return ERR_PROTOCOL;
+        s = find(c, id);
+        if (!s && id > c->lastStream) return ERR_PROTOCOL;
+        if (counted) {//handlers read no request body, over HTTP/1.1 either: hand the credit straight back
+            emit_u32(c, FRAME_WINDOW_UPDATE, 0, counted);
+            if (s && !(flags & FLAG_END_STREAM)) emit_u32(c, FRAME_WINDOW_UPDATE, id, counted);
+        }
+        if (s && (flags & FLAG_END_STREAM)) s->remoteClosed = 1;
+        return 0;
+    }
+    case FRAME_HEADERS:
+        if (id == 0 || !(id & 1) || strip_padding(flags, &p, &len) < 0) return ERR_PROTOCOL;
+        if (flags & FLAG_PRIORITY) {
+            if (len < 5) return ERR_PROTOCOL;
+            p += 5;
+            len -= 5;
+        }
+        c->blockStream = id;
+        c->blockEndStream = flags & FLAG_END_STREAM;
+        c->blockLen = 0;
+        return add_block(c, p, len, flags);
+    case FRAME_CONTINUATION:
+        if (!c->blockStream) return ERR_PROTOCOL;
+        return add_block(c, p, len, flags);
+    case FRAME_SETTINGS:
+        if (id) return ERR_PROTOCOL;
+        if (flags & FLAG_ACK) return len ? ERR_FRAME_SIZE : 0;
+        if ((err = apply_settings(c, p, len))) return err;
+        emit(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        return 0;
+    case FRAME_PING:
+        if (len != 8) return ERR_FRAME_SIZE;
+        if (id) return ERR_PROTOCOL;
+        if (!(flags & FLAG_ACK)) emit(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+        return 0;
+    case FRAME_WINDOW_UPDATE: {
+        if (len != 4) return ERR_FRAME_SIZE;
+        uint32_t inc = get32(p) & MAX_WINDOW;
+        if (id == 0) {
+            if (inc == 0) return ERR_PROTOCOL;
+            c->window += inc;
+            return c->window > MAX_WINDOW ? ERR_FLOW_CONTROL : 0;
+        }
+        if (!(s = find(c, id))) return 0;
+        s->window += inc;
+        if (inc == 0) reset(c, s, ERR_PROTOCOL);
+        else if (s->window > MAX_WINDOW) reset(c, s, ERR_FLOW_CONTROL);
+        return 0;
+    }
+    case FRAME_RST_STREAM:
+        if (len != 4) return ERR_FRAME_SIZE;
+        if (id == 0) return ERR_PROTOCOL;
+        if ((s = find(c, id))) drop_stream(c, s);
+        return 0;
+    case FRAME_GOAWAY:
+        c->closing = 1;//finish what is open, start nothing new
+        return 0;
+    case FRAME_PUSH_PROMISE:
+        return ERR_PROTOCOL;
+    default://PRIORITY is advisory, unknown types are ignored
+        return 0;
+    }
+}
+
+static int parse_input(struct conn *c) {//-1 once the connection has to close
+    size_t off = 0;
+    if (c->prefaceLeft) {
+        size_t n = c->inLen < (size_t)c->prefaceLeft ? c->inLen : (size_t)c->prefaceLeft;
+        if (memcmp(c->in, PREFACE + PREFACE_LEN - c->prefaceLeft, n) != 0) return -1;//not HTTP/2 after all
+        c->prefaceLeft -= n;
+        off = n;
+    }
+
+    while (c->inLen - off >= 9) {
+        uint8_t *h = c->in + off;
+        uint32_t len = h[0] << 16 | h[1] << 8 | h[2];
+        if (len > H2_FRAME_MAX) {
+            go_away(c, ERR_FRAME_SIZE);
+            return -1;
+        }
+        if (c->inLen - off < 9 + len) break;
+
+        int err = on_frame(c, h[3], h[4], get32(h + 5) & MAX_WINDOW, h + 9, len);
+        if (err) {
+            go_away(c, err);
+            return -1;
+        }
+        off += 9 + len;
+    }
+    memmove(c->in, c->in + off, c->inLen - off);
+    c->inLen -= off;
+    return 0;
+}
+
+static int read_input(struct conn *c) {
+    ssize_t n = recv(c->sock, c->in + c->inLen, sizeof(c->in) - c->inLen, 0);
+    if (n == 0) return -1;
+    if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    c->inLen += n;
+    c->lastActive = time(NULL);
+    return parse_input(c);
+}
+
+static int head_end(const char *buf, int len) {//offset just past the blank line, or -1
+    for (int i = 0; i + 1 < len; i++) {
+        if (buf[i] != '\n') continue;
+        if (buf[i + 1] == '\n') return i + 2;
+        if (buf[i + 1] == '\r' && i + 2 < len && buf[i + 2] == '\n') return i + 3;
+    }
+    return -1;
+}
+
+static int send_head(struct conn *c, struct stream *s, int headLen) {//HTTP/1.1 (or CGI) head to a HEADERS frame
+    char head[H2_HEAD_MAX + 1];
+    memcpy(head, s->buf, headLen);
+    head[headLen] = '\0';
+
+    const char *names[64], *values[64];
+    int count = 0;
+    char status[4] = "200";
+    char *saveptr;
+
+    for (char *line = strtok_r(head, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        if (strncmp(line, "HTTP/1.", 7) == 0) {//status line
+            if (strlen(line) >= 12) memcpy(status, line + 9, 3);
+            continue;
+        }
+        char *colon = strchr(line, ':');
+        if (!colon || count == 64) continue;
+        *colon = '\0';
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') value++;
+        for (char *p = line; *p; p++) *p = tolower((unsigned char)*p);
+
+        if (strcmp(line, "status") == 0) {//CGI-style head
+            if (strlen(value) >= 3) memcpy(status, value, 3);
+            continue;
+        }
+        if (strcmp(line, "connection") == 0 || strcmp(line, "keep-alive") == 0 || strcmp(line, "transfer-encoding") == 0 ||
+            strcmp(line, "upgrade") == 0 || strcmp(line, "proxy-connection") == 0) {
+            continue;
+        }
+        names[count] = line;
+        values[count++] = value;
+    }
+
+    uint8_t block[H2_HEAD_MAX];
+    size_t len = 0;
+    int n;
+    size_t tableSize = c->peerTableSize < HPACK_TABLE_SIZE ? c->peerTableSize : HPACK_TABLE_SIZE;
+    if (tableSize != c->encoder.maxSize) {//client shrank its table since our last block
+        if ((n = hpack_encode_size(&c->encoder, block, sizeof(block), tableSize)) < 0) return -1;
+        len += n;
+    }
+    if ((n = hpack_encode(&c->encoder, block + len, sizeof(block) - len, ":status", 7, status, 3)) < 0) return -1;
+    len += n;
+    for (int i = 0; i < count; i++) {
+        n = hpack_encode(&c->encoder, block + len, sizeof(block) - len, names[i], strlen(names[i]), values[i], strlen(values[i]));
+        if (n < 0) return -1;
+        len += n;
+    }
+
+    for (size_t off = 0; off < len;) {//HEADERS, then CONTINUATION for whatever does not fit
+        size_t chunk = len - off > H2_FRAME_MAX ? H2_FRAME_MAX : len - off;
+        uint8_t type = off == 0 ? FRAME_HEADERS : FRAME_CONTINUATION;
+        if (emit(c, type, off + chunk == len ? FLAG_END_HEADERS : 0, s->id, block + off, chunk) < 0) return -1;
+        off += chunk;
+    }
+    return 0;
+}
+
+static int pump(struct conn *c, struct stream *s) {//moves up to one frame of the response; 1 if the stream is gone
+    if (!s->headSent) {
+        ssize_t n = read(s->fd, s->buf + s->bufLen, sizeof(s->buf) - s->bufLen);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+        if (n > 0) s->bufLen += n;
+
+        int headLen = head_end(s->buf, s->bufLen);
+        if (headLen < 0) {
+            if (n <= 0 || s->bufLen == (int)sizeof(s->buf)) {//handler gave up, or no head we can use
+                reset(c, s, ERR_INTERNAL);
+                return 1;
+            }
+            return 0;
+        }
+        if (send_head(c, s, headLen) < 0) {
+            reset(c, s, ERR_INTERNAL);
+            return 1;
+        }
+        s->headSent = 1;
+        s->bufOff = headLen;
+    }
+
+    int64_t room = c->window < s->window ? c->window : s->window;
+    if (room > H2_FRAME_MAX) room = H2_FRAME_MAX;
+    if (room <= 0) return 0;
+    if (c->outLen + 9 + room > sizeof(c->out) && flush(c) < 0) return 0;
+
+    uint8_t *payload = c->out + c->outLen + 9;//read straight into the batch
+    ssize_t n;
+    if (s->bufOff < s->bufLen) {
+        n = s->bufLen - s->bufOff < room ? s->bufLen - s->bufOff : room;
+        memcpy(payload, s->buf + s->bufOff, n);
+        s->bufOff += n;
+    } else {
+        n = read(s->fd, payload, room);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            reset(c, s, ERR_INTERNAL);
+            return 1;
+        }
+    }
+
+    frame_header(c->out + c->outLen, n, FRAME_DATA, n == 0 ? FLAG_END_STREAM : 0, s->id);
+    c->outLen += 9 + n;
+    c->window -= n;
+    s->window -= n;
+    if (n > 0) return 0;
+
+    if (!s->remoteClosed) emit_u32(c, FRAME_RST_STREAM, s->id, ERR_NONE);//response is complete, the client can stop sending
+    drop_stream(c, s);
+    return 1;
+}
+
+static void run(struct conn *c) {
+    while (!c->q.failed) {
+        if (!c->closing && (server_draining() || (c->streamCount == 0 && time(NULL) - c->lastActive > GATE_IDLE_SECS))) {
+            go_away(c, ERR_NONE);
+        }
+        if (c->closing && c->streamCount == 0) break;
+
+        struct pollfd fds[1 + H2_MAX_STREAMS];
+        struct stream *who[1 + H2_MAX_STREAMS];
+        int n = 1, busy = 0;
+        fds[0] = (struct pollfd){c->sock, POLLIN, 0};
+        for (int i = 0; i < c->streamCount && !c->prefaceLeft; i++) {//after an upgrade, answer once the client speaks HTTP/2 too
+            struct stream *s = c->streams[i];
+            int canSend = c->window > 0 && s->window > 0;
+            if (!s->headSent || (canSend && s->bufOff == s->bufLen)) {//out of window: the handler waits on its socket
+                fds[n] = (struct pollfd){s->fd, POLLIN, 0};
+                who[n++] = s;
+            } else if (canSend) {
+                busy = 1;
+            }
+        }
+        if (flush(c) < 0) break;
+
+        int ready = poll(fds, n, busy ? 0 : 1000);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 1; i < n; i++) who[i]->readable = fds[i].revents != 0;
+        for (int i = 0; i < c->streamCount && !c->prefaceLeft;) {//one frame per stream per round, nobody waits behind a big body
+            struct stream *s = c->streams[i];
+            int buffered = s->headSent && s->bufOff < s->bufLen;
+            if (s->readable || buffered) {
+                s->readable = 0;
+                if (pump(c, s)) continue;//dropped, the last stream moved into slot i
+            }
+            i++;
+        }
+        if (fds[0].revents && read_input(c) < 0) break;
+    }
+}
+
+static struct conn *conn_new(int client_sock) {
+    struct conn *c = malloc(sizeof(*c));
+    if (!c) return NULL;
+    memset(c, 0, offsetof(struct conn, block));//the buffers need no clearing, only their lengths
+    c->blockLen = c->inLen = c->outLen = 0;
+    c->sock = client_sock;
+    c->window = DEFAULT_WINDOW;
+    c->initialWindow = DEFAULT_WINDOW;
+    c->peerTableSize = HPACK_TABLE_SIZE;
+    c->prefaceLeft = PREFACE_LEN;
+    c->lastActive = time(NULL);
+    hpack_init(&c->decoder, HPACK_TABLE_SIZE);
+    hpack_init(&c->encoder, HPACK_TABLE_SIZE);
+    outq_init(&c->q, client_sock);
+    int one = 1;//frames are batched here already, Nagle would only hold back the tail of a round
+    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    static const uint8_t settings[] = {0, 0x3, 0, 0, 0, H2_MAX_STREAMS};//SETTINGS_MAX_CONCURRENT_STREAMS
+    emit(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    return c;
+}
+
+static void conn_close(struct conn *c) {
+    flush(c);
+    outq_finish(&c->q);
+    while (c->streamCount > 0) drop_stream(c, c->streams[0]);
+    hpack_free(&c->decoder);
+    hpack_free(&c->encoder);
+    close(c->sock);
+    free(c);
+}
+
+static int has_token(const char *value, const char *token) {//comma-separated list, case-insensitive
+    size_t len = strlen(token);
+    for (const char *p = value; *p;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        size_t n = strcspn(p, ", \t");
+        if (n == len && strncasecmp(p, token, len) == 0) return 1;
+        p += n;
+    }
+    return 0;
+}
+
+static int base64url_decode(const char *in, uint8_t *out, size_t room) {//HTTP2-Settings, no padding; -1 if malformed
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (; *in && *in != '='; in++) {
+        const char *p = strchr(alphabet, *in);
+        if (!p) return -1;
+        acc = (acc << 6) | (p - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == room) return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+static int upgrade_request(const char *buff, int headLen, struct task *t) {//the upgraded request as stream 1, upgrade headers left out
+    int len = 0;
+    const char *line = buff, *end = buff + headLen;
+    while (line < end) {
+        const char *next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if (strncasecmp(line, "Upgrade:", 8) != 0 && strncasecmp(line, "HTTP2-Settings:", 15) != 0 &&
+            strncasecmp(line, "Connection:", 11) != 0) {
+            if (len + (next - line) >= (int)sizeof(t->buff)) return -1;
+            memcpy(t->buff + len, line, next - line);
+            len += next - line;
+        }
+        line = next;
+    }
+    t->len = len;
+    return 0;
+}
+
+static int upgrade_settings(const char *buff, uint8_t *payload, size_t room) {//-1 unless this is an h2c upgrade we can take
+    if (strncmp(buff, "GET ", 4) != 0 && strncmp(buff, "HEAD ", 5) != 0) return -1;//only requests without a body upgrade
+    const char *headers = strchr(buff, '\n');
+    char value[256], settings[256];
+    if (!headers || !get_header(headers + 1, "Upgrade", value, sizeof(value)) || !has_token(value, "h2c") ||
+        !get_header(headers + 1, "HTTP2-Settings", settings, sizeof(settings))) {
+        return -1;
+    }
+    return base64url_decode(settings, payload, room);//ignoring a malformed upgrade is always allowed
+}
+
+int h2_wanted(const char *buff, int len) {
+    uint8_t payload[192];
+    return (len >= 16 && memcmp(buff, PREFACE, 16) == 0) || upgrade_settings(buff, payload, sizeof(payload)) >= 0;
+}
+
+int h2_dispatch(int client_sock, char *buff, int len) {
+    struct conn *c;
+    buff[len] = '\0';
+
+    if (len >= 16 && memcmp(buff, PREFACE, 16) == 0) {//prior knowledge: the preface is the request line
+        if (!(c = conn_new(client_sock))) return 0;
+        logMsg("HTTP/2 connection");
+        memcpy(c->in, buff, len);
+        c->inLen = len;
+        if (parse_input(c) == 0) run(c);
+        conn_close(c);
+        return 1;
+    }
+
+    uint8_t payload[192];
+    int payloadLen = upgrade_settings(buff, payload, sizeof(payload));
+    if (payloadLen < 0) return 0;
+
+    const char *blank = strstr(buff, "\r\n\r\n");
+    int headLen = blank ? blank + 4 - buff : len;
+    struct task *t = malloc(sizeof(*t));
+    if (!t || upgrade_request(buff, headLen, t) < 0) {
+        free(t);
+        return 0;
+    }
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    if (outq_send(client_sock, switching, sizeof(switching) - 1) < 0 || !(c = conn_new(client_sock))) {
+        free(t);
+        close(client_sock);
+        return 1;
+    }
+    logMsg("HTTP/2 connection (upgraded)");
+
+    memcpy(c->in, buff + headLen, len - headLen);//whatever followed the head, normally the preface
+    c->inLen = len - headLen;
+    if (apply_settings(c, payload, payloadLen) != 0) {//the 101 acknowledged them, no SETTINGS ACK
+        free(t);
+        go_away(c, ERR_PROTOCOL);
+    } else {
+        c->lastStream = 1;
+        if (start_stream(c, 1, t) == 0) c->streams[0]->remoteClosed = 1;
+        else go_away(c, ERR_INTERNAL);
+        if (parse_input(c) == 0) run(c);
+    }
+    conn_close(c);
+    return 1;
+}
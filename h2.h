@@ -0,0 +1,37 @@
+#ifndef H2_H
+#define H2_H
+
+// Cleartext HTTP/2 (RFC 9113), by prior knowledge or Upgrade: h2c.
+
+// Streams one connection may have open at once (SETTINGS_MAX_CONCURRENT_STREAMS)
+#define H2_MAX_STREAMS 32
+
+// Largest frame payload either side sends (the protocol minimum)
+#define H2_FRAME_MAX 16384
+
+// Frames are batched here and written with one call per loop
+#define H2_WRITE_BUF 65536
+
+// Longest response head a handler may write before its body
+#define H2_HEAD_MAX 4096
+
+// 1 if the request read into buff (len bytes, NUL-terminated) opens an
+// HTTP/2 connection: the client preface, or a GET/HEAD asking to upgrade.
+// Engines use it to move such long-lived connections off their fast paths.
+int h2_wanted(const char *buff, int len);
+
+// If the request that was just read (len bytes in buff, room for a
+// terminator) opens an HTTP/2 connection, serve the whole connection and
+// close the socket, returning 1. Returns 0 for an ordinary HTTP/1.1 request,
+// with buff only terminated.
+//
+// Every stream is turned back into an HTTP/1.1 request and run through
+// dispatch_request() on its own thread, against one end of a socketpair;
+// the connection thread reads the response from the other end and frames
+// it, so the existing handlers serve HTTP/2 unchanged and a slow stream
+// never holds up the others. Request bodies do not reach the handlers, so
+// uploads and proxied requests with a body are refused with
+// HTTP_1_1_REQUIRED.
+int h2_dispatch(int client_sock, char *buff, int len);
+
+#endif // H2_H
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "httpserve.h"
+#include "handoff.h"
+
+// Deploy protocol on the control socket, old server O, new server N:
+//
+//   N connects -> O sends "L" with the listening socket attached
+//   N replies "K" -> O stops accepting and drains, N is already accepting
+//
+// Both processes accept from the same kernel queue while O drains, so no
+// connection is refused or reset. If N dies before "K", O keeps serving.
+
+#define SD_LISTEN_FDS_START 3
+
+static int controlSock = -1;
+static int listenSock = -1;
+static pthread_t mainThread;
+
+static int control_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_receive(const char *path) {
+    struct sockaddr_un addr;
+    if (control_addr(path, &addr) < 0) return -1;
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return -1;
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {//no server to replace
+        close(s);
+        return -1;
+    }
+
+    char tag;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&tag, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int fd = -1;
+    if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) == 1 && tag == 'L') {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (fd >= 0 && write(s, "K", 1) != 1) {//the old server only lets go once it hears back
+        close(fd);
+        fd = -1;
+    }
+    close(s);
+    if (fd < 0) fprintf(stderr, "takeover from %s failed\n", path);
+    return fd;
+}
+
+int handoff_inherited(void) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    if (!pid || !fds || atoi(pid) != getpid() || atoi(fds) < 1) return -1;
+
+    unsetenv("LISTEN_PID");//CGI children must not think the socket is theirs
+    unsetenv("LISTEN_FDS");
+    int type;
+    socklen_t len = sizeof(type);
+    if (getsockopt(SD_LISTEN_FDS_START, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM) return -1;
+    return SD_LISTEN_FDS_START;
+}
+
+static int send_listener(int c) {//returns 0 once the successor has confirmed
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {"L", 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listenSock, sizeof(int));
+
+    struct timeval timeout = {HANDOFF_ACK_SECS, 0};
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char ack;
+    if (sendmsg(c, &msg, MSG_NOSIGNAL) != 1) return -1;
+    if (read(c, &ack, 1) != 1 || ack != 'K') return -1;
+    return 0;
+}
+
+static void *control_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        int c = accept4(controlSock, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("control socket");
+            return NULL;
+        }
+        int handedOver = send_listener(c) == 0;
+        close(c);
+        if (handedOver) break;
+        logMsg("takeover attempt abandoned, still serving");
+    }
+
+    logMsg("listening socket handed over, draining");
+    close(controlSock);//the path belongs to the successor now, leave it alone
+    for (;;) {//repeat: the main thread may be between its check and a blocking call the first time
+        pthread_kill(mainThread, SIGQUIT);
+        sleep(1);
+    }
+    return NULL;
+}
+
+int handoff_listen(const char *path, int server_sock) {
+    struct sockaddr_un addr;
+    if (control_addr(path, &addr) < 0) return -1;
+
+    controlSock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (controlSock < 0) return -1;
+
+    unlink(path);//a predecessor's socket, or a stale one from a crash
+    mode_t old = umask(0077);//only our own user may take the server over
+    int err = bind(controlSock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+    if (err < 0 || listen(controlSock, 4) < 0) {
+        close(controlSock);
+        controlSock = -1;
+        return -1;
+    }
+
+    listenSock = server_sock;
+    mainThread = pthread_self();
+
+    if ((err = spawn_detached(control_main, NULL)) != 0) {//it must not catch SIGQUIT or SIGHUP meant for the engine
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Seconds a draining server gets to finish what it already accepted
+#define HANDOFF_DRAIN_SECS 30
+
+// Seconds the old server waits for the new one to confirm it has the socket
+#define HANDOFF_ACK_SECS 5
+
+// Take the listening socket over from a server running with the same
+// control path: receive it with SCM_RIGHTS and confirm, after which the old
+// server stops accepting and drains. Returns the socket, or -1 when nobody
+// is listening on path.
+int handoff_receive(const char *path);
+
+// Listening socket passed down by a supervisor (systemd LISTEN_FDS/LISTEN_PID
+// convention, first descriptor only), or -1
+int handoff_inherited(void);
+
+// Bind the control socket at path and serve takeover requests for
+// server_sock from a background thread. Once a successor confirms, the
+// calling thread is sent SIGQUIT until the process has drained and exited.
+// Returns 0 on success, -1 on error.
+int handoff_listen(const char *path, int server_sock);
+
+#endif // HANDOFF_H
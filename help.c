@@ -9,6 +9,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "fileinfo.h"
 
 #define MAX_STRING 4096
 
@@ -353,62 +354,13 @@ char* getNumber(struct stat *fileInfo) {
 
 char* getType(struct stat *fileInfo) {
     static char type[20]; // Assuming the type won't exceed 20 characters
-    const char* types[] = {
-        "regular file",
-        "directory",
-        "character device",
-        "block device",
-        "FIFO",
-        "symbolic link",
-        "socket"
-    };
-    mode_t mode = fileInfo->st_mode;
-    int i = 0;
-    while (i < 7) {
-        if (S_ISREG(mode)) {
-            strcpy(type, types[0]);
-            break;
-        } else if (S_ISDIR(mode)) {
-            strcpy(type, types[1]);
-            break;
-        } else if (S_ISCHR(mode)) {
-            strcpy(type, types[2]);
-            break;
-        } else if (S_ISBLK(mode)) {
-            strcpy(type, types[3]);
-            break;
-        } else if (S_ISFIFO(mode)) {
-            strcpy(type, types[4]);
-            break;
-        } else if (S_ISLNK(mode)) {
-            strcpy(type, types[5]);
-            break;
-        } else if (S_ISSOCK(mode)) {
-            strcpy(type, types[6]);
-            break;
-        } else {
-            strcpy(type, "unknown");
-            break;
-        }
-        i++;
-    }
+    strcpy(type, fileinfo_type(fileInfo->st_mode));
     return type;
 }
 
 char* getPermissions(struct stat *fileInfo) {
     static char str1[11];
-    int i = 0;
-    str1[i++] = (S_ISDIR(fileInfo->st_mode)) ? 'd' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IRUSR) ? 'r' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IWUSR) ? 'w' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IXUSR) ? 'x' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IRGRP) ? 'r' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IWGRP) ? 'w' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IXGRP) ? 'x' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IROTH) ? 'r' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IWOTH) ? 'w' : '-';
-    str1[i++] = (fileInfo->st_mode & S_IXOTH) ? 'x' : '-';
-    str1[i++] = '\0';
+    fileinfo_permissions(fileInfo->st_mode, str1);
     return str1;
 }
 
@@ -431,28 +383,8 @@ char* getGid(struct stat *fileInfo) {
 }
 
 char* getSize(struct stat *fileInfo) {
-    //printf("this is running i think\n");
     static char buf[64]; // Static buffer for the size string
-    long long size = fileInfo->st_size;
-    if (Options.human) {
-        //printf("working!\n");
-        static const char *SIZES[] = { "B", "K", "M", "G", "T", "P", "E" }; // Include all units up to exabytes
-        int div = 0;
-
-        while (size >= 1024 && div < (sizeof SIZES / sizeof *SIZES) - 1) {
-            size /= 1024;
-            div++;
-        }
-
-        if (div == 0) {  // Bytes do not need a decimal
-            snprintf(buf, sizeof(buf), "%lld%s", size, SIZES[div]);
-        } else {  // Other units get one decimal for precision
-            snprintf(buf, sizeof(buf), "%.1f%s", (double)size, SIZES[div]);
-        }
-    } else {
-        snprintf(buf, sizeof(buf), "%lld", size);
-    }
-
+    fileinfo_size(fileInfo->st_size, Options.human, buf, sizeof(buf));
     return buf; // Return the buffer containing the formatted size
 }
 
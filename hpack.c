@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hpack.h"
+
+// The Huffman code of RFC 7541 Appendix B is canonical: codes of one length
+// are consecutive, in symbol order, so the code lengths alone define it.
+static const uint8_t huffLength[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static uint32_t huffCode[257];
+static uint16_t huffSorted[257];        // symbols by (length, value)
+static uint32_t firstCode[31];          // smallest code of each length
+static int firstIndex[31], lengthCount[31];
+static pthread_once_t huffOnce = PTHREAD_ONCE_INIT;
+
+static void huff_build(void) {
+    uint32_t code = 0;
+    int n = 0;
+    for (int len = 1; len <= 30; len++) {
+        firstCode[len] = code;
+        firstIndex[len] = n;
+        for (int s = 0; s < 257; s++) {
+            if (huffLength[s] != len) continue;
+            huffSorted[n++] = s;
+            huffCode[s] = code++;
+        }
+        lengthCount[len] = n - firstIndex[len];
+        code <<= 1;
+    }
+}
+
+static int huff_decode(const uint8_t *in, size_t len, char *out, size_t room) {//decoded length or -1
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            if (++bits > 30) return -1;
+            if (code - firstCode[bits] >= (uint32_t)lengthCount[bits]) continue;//not a whole code yet
+
+            int sym = huffSorted[firstIndex[bits] + code - firstCode[bits]];
+            if (sym == 256 || n == room) return -1;//EOS inside a string is an error
+            out[n++] = sym;
+            code = 0;
+            bits = 0;
+        }
+    }
+    if (bits > 7 || code != (1u << bits) - 1) return -1;//padding is a short run of ones (a prefix of EOS)
+    return n;
+}
+
+static size_t huff_length(const char *s, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) bits += huffLength[(uint8_t)s[i]];
+    return (bits + 7) / 8;
+}
+
+static void huff_encode(const char *s, size_t len, uint8_t *out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        int sym = (uint8_t)s[i];
+        acc = (acc << huffLength[sym]) | huffCode[sym];
+        bits += huffLength[sym];
+        while (bits >= 8) {
+            bits -= 8;
+            *out++ = acc >> bits;
+        }
+        acc &= (1ULL << bits) - 1;
+    }
+    if (bits) *out = (acc << (8 - bits)) | (0xff >> bits);
+}
+
+static int get_int(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+    if (*p >= end) return -1;
+    size_t max = (1u << prefix) - 1;
+    size_t v = *(*p)++ & max;
+    if (v == max) {
+        for (int shift = 0;; shift += 7) {
+            if (*p >= end || shift > 28) return -1;//nothing we accept needs more
+            uint8_t b = *(*p)++;
+            v += (size_t)(b & 127) << shift;
+            if (!(b & 128)) break;
+        }
+    }
+    *value = v;
+    return 0;
+}
+
+static int put_int(uint8_t *out, size_t room, uint8_t first, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+    size_t n = 0;
+    if (room == 0) return -1;
+    if (value < max) {
+        out[0] = first | value;
+        return 1;
+    }
+    out[n++] = first | max;
+    value -= max;
+    while (value >= 128) {
+        if (n == room) return -1;
+        out[n++] = (value & 127) | 128;
+        value >>= 7;
+    }
+    if (n == room) return -1;
+    out[n++] = value;
+    return n;
+}
+
+static int get_string(const uint8_t **p, const uint8_t *end, char *out, size_t room) {//length or -1
+    if (*p >= end) return -1;
+    int huffman = **p & 0x80;
+    size_t len;
+    if (get_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p)) return -1;
+
+    int n;
+    if (huffman) {
+        n = huff_decode(*p, len, out, room);
+    } else {
+        if (len > room) return -1;
+        memcpy(out, *p, len);
+        n = len;
+    }
+    *p += len;
+    return n;
+}
+
+static int put_string(uint8_t *out, size_t room, const char *s, size_t len) {//Huffman whenever it is shorter
+    size_t packed = huff_length(s, len);
+    int huffman = packed < len;
+    size_t size = huffman ? packed : len;
+
+    int n = put_int(out, room, huffman ? 0x80 : 0, 7, size);
+    if (n < 0 || room - n < size) return -1;
+    if (huffman) huff_encode(s, len, out + n);
+    else memcpy(out + n, s, len);
+    return n + size;
+}
+
+static const struct {
+    const char *name, *value;
+} staticTable[] = {
+    {NULL, NULL},//indices start at 1
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+};
+#define STATIC_COUNT 61
+
+void hpack_init(struct hpack *h, size_t maxSize) {
+    memset(h, 0, sizeof(*h));
+    h->maxSize = maxSize;
+    pthread_once(&huffOnce, huff_build);
+}
+
+static struct hpack_field *entry(struct hpack *h, int i) {//0 is the newest
+    return &h->ring[(h->head + i) % HPACK_ENTRIES];
+}
+
+static void evict(struct hpack *h, size_t need) {//oldest first until need more bytes fit
+    while (h->count > 0 && h->size + need > h->maxSize) {
+        struct hpack_field *f = entry(h, h->count - 1);
+        h->size -= f->nameLen + f->valueLen + 32;
+        free(f->name);
+        f->name = f->value = NULL;
+        h->count--;
+    }
+}
+
+void hpack_free(struct hpack *h) {
+    h->maxSize = 0;
+    evict(h, 0);
+}
+
+static int add(struct hpack *h, const char *name, size_t nameLen, const char *value, size_t valueLen) {
+    size_t size = nameLen + valueLen + 32;
+    evict(h, size);
+    if (size > h->maxSize) return 0;//bigger than the table: it just ends up empty
+
+    char *p = malloc(nameLen + valueLen + 2);
+    if (!p) return -1;
+    memcpy(p, name, nameLen);
+    p[nameLen] = '\0';
+    memcpy(p + nameLen + 1, value, valueLen);
+    p[nameLen + 1 + valueLen] = '\0';
+
+    h->head = (h->head + HPACK_ENTRIES - 1) % HPACK_ENTRIES;
+    struct hpack_field *f = entry(h, 0);
+    f->name = p;
+    f->nameLen = nameLen;
+    f->value = p + nameLen + 1;
+    f->valueLen = valueLen;
+    h->count++;
+    h->size += size;
+    return 0;
+}
+
+static void set_max(struct hpack *h, size_t maxSize) {
+    h->maxSize = maxSize;
+    evict(h, 0);
+}
+
+static int lookup(struct hpack *h, size_t index, const char **name, size_t *nameLen, const char **value, size_t *valueLen) {
+    if (index == 0) return -1;
+    if (index <= STATIC_COUNT) {
+        *name = staticTable[index].name;
+        *nameLen = strlen(*name);
+        *value = staticTable[index].value;
+        *valueLen = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= (size_t)h->count) return -1;
+    struct hpack_field *f = entry(h, index);
+    *name = f->name;
+    *nameLen = f->nameLen;
+    *value = f->value;
+    *valueLen = f->valueLen;
+    return 0;
+}
+
+int hpack_decode(struct hpack *h, const uint8_t *in, size_t len,
+                 int (*field)(void *arg, const char *name, size_t nameLen, const char *value, size_t valueLen),
+                 void *arg) {
+    const uint8_t *p = in, *end = in + len;
+    char nameBuf[HPACK_NAME_MAX], valueBuf[HPACK_VALUE_MAX];
+
+    while (p < end) {
+        uint8_t b = *p;
+        const char *name, *value;
+        size_t nameLen, valueLen, index;
+
+        if (b & 0x80) {//indexed field
+            if (get_int(&p, end, 7, &index) < 0 || lookup(h, index, &name, &nameLen, &value, &valueLen) < 0) return -1;
+        } else if ((b & 0xe0) == 0x20) {//dynamic table size update, never above what we advertised
+            if (get_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) return -1;
+            set_max(h, index);
+            continue;
+        } else {//literal, with incremental indexing (01), without (0000) or never indexed (0001)
+            int indexing = b & 0x40;
+            if (get_int(&p, end, indexing ? 6 : 4, &index) < 0) return -1;
+
+            if (index) {//copied, adding the field below may evict the one it names
+                if (lookup(h, index, &name, &nameLen, &value, &valueLen) < 0 || nameLen > sizeof(nameBuf)) return -1;
+                memcpy(nameBuf, name, nameLen);
+            } else {
+                int n = get_string(&p, end, nameBuf, sizeof(nameBuf));
+                if (n < 0) return -1;
+                nameLen = n;
+            }
+            int n = get_string(&p, end, valueBuf, sizeof(valueBuf));
+            if (n < 0) return -1;
+            name = nameBuf;
+            value = valueBuf;
+            valueLen = n;
+            if (indexing && add(h, name, nameLen, value, valueLen) < 0) return -1;
+        }
+        if (field(arg, name, nameLen, value, valueLen) < 0) return -1;
+    }
+    return 0;
+}
+
+int hpack_encode_size(struct hpack *h, uint8_t *out, size_t room, size_t maxSize) {
+    set_max(h, maxSize);
+    return put_int(out, room, 0x20, 5, maxSize);
+}
+
+static int named(const char *name, size_t nameLen, const char *s) {
+    return strlen(s) == nameLen && memcmp(name, s, nameLen) == 0;
+}
+
+static int changes_per_response(const char *name, size_t nameLen) {//indexing these would only churn the table
+    return named(name, nameLen, "content-length") || named(name, nameLen, "date") || named(name, nameLen, "etag") ||
+           named(name, nameLen, "last-modified") || named(name, nameLen, "content-range") || named(name, nameLen, "age") ||
+           named(name, nameLen, "expires");
+}
+
+int hpack_encode(struct hpack *h, uint8_t *out, size_t room,
+                 const char *name, size_t nameLen, const char *value, size_t valueLen) {
+    size_t nameIndex = 0;
+
+    for (int i = 1; i <= STATIC_COUNT; i++) {
+        if (!named(name, nameLen, staticTable[i].name)) continue;
+        if (named(value, valueLen, staticTable[i].value)) return put_int(out, room, 0x80, 7, i);
+        if (!nameIndex) nameIndex = i;
+    }
+    for (int i = 0; i < h->count; i++) {
+        struct hpack_field *f = entry(h, i);
+        if (f->nameLen != nameLen || memcmp(f->name, name, nameLen) != 0) continue;
+        if (f->valueLen == valueLen && memcmp(f->value, value, valueLen) == 0) {
+            return put_int(out, room, 0x80, 7, STATIC_COUNT + 1 + i);
+        }
+        if (!nameIndex) nameIndex = STATIC_COUNT + 1 + i;
+    }
+
+    int sensitive = named(name, nameLen, "set-cookie");
+    int indexing = !sensitive && !changes_per_response(name, nameLen);
+    int n = put_int(out, room, indexing ? 0x40 : sensitive ? 0x10 : 0, indexing ? 6 : 4, nameIndex);
+    if (n < 0) return -1;
+    if (!nameIndex) {
+        int m = put_string(out + n, room - n, name, nameLen);
+        if (m < 0) return -1;
+        n += m;
+    }
+    int m = put_string(out + n, room - n, value, valueLen);
+    if (m < 0) return -1;
+    if (indexing && add(h, name, nameLen, value, valueLen) < 0) return -1;
+    return n + m;
+}
@@ -0,0 +1,52 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HPACK (RFC 7541) header compression for the HTTP/2 front end.
+
+// Dynamic table size both directions start with (SETTINGS_HEADER_TABLE_SIZE)
+#define HPACK_TABLE_SIZE 4096
+
+// Longest header name and value we decode
+#define HPACK_NAME_MAX 256
+#define HPACK_VALUE_MAX 4096
+
+// Every entry costs its lengths plus 32, so this many always fit
+#define HPACK_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+struct hpack_field {
+    size_t nameLen, valueLen;
+    char *name, *value;     // one allocation, name first
+};
+
+// One dynamic table, owned by a decoder or an encoder. Entries are a ring,
+// newest at head, and are evicted from the tail as size exceeds maxSize.
+struct hpack {
+    struct hpack_field ring[HPACK_ENTRIES];
+    int head, count;
+    size_t size, maxSize;
+};
+
+void hpack_init(struct hpack *h, size_t maxSize);
+void hpack_free(struct hpack *h);
+
+// Decode a complete header block, calling field() for each header in order.
+// Returns 0, or -1 on a compression error (the connection has to go, since
+// the table is now out of step) or when field() returns -1.
+int hpack_decode(struct hpack *h, const uint8_t *in, size_t len,
+                 int (*field)(void *arg, const char *name, size_t nameLen, const char *value, size_t valueLen),
+                 void *arg);
+
+// Encode a dynamic table size update, first in a block after the peer's
+// SETTINGS_HEADER_TABLE_SIZE changed. Returns bytes written or -1.
+int hpack_encode_size(struct hpack *h, uint8_t *out, size_t room, size_t maxSize);
+
+// Encode one field, indexed when the tables have it, otherwise as a literal
+// that is added to the table unless it changes per response (dates, lengths,
+// validators) or is sensitive. Returns bytes written or -1 if out is full.
+int hpack_encode(struct hpack *h, uint8_t *out, size_t room,
+                 const char *name, size_t nameLen, const char *value, size_t valueLen);
+
+#endif // HPACK_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,33 +9,268 @@
 #include <fcntl.h> 
 #include <sys/wait.h>
 #include <errno.h> 
+#include <strings.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "httpserve.h"
+#include "range.h"
+#include "docroot.h"
+#include "urlpath.h"
+#include "pack.h"
+#include "uring.h"
+#include "pool.h"
+#include "prefork.h"
+#include "handoff.h"
+#include "admit.h"
+#include "ratelimit.h"
+#include "gate.h"
+#include "outq.h"
+#include "h2.h"
+#include "tls.h"
+#include "proxy.h"
+#include "cgicache.h"
+#include "router.h"
+#include "session.h"
+#include "co.h"
+#include "upload.h"
+#include "profile.h"
+#include "trace.h"
+#include "numa.h"
+#include "accesslog.h"
+#include "autoindex.h"
 #define BACKLOG 32 
 
 
+enum engine { ENGINE_BLOCKING, ENGINE_URING, ENGINE_POOL, ENGINE_CO };
+
+static struct {//command line options
+    int port;
+    const char *packPath;
+    enum engine engine;
+    int workers;            // pool engine threads, 0 means one per CPU
+    int prefork;            // worker processes, 0 serves from this process
+    const char *controlPath;// unix socket for listening-socket handoff between deploys
+    int backlog;            // listen() queue length
+    int maxInflight;        // connections in flight before new ones get a 503, 0 for no cap
+    const char *tlsCert;    // PEM certificate chain and key: serve TLS instead of cleartext
+    const char *tlsKey;
+    int numa;               // place pool workers and prefork processes by NUMA node
+} Options = {SERVER_PORT, NULL, ENGINE_BLOCKING, 0, 0, NULL, BACKLOG, 0, NULL, NULL, 0};
+
+static volatile sig_atomic_t reloadPack;//set by SIGHUP, handled between connections
+static volatile sig_atomic_t draining;//set by SIGQUIT: stop accepting, finish what is in flight
+
 void logMsg(const char *msg); //log function
+void parseargs(int argc, char *argv[]);
+static void add_routes(void);
+static void co_connections(int server_sock);
 char httpHead[2048];//buffer for http header
 
 int main(int argc, char *argv[]) {
-    int port = SERVER_PORT;//getting port num
-    if (argc > 1) {
-        port = atoi(argv[1]); //changing port num
-        if (port <= 0) {
-            fprintf(stderr, "invalid port. Defaulting to set port %d\n", SERVER_PORT);
-            port = SERVER_PORT;  
-        }
-    }
+    parseargs(argc, argv);//port and options
      logMsg("starting server...");//start log msg
-    start_server(port);
+    start_server(Options.port);
     logMsg("server stopped.");//end log msg
     return 0;
 }
 void logMsg(const char *msg) {//log function
     printf("%s\n", msg);
 }
+
+void parseargs(int argc, char *argv[]) {
+    add_routes();//defaults first, options may route paths elsewhere
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {//serve from a mkpack archive
+            Options.packPath = argv[++i];
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {//uring, pool, co or blocking
+            i++;
+            if (strcmp(argv[i], "uring") == 0) Options.engine = ENGINE_URING;
+            else if (strcmp(argv[i], "pool") == 0) Options.engine = ENGINE_POOL;
+            else if (strcmp(argv[i], "blocking") == 0) Options.engine = ENGINE_BLOCKING;
+            else if (strcmp(argv[i], "co") == 0) Options.engine = ENGINE_CO;
+            else {
+                fprintf(stderr, "unknown engine %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {//request threads of the pool engine
+            Options.workers = atoi(argv[++i]);
+            if (Options.workers <= 0) {
+                fprintf(stderr, "invalid worker count %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--prefork") == 0 && i + 1 < argc) {//master plus n worker processes
+            Options.prefork = atoi(argv[++i]);
+            if (Options.prefork <= 0) {
+                fprintf(stderr, "invalid process count %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {//take over from / hand over to another deploy
+            Options.controlPath = argv[++i];
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {//kernel accept queue
+            Options.backlog = atoi(argv[++i]);
+            if (Options.backlog <= 0) {
+                fprintf(stderr, "invalid backlog %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--max-inflight") == 0 && i + 1 < argc) {//admission cap for the pool, uring and co engines
+            Options.maxInflight = atoi(argv[++i]);
+            if (Options.maxInflight < 0) {
+                fprintf(stderr, "invalid in-flight cap %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[i], "--rate-ip") == 0 || strcmp(argv[i], "--rate-cgi") == 0) && i + 1 < argc) {//token buckets, rate[/burst]
+            enum ratelimit_kind kind = strcmp(argv[i], "--rate-ip") == 0 ? RATELIMIT_IP : RATELIMIT_CGI;
+            unsigned rate, burst;
+            if (ratelimit_parse(argv[++i], &rate, &burst) < 0) {
+                fprintf(stderr, "invalid rate %s, expected rate[/burst]\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            ratelimit_set(kind, rate, burst);
+        } else if (strcmp(argv[i], "--proxy") == 0 && i + 1 < argc) {//forward a path prefix to backends
+            if (proxy_add(argv[++i]) < 0) {
+                fprintf(stderr, "invalid proxy route %s, expected /prefix=host:port|unix:/path[,...]\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--upload") == 0 && i + 1 < argc) {//PUT and POST bodies under a prefix land in a directory
+            if (upload_add(argv[++i]) < 0) {
+                fprintf(stderr, "invalid upload mount %s, expected /prefix=directory\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--cgi-cache") == 0 && i + 1 < argc) {//megabytes of CGI output kept, per process
+            int megabytes = atoi(argv[++i]);
+            if (megabytes <= 0) {
+                fprintf(stderr, "invalid cache size %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            cgicache_init((size_t)megabytes << 20);
+        } else if (strcmp(argv[i], "--session-page") == 0 && i + 1 < argc) {//welcome page with a session cookie
+            if (argv[++i][0] != '/' || session_mount(argv[i]) < 0) {
+                fprintf(stderr, "invalid session page %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {//folded stacks of the live server, e.g. /debug/profile
+            if (argv[++i][0] != '/' || profile_mount(argv[i]) < 0) {
+                fprintf(stderr, "invalid profile path %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 2 < argc) {//phase timings of a percentage of requests, exported at a path
+            const char *path = argv[++i];
+            char *end;
+            double percent = strtod(argv[++i], &end);
+            if (path[0] != '/' || *end || end == argv[i] || trace_mount(path, percent) < 0) {
+                fprintf(stderr, "invalid trace %s %s, expected /path percent\n", path, argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--access-log") == 0 && i + 1 < argc) {//binary record of every request, for replay
+            if (accesslog_open(argv[++i]) < 0 || trace_follow_all() < 0) {
+                fprintf(stderr, "cannot open access log %s: %s\n", argv[i], strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--autoindex") == 0) {//list directories beneath www/
+            autoindex_enable();
+        } else if (strcmp(argv[i], "--numa") == 0) {//pin workers by node, connections to the node that received them
+            Options.numa = 1;
+        } else if (strcmp(argv[i], "--tls") == 0 && i + 2 < argc) {//certificate chain and private key, PEM
+            Options.tlsCert = argv[++i];
+            Options.tlsKey = argv[++i];
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [port] [--pack file] [--engine uring|pool|co|blocking] [--workers n] [--prefork n] [--control socket]\n"
+                            "          [--backlog n] [--max-inflight n] [--rate-ip r[/b]] [--rate-cgi r[/b]] [--tls cert.pem key.pem]\n"
+                            "          [--proxy /prefix=backend[,backend...]] [--cgi-cache MB] [--session-page /path]\n"
+                            "          [--upload /prefix=directory] [--profile /path] [--trace /path percent] [--numa]\n"
+                            "          [--access-log file] [--autoindex]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        } else {
+            Options.port = atoi(argv[i]); //changing port num
+            if (Options.port <= 0) {
+                fprintf(stderr, "invalid port. Defaulting to set port %d\n", SERVER_PORT);
+                Options.port = SERVER_PORT;  
+            }
+        }
+    }
+}
+
+static void on_sighup(int sig) {//deploy finished: remap the pack
+    (void)sig;
+    reloadPack = 1;
+}
+
+static void on_sigquit(int sig) {//graceful stop, also how a deploy retires us
+    (void)sig;
+    if (!draining) alarm(HANDOFF_DRAIN_SECS);//whatever is still running at the deadline is cut off
+    draining = 1;
+}
+
+int server_draining(void) {
+    return draining;
+}
+
+static void serve(int server_sock) {//run the chosen engine on the listening socket
+    enum engine engine = Options.engine;
+    proxy_start();//per process, prefork workers each check for themselves
+    if (engine == ENGINE_URING && tls_enabled()) {//handshakes need the gate's event loop, the ring has no place for them
+        logMsg("TLS runs on the pool engine");
+        engine = ENGINE_POOL;
+    }
+    if (engine == ENGINE_URING && uring_serve(server_sock) < 0) {//falls through to the accept loop on kernels without it
+        logMsg("io_uring unavailable, using the blocking accept loop");
+        engine = ENGINE_BLOCKING;
+    }
+    if (engine == ENGINE_POOL) {
+        int workers = Options.workers ? Options.workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        pool_serve(server_sock, workers > 0 ? workers : 1);
+    }
+    if (engine == ENGINE_BLOCKING) handle_connections(server_sock);
+    if (engine == ENGINE_CO) co_connections(server_sock);
+    tls_drain();//relayed responses may still be on their way out
+}
+
 void start_server(int port) {//beginnninng of server
-    int server_sock = create_socket(port);//call to each function
-    handle_connections(server_sock);
+    if (Options.packPath) {//map the asset pack before taking traffic
+        if (pack_load(Options.packPath) < 0) {
+            perror("Error loading pack");
+            exit(EXIT_FAILURE);
+        }
+        struct sigaction sa = {0};
+        sa.sa_handler = on_sighup;//no SA_RESTART so accept() wakes up
+        sigaction(SIGHUP, &sa, NULL);
+    }
+
+    if (docroot_open(DOCROOT_DIR) < 0) {//pin www/ once, every lookup is relative to it
+        if (!Options.packPath) {
+            perror("Error opening document root");
+            exit(EXIT_FAILURE);
+        }
+        logMsg("no www/ directory, serving from the pack only");
+    }
+    admit_init(Options.maxInflight);
+    if (Options.numa) {//before any worker thread or process exists, they inherit placement
+        char lgbuff[64];
+        snprintf(lgbuff, sizeof(lgbuff), "NUMA: %d nodes", numa_init());
+        logMsg(lgbuff);
+    }
+    if (Options.tlsCert && tls_init(Options.tlsCert, Options.tlsKey) < 0) {//before prefork, so the workers share ticket keys
+        fprintf(stderr, "Error loading TLS certificate %s or key %s\n", Options.tlsCert, Options.tlsKey);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);//sendfile() has no MSG_NOSIGNAL; a client hanging up is an error return, not a kill
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_sigquit;//no SA_RESTART so accept() wakes up
+    sigaction(SIGQUIT, &sa, NULL);
+
+    int server_sock = Options.controlPath ? handoff_receive(Options.controlPath) : -1;//a running server hands its socket over
+    if (server_sock >= 0) logMsg("took over the listening socket");
+    else if ((server_sock = handoff_inherited()) >= 0) logMsg("using the inherited listening socket");
+    else server_sock = create_socket(port);//call to each function
+
+    if (Options.controlPath && handoff_listen(Options.controlPath, server_sock) < 0) {//so the next deploy can take over from us
+        perror("Error opening control socket");
+        exit(EXIT_FAILURE);
+    }
+    if (Options.prefork) prefork_serve(server_sock, Options.prefork, serve);//bound once, shared by every worker
+    else serve(server_sock);
     close(server_sock);
 }
 
@@ -58,7 +294,7 @@ int create_socket(int port) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(sockfd, BACKLOG) < 0) {//listening on socket
+    if (listen(sockfd, Options.backlog) < 0) {//listening on socket
         perror("Error listening on socket");//error msg check
         close(sockfd);
         exit(EXIT_FAILURE);
@@ -67,38 +303,203 @@ int create_socket(int port) {
     return sockfd;
 }
 
-void handle_connections(int server_sock) {
+int server_tick(void) {
+    ratelimit_report();
+    if (reloadPack) {//swap in the freshly deployed pack
+        reloadPack = 0;
+        if (pack_reload() < 0) perror("pack reload failed, keeping the old one");
+        else logMsg("pack reloaded");
+        return 1;
+    }
+    return 0;
+}
+
+static int blocking_accepted(int client_sock, const struct sockaddr_in *client_addr) {
+    if (ratelimit_take(RATELIMIT_IP, client_addr->sin_addr.s_addr, NULL) < 0) {//before a single byte is parsed
+        ratelimit_refuse(client_sock);
+        return -1;
+    }
+      logMsg("New connection accepted");//logging
+    score_accepted();
+    return 0;
+}
 
-    struct sockaddr_in client_addr;//structure for client
+static void blocking_ready(int client_sock) {
+    process_request(client_sock);
+    score_done();
+}
+
+static void blocking_expired(int client_sock) {
+    (void)client_sock;
+    score_done();
+}
 
-    socklen_t client_addrlen = sizeof(client_addr);//settingn size
+static const struct gate_ops blocking_ops = {blocking_accepted, blocking_ready, blocking_expired, NULL, NULL};
 
+struct co_task {
     int client_sock;
+    int len;
+    uint64_t readyAt;               // head in, from here it waits for the scheduler
+    char buff[REQUEST_SIZE];
+};
 
-    while ((client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addrlen)) >= 0) {//accepting connection
+static int coThreads;//requests the co engine moved to threads, still running
 
-          logMsg("New connection accepted");//logging
-        process_request(client_sock);
+static void co_thread_done(void) {
+    score_done();
+    admit_done();
+    __atomic_fetch_sub(&coThreads, 1, __ATOMIC_RELAXED);
+}
+
+static void co_request(void *arg) {//one request on its own stack; waits on the client or a child yield to the others
+    struct co_task *t = arg;
+    if (admit_dequeue(t->readyAt) < 0) {//the run queue has been standing for too long
+        admit_shed(t->client_sock);
+        free(t);
+        score_done();
+        admit_done();
+        return;
+    }
+    trace_begin(t->client_sock);
+    trace_phase(TRACE_READ);
+    t->len = co_read(t->client_sock, t->buff, sizeof(t->buff) - 1, GATE_BODY_SECS * 1000);
+    if (t->len <= 0) {
+        trace_drop();
+        close(t->client_sock);
+    } else {
+        t->buff[t->len] = '\0';
+        if (h2_wanted(t->buff, t->len) || proxy_wanted(t->buff) || upload_wanted(t->buff) || profile_wanted(t->buff)) {//they hold on for long or write to disk
+            __atomic_fetch_add(&coThreads, 1, __ATOMIC_RELAXED);
+            if (dispatch_detached(t->client_sock, t->buff, t->len, co_thread_done) == 0) {
+                free(t);
+                return;
+            }
+            __atomic_fetch_sub(&coThreads, 1, __ATOMIC_RELAXED);
+        }
+        dispatch_request(t->client_sock, t->buff, t->len);
     }
+    free(t);
+    score_done();
+    admit_done();
+}
 
-    if (client_sock < 0) {
+static int co_accepted(int client_sock, const struct sockaddr_in *client_addr) {
+    if (blocking_accepted(client_sock, client_addr) < 0) return -1;
+    if (admit_accept() < 0) {//at the cap: thousands may be in flight on the one thread, answer before holding another
+        score_done();
+        admit_shed(client_sock);
+        return -1;
+    }
+    return 0;
+}
 
-        perror("error accepting");
+static void co_ready(int client_sock) {
+    struct co_task *t = malloc(sizeof(*t));
+    if (t) {
+        t->client_sock = client_sock;
+        t->readyAt = admit_now();
+        if (co_spawn(co_request, t) == 0) return;
+        free(t);
     }
+    blocking_ready(client_sock);//no stack to be had: run it to the end right here
+    admit_done();
+}
+
+static void co_expired(int client_sock) {
+    blocking_expired(client_sock);
+    admit_done();
+}
+
+static int co_inflight(void) {
+    return co_run() + __atomic_load_n(&coThreads, __ATOMIC_RELAXED);
+}
+
+static const struct gate_ops co_ops = {co_accepted, co_ready, co_expired, co_fd, co_inflight};
+
+static void co_connections(int server_sock) {
+    if (gate_serve(server_sock, &co_ops) < 0) return;//one thread, every request in flight on it at once
+    logMsg("drained");
+}
+
+void handle_connections(int server_sock) {
+    if (gate_serve(server_sock, &blocking_ops) < 0) return;//held until the head is in, so a silent client never owns the loop
+    logMsg("drained");//one connection at a time, nothing is left in flight
 }
 
 
 void process_request(int client_sock) {
-    char buff[4096]; //buffer for request
+    char buff[REQUEST_SIZE]; //buffer for request
 
-    int bytes_read = read(client_sock, buff, sizeof(buff) - 1); // Read the request from the client socket
+    int bytes_read;
+    trace_begin(client_sock);
+    trace_phase(TRACE_READ);
+    do {
+        bytes_read = read(client_sock, buff, sizeof(buff) - 1); // Read the request from the client socket
+    } while (bytes_read < 0 && errno == EINTR);//SIGHUP/SIGQUIT must not cost the client its request
 
     if (bytes_read <= 0) {//error check forreaing 
+        trace_drop();
         close(client_sock);
         return;
     }
 
-    buff[bytes_read] = '\0'; //null terminate for string tokenization
+    dispatch_request(client_sock, buff, bytes_read);
+}
+
+int spawn_detached(void *(*fn)(void *), void *arg) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, saved;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int err = pthread_create(&thread, &attr, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+struct detached {
+    int client_sock;
+    int len;
+    struct trace_record *trace;
+    void (*done)(void);
+    char buff[REQUEST_SIZE];
+};
+
+static void *detached_main(void *arg) {
+    struct detached *d = arg;
+    trace_attach(d->trace);
+    dispatch_request(d->client_sock, d->buff, d->len);
+    d->done();
+    free(d);
+    return NULL;
+}
+
+int dispatch_detached(int client_sock, const char *buff, int len, void (*done)(void)) {
+    struct detached *d = malloc(sizeof(*d));
+    if (!d) return -1;
+    d->client_sock = client_sock;
+    d->len = len;
+    d->done = done;
+    memcpy(d->buff, buff, len);
+    d->trace = trace_detach();
+    if (spawn_detached(detached_main, d) == 0) return 0;
+    trace_attach(d->trace);
+    free(d);
+    return -1;
+}
+
+void dispatch_request(int client_sock, char *buff, int len) {
+    trace_begin(client_sock);//engines that read the request themselves have begun already
+    trace_phase(TRACE_ROUTE);
+    if (h2_dispatch(client_sock, buff, len)) {//prior knowledge or Upgrade: h2c, the whole connection is served there
+        trace_drop();
+        return;
+    }
+
+    buff[len] = '\0'; //null terminate for string tokenization
 
     char *method, *path, *protocol, *saveptr;
 
@@ -112,171 +513,434 @@ void process_request(int client_sock) {
         fprintf(stderr, "Invalid HTTP request line\n");
 
         close(client_sock);
+        trace_end();
         return;
     }
-    char lgbuff[1024];//buffer for log msg
 
-    snprintf(lgbuff, sizeof(lgbuff), "Received %s request for %s", method, path);
-    logMsg(lgbuff);
-    
-    if (strcmp(method, "GET") == 0) {//checking for method and calling its function
-        handle_get_request(client_sock, path);
+    const char *headers = saveptr ? saveptr : "";//rest of the buffer is the header block
+    if (*headers == '\n') headers++;
 
-    } else if (strcmp(method, "HEAD") == 0) {
-        handle_head_request(client_sock, path);
+    char canon[URLPATH_MAX];//decoded, normalized path used for the cache and the filesystem
+    const char *query;
+    int pathFlags;
 
-    } else if (strcmp(method, "POST") == 0) {
-        handle_post_request(client_sock, path);
+    if (normalize_target(path, canon, sizeof(canon), &query, &pathFlags) < 0 || (pathFlags & URLPATH_BAD_UTF8)) {
+        const char *response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        outq_send(client_sock, response, strlen(response));
+        close(client_sock);
+        trace_end();
+        return;
+    }
+    trace_describe(method, canon, path, headers);
+    struct request req = {client_sock, router_method(method), method, path, canon, query, headers, buff + len};
 
-    } else {
+    char lgbuff[URLPATH_MAX + 64];//buffer for log msg
+
+    snprintf(lgbuff, sizeof(lgbuff), "Received %s request for %s", method, canon);
+    logMsg(lgbuff);
+
+    void *arg;
+    router_handler handler = router_match(req.method, canon, &arg);
+    if (handler) {
+        trace_phase(TRACE_HANDLER);
+        handler(&req, arg);
+
+    } else if (req.method == ROUTER_OTHER) {
                const char *response = "HTTP/1.1 501 Not a method\r\nContent-Length: 0\r\n\r\n";//just incase of wrong methof
-        send(client_sock, response, strlen(response), 0);
+        outq_send(client_sock, response, strlen(response));
+
+    } else {//a method we know, nothing serves it here
+        const char *response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        outq_send(client_sock, response, strlen(response));
     }
     close(client_sock); // Close the client socket after handling the request
+    trace_end();
 }
 
-void handle_get_request(int client_sock, const char* path) {
-    char fPath[1024];//giving buffer for file pth
+static void route_static(const struct request *req, void *arg) {//docroot and pack files, the catch-all
+    (void)arg;
+    if (autoindex_enabled() && autoindex_serve(req)) return;//a directory: its listing
+    if (req->method == ROUTER_HEAD) handle_head_request(req->sock, req->path, req->headers);
+    else handle_get_request(req->sock, req->path, req->headers);
+}
 
-   
-    if (strcmp(path, "/") == 0) {//mapping path to correct file path
-        strcpy(fPath, "www/index.html");  
-    } else {
-                snprintf(fPath, sizeof(fPath), "www%s", path);// snprintf to avoid buffer overfloW
+static void route_cgi(const struct request *req, void *arg) {
+    (void)arg;
+    handle_post_request(req->sock, req->path, req->headers);
+}
+
+static void add_routes(void) {
+    if (router_add(ROUTER_GET, "/*", route_static, NULL) < 0 || router_add(ROUTER_HEAD, "/*", route_static, NULL) < 0 ||
+        router_add(ROUTER_POST, "*.cgi", route_cgi, NULL) < 0) {
+        fprintf(stderr, "Error setting up routes\n");
+        exit(EXIT_FAILURE);
     }
-     const char* mime_type = get_mime_type(fPath);//getting mime type
+}
 
-    if (mime_type == NULL) {  //error responses 415 invalid media type
-        send_response(client_sock, "HTTP/1.1 415 Unsupported Media Type", "text/plain", "415 Unsupported Media Type: file type not supported", 0);
-        return;
+static int format_entity_header(char *out, size_t len, const char *mime, off_t size, const char *etag,
+                                const char *lastMod, const char *extraHeaders) {
+    return snprintf(out, len,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Length: %lld\r\n"
+                    "Accept-Ranges: bytes\r\n"
+                    "ETag: %s\r\n"
+                    "Last-Modified: %s\r\n"
+                    "%s\r\n",
+                    mime, (long long)size, etag, lastMod, extraHeaders);
+}
+
+// Send a 200 (or 206/416 when a Range applies) for size bytes of fd starting at base.
+// extraHeaders is inserted verbatim, headOnly skips the body.
+static void send_entity(int client_sock, const char *headers, int fd, off_t base, off_t size, const char *mime,
+                        const char *etag, time_t mtime, const char *extraHeaders, int headOnly) {
+    trace_phase(TRACE_SEND);
+    char lastMod[64], value[512];
+    http_date(mtime, lastMod, sizeof(lastMod));
+
+    if (!headOnly && get_header(headers, "Range", value, sizeof(value))) {//partial content if the client asked and it still matches
+        char ifRange[128];
+        if (!get_header(headers, "If-Range", ifRange, sizeof(ifRange)) || if_range_matches(ifRange, etag, mtime)) {
+            struct byte_range ranges[MAX_RANGES];
+            int count = parse_range(value, size, ranges, MAX_RANGES);
+
+            if (count < 0) {
+                send_range_not_satisfiable(client_sock, size);
+                return;
+            }
+            if (count > 0) {
+                if (send_ranges(client_sock, fd, base, size, mime, etag, lastMod, ranges, count) < 0) {
+                    perror("sending ranges failed");
+                }
+                return;
+            }
+        }
     }
 
-    struct stat pathStat;
+    char header[STATIC_HEADER_SIZE];//full entity
+    int headLength = format_entity_header(header, sizeof(header), mime, size, etag, lastMod, extraHeaders);
+    struct outq q;
+    outq_init(&q, client_sock);
+    outq_copy(&q, header, headLength);
+    if (!headOnly) outq_file(&q, fd, base, size, NULL, NULL);//zero-copy body, sent behind the header
+    outq_finish(&q);
+}
 
-    if (stat(fPath, &pathStat) < 0) {//checking for file
-        send_response(client_sock, "HTTP/1.1 404 Not Found", "text/html", "404 Not Found: file not found.", 0);
-        return;
+static int accepts_gzip(const char *headers) {//gzip listed in Accept-Encoding and not refused with q=0
+    char value[512];
+    if (!get_header(headers, "Accept-Encoding", value, sizeof(value))) return 0;
+
+    const char *p = strcasestr(value, "gzip");
+    if (!p) return 0;
+    p += 4;
+    while (*p == ' ') p++;
+    if (*p != ';') return 1;
+    p++;
+    while (*p == ' ') p++;
+    if (strncasecmp(p, "q=", 2) != 0) return 1;
+    return strtod(p + 2, NULL) > 0;
+}
+
+// Pick the gzip or identity payload of a pack entry for this request. Fills
+// etag (etagSize bytes), offset and size and returns the extra headers the
+// choice needs.
+static const char *pack_variant(const struct pack *pack, const struct pack_entry *e, const char *headers,
+                                char *etag, size_t etagSize, off_t *offset, off_t *size) {
+    const char *identityEtag = pack_string(pack, e->etagOffset);
+    char value[8];
+
+    if (e->gzSize > 0 && accepts_gzip(headers) && !get_header(headers, "Range", value, sizeof(value))) {//precompressed variant, its own ETag
+        snprintf(etag, etagSize, "%.*s-gz\"", (int)strlen(identityEtag) - 1, identityEtag);
+        *offset = e->gzOffset;
+        *size = e->gzSize;
+        return "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
     }
+    snprintf(etag, etagSize, "%s", identityEtag);
+    *offset = e->offset;
+    *size = e->size;
+    return e->gzSize > 0 ? "Vary: Accept-Encoding\r\n" : "";
+}
 
-    int fileFd = open(fPath, O_RDONLY);//opening file
+static int serve_from_pack(int client_sock, const char *path, const char *headers, int headOnly) {//returns 1 if the pack answered
+    struct pack *pack = pack_acquire();
+    if (!pack) return 0;
 
-    if (fileFd < 0) {
-        perror("file open failed");
-        send_response(client_sock, "HTTP/1.1 404 Not Found", "text/html", "404 Not Found: file not found.", 0);
+    const struct pack_entry *e = pack_find(pack, path);
+    if (!e) {
+        pack_release(pack);
+        return 0;
+    }
+
+    const char *mime = pack_string(pack, e->mimeOffset);
+    char etag[PACK_ETAG_LEN + 8];
+    off_t offset, size;
+    const char *extra = pack_variant(pack, e, headers, etag, sizeof(etag), &offset, &size);
+
+    send_entity(client_sock, headers, pack_fd(pack), offset, size, mime, etag, e->mtime, extra, headOnly);
+    pack_release(pack);
+    return 1;
+}
+
+void handle_get_request(int client_sock, const char* path, const char* headers) {
+    trace_phase(TRACE_OPEN);
+     const char* mime_type = get_mime_type(strcmp(path, "/") == 0 ? "index.html" : path);//getting mime type
+
+    if (mime_type == NULL) {  //error responses 415 invalid media type
+        send_response(client_sock, "HTTP/1.1 415 Unsupported Media Type", "text/plain", "415 Unsupported Media Type: file type not supported", 0);
         return;
     }
 
-    if (fstat(fileFd, &pathStat) < 0) {//checking for file stats
-        perror("Failed to get file statistics");
-        send_response(client_sock, "HTTP/1.1 500 Internal Server Error", "text/html", "500 Internal Server Error: Couldnt get info.", 0);
-        close(fileFd);
+    if (serve_from_pack(client_sock, path, headers, 0)) {//packed assets never touch the filesystem
         return;
     }
 
-    char *fileCont = malloc(pathStat.st_size + 1);//allocating memory for file content
+    int err = ENOENT;
+    struct docroot_entry *file = docroot_fd() >= 0 ? docroot_get(path, &err) : NULL;//resolved beneath www/, usually straight from the cache
 
-    if (fileCont == NULL || read(fileFd, fileCont, pathStat.st_size) < 0) {//reading file
-        perror("unable to read file");
-        send_response(client_sock, "HTTP/1.1 500 Internal Server Error", "text/html", "500 Internal Server Error: unable to read file.", 0);
-        free(fileCont);
-        close(fileFd);
+    if (file == NULL) {
+        if (err == EACCES) {
+            send_response(client_sock, "HTTP/1.1 400 Bad Request", "text/html", "400 Bad Request: invalid path.", 0);
+        } else {
+            send_response(client_sock, "HTTP/1.1 404 Not Found", "text/html", "404 Not Found: file not found.", 0);
+        }
         return;
     }
-    fileCont[pathStat.st_size] = '\0';//null terminate
-
-    
-    send_response(client_sock, "HTTP/1.1 200 OK", mime_type, fileCont, pathStat.st_size);//sending response to client
 
-    free(fileCont);//free file content
-    close(fileFd);//close file descriptor
-}
+    if (!S_ISREG(file->st.st_mode)) {//directories and devices are not served
+        send_response(client_sock, "HTTP/1.1 404 Not Found", "text/html", "404 Not Found: file not found.", 0);
+        docroot_put(file);
+        return;
+    }
 
+    char etag[64];//validator for caching and If-Range
+    make_etag(&file->st, etag, sizeof(etag));
 
-void handle_head_request(int client_sock, const char* path) {
-    char fPath[512]; //setting up buffer for file path
+    send_entity(client_sock, headers, file->fd, 0, file->st.st_size, mime_type, etag, file->st.st_mtime, "", 0);
+    docroot_put(file);//release the cache reference
+}
 
-   
-    if (strcmp(path, "/") == 0) {//mapping path to correct file path
-        strcpy(fPath, "www/index.html");
 
-    } else {
-            snprintf(fPath, sizeof(fPath), "www%s", path);
+void handle_head_request(int client_sock, const char* path, const char* headers) {
+    trace_phase(TRACE_OPEN);
+    if (serve_from_pack(client_sock, path, headers, 1)) {//same headers a GET would get
+        return;
     }
 
-    
-    if (strstr(path, "..") != NULL) {//checking for invalid path
+    int err = ENOENT;
+    struct docroot_entry *file = docroot_fd() >= 0 ? docroot_get(path, &err) : NULL;//same resolution as GET
+
+    if (file == NULL && err == EACCES) {//checking for invalid path
         const char *errorMsg = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
-        send(client_sock, errorMsg, strlen(errorMsg), 0);
+        outq_send(client_sock, errorMsg, strlen(errorMsg));
         return;
     }
 
-    struct stat fStat;//structing file stats
-
-    if (stat(fPath, &fStat) < 0 || S_ISDIR(fStat.st_mode)) {//if file not found or its a directory
+    if (file == NULL || S_ISDIR(file->st.st_mode)) {//if file not found or its a directory
                const char *notFound = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-        send(client_sock, notFound, strlen(notFound), 0);
+        outq_send(client_sock, notFound, strlen(notFound));
+        if (file) docroot_put(file);
         return;
     }
 
-    
-    char header[256];//buffer for header
+    char etag[64];
+    make_etag(&file->st, etag, sizeof(etag));
+    const char *mime_type = get_mime_type(strcmp(path, "/") == 0 ? "index.html" : path);
 
-    snprintf(header, sizeof(header),//printing out header
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: %s\r\n"  
-             "Content-Length: %lld\r\n\r\n", get_mime_type(fPath), (long long)fStat.st_size);
-    send(client_sock, header, strlen(header), 0);//send to client
+    send_entity(client_sock, headers, file->fd, 0, file->st.st_size, mime_type ? mime_type : "application/octet-stream",
+                etag, file->st.st_mtime, "", 1);
+    docroot_put(file);
 }
 
-void handle_post_request(int client_sock, const char* path) {// this is an attempt to handle post request. not finished 
-    char fPath[512];  //another buff
-
-    if (strcmp(path, "/") == 0) {//mapping once again
-        strcpy(fPath, "www/index.html"); 
-
+int open_static_file(char *buff, struct static_file *sf) {
+    char *saveptr;
+    char *method = strtok_r(buff, " ", &saveptr);
+    char *path = strtok_r(NULL, " ", &saveptr);
+    char *protocol = strtok_r(NULL, "\r\n", &saveptr);
+
+    if (!method || !path || !protocol) return 0;
+    int headOnly = strcmp(method, "HEAD") == 0;
+    if (!headOnly && strcmp(method, "GET") != 0) return 0;
+
+    const char *headers = saveptr ? saveptr : "";
+    if (*headers == '\n') headers++;
+
+    char canon[URLPATH_MAX], value[8];
+    const char *query;
+    int pathFlags;
+    if (normalize_target(path, canon, sizeof(canon), &query, &pathFlags) < 0 || (pathFlags & URLPATH_BAD_UTF8)) return 0;
+    if (get_header(headers, "Range", value, sizeof(value))) return 0;//partial responses take the general route
+    if (get_header(headers, "HTTP2-Settings", value, sizeof(value))) return 0;//so does an h2c upgrade
+    if (router_match(headOnly ? ROUTER_HEAD : ROUTER_GET, canon, NULL) != route_static) return 0;//and anything another handler answers
+
+    const char *mime = get_mime_type(strcmp(canon, "/") == 0 ? "index.html" : canon);
+    if (!mime && !headOnly) return 0;
+
+    char etag[64], lastMod[64];
+    const char *extra = "";
+    memset(sf, 0, sizeof(*sf));
+
+    struct pack *pack = pack_acquire();
+    const struct pack_entry *e = pack ? pack_find(pack, canon) : NULL;
+    if (e) {
+        sf->pack = pack;
+        sf->fd = pack_fd(pack);
+        mime = pack_string(pack, e->mimeOffset);
+        extra = pack_variant(pack, e, headers, etag, sizeof(etag), &sf->offset, &sf->size);
+        http_date(e->mtime, lastMod, sizeof(lastMod));
     } else {
-            snprintf(fPath, sizeof(fPath), "www%s", path);
+        if (pack) pack_release(pack);
+
+        int err;
+        struct docroot_entry *file = docroot_fd() >= 0 ? docroot_get(canon, &err) : NULL;
+        if (!file) return 0;
+        if (!S_ISREG(file->st.st_mode)) {
+            docroot_put(file);
+            return 0;
+        }
+        sf->entry = file;
+        sf->fd = file->fd;
+        sf->offset = 0;
+        sf->size = file->st.st_size;
+        make_etag(&file->st, etag, sizeof(etag));
+        http_date(file->st.st_mtime, lastMod, sizeof(lastMod));
     }
 
-    if (strstr(fPath, ".cgi") != NULL) {//checking for cgi file
-        int pid = fork();  
+    sf->headLength = format_entity_header(sf->header, sizeof(sf->header), mime ? mime : "application/octet-stream",
+                                          sf->size, etag, lastMod, extra);
+    if (headOnly) sf->size = 0;
 
-        if (pid == 0) {   //waitpidforking process
-            
-            setenv("REQUEST_METHOD", "POST", 1);//setting up env variables
+    trace_describe(method, canon, path, headers);
+    char lgbuff[URLPATH_MAX + 64];//same log line as the general route
+    snprintf(lgbuff, sizeof(lgbuff), "Received %s request for %s", method, canon);
+    logMsg(lgbuff);
+    return 1;
+}
 
-            
-            dup2(client_sock, STDOUT_FILENO);
-            dup2(client_sock, STDERR_FILENO);
+void close_static_file(struct static_file *sf) {
+    if (sf->entry) docroot_put(sf->entry);
+    if (sf->pack) pack_release(sf->pack);
+    sf->entry = NULL;
+    sf->pack = NULL;
+}
 
-            
-            execl(fPath, fPath, NULL);//executing cgi script
-            perror("didnt execute cgi script");
-            exit(EXIT_FAILURE);
+static void send_captured(int client_sock, int fd, off_t size) {//script output kept in a memfd goes out like a static file
+    trace_phase(TRACE_SEND);
+    struct outq q;
+    outq_init(&q, client_sock);
+    outq_file(&q, fd, 0, size, NULL, NULL);
+    outq_finish(&q);
+}
+
+void handle_post_request(int client_sock, const char* path, const char* headers) {// this is an attempt to handle post request. not finished 
+    trace_phase(TRACE_OPEN);
+    int err = ENOENT;
+    struct docroot_entry *script = docroot_fd() >= 0 ? docroot_get(path, &err) : NULL;//same traversal rules as every other method
+
+    if (script == NULL || !S_ISREG(script->st.st_mode)) {
+        const char *errorMsg = script == NULL && err == EACCES
+            ? "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n"
+            : "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        outq_send(client_sock, errorMsg, strlen(errorMsg));
+        if (script) docroot_put(script);
+        return;
+    }
 
-        } else if (pid > 0) {  
-            int status;
+    char key[REQUEST_SIZE + 256];//the whole head fits, so no value is ever too long for it
+    struct cgicache_response *cached = NULL;
+    struct cgicache_slot *slot = NULL;
+    if (cgicache_enabled() && cgicache_key(key, sizeof(key), "POST", path, headers) >= 0 &&
+        cgicache_lookup(key, &cached, &slot) == CGICACHE_HIT) {//no fork, no rate limit: nothing runs
+        send_captured(client_sock, cached->fd, cached->size);
+        cgicache_release(cached);
+        docroot_put(script);
+        return;
+    }
+
+    if (ratelimit_enabled(RATELIMIT_CGI) && ratelimit_take(RATELIMIT_CGI, ratelimit_peer(client_sock), path) < 0) {//no fork for this client
+        const char *tooMany = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+        outq_send(client_sock, tooMany, strlen(tooMany));
+        if (slot) cgicache_fill(slot, -1, 0, 0);//whoever waits on this run has to try for themselves
+        docroot_put(script);
+        return;
+    }
+
+    int out = client_sock;//the script writes straight to the client, or into a memfd when its output may be kept
+    if (slot && (out = memfd_create("cgi", MFD_CLOEXEC)) < 0) {
+        cgicache_fill(slot, -1, 0, 0);
+        slot = NULL;
+        out = client_sock;
+    }
 
-            waitpid(pid, &status, 0); 
+    trace_phase(TRACE_CGI_FORK);
+    extern char **environ;
+    size_t envCount = 0;
+    while (environ[envCount]) envCount++;
+    char **envp = malloc((envCount + 2) * sizeof(*envp));//built before fork, other threads may hold the malloc lock
+    if (envp) {
+        envp[0] = "REQUEST_METHOD=POST";//setting up env variables
+        memcpy(envp + 1, environ, (envCount + 1) * sizeof(*envp));
+    }
 
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {//checking exiting statis
-                const char *errorMsg = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
-                send(client_sock, errorMsg, strlen(errorMsg), 0);
+    int pid = envp ? fork() : -1;
+
+    if (pid == 0) {   //waitpidforking process
+        
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);//engines may ignore it, the script should not inherit that
+
+        char *argv[] = { (char *)path, NULL };
+        fexecve(dup(script->fd), argv, envp);//executing the resolved file, dup drops close-on-exec for #! scripts
+        perror("didnt execute cgi script");
+        _exit(127);//no atexit handlers: they belong to the server, not to this copy of it
+
+    } else if (pid > 0) {  
+        int status, captured = 0;//a failed run whose output was held back
+
+        trace_phase(TRACE_CGI_RUN);
+        co_wait_child(pid, &status);//yields to other requests under the co engine
+        trace_phase(TRACE_SEND);
+
+        if (slot) {
+            off_t size = lseek(out, 0, SEEK_END);//the script's writes moved the shared offset
+            int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0, ttl = 0;
+            char head[REQUEST_SIZE];
+            ssize_t n = ok ? pread(out, head, sizeof(head) - 1, 0) : -1;
+            if (n > 0) {
+                head[n] = '\0';
+                ttl = cgicache_ttl(head);
+            }
+            if (!ok) {//a failed run is neither kept nor shared, the client gets the 500 below and none of its output
+                cgicache_fill(slot, -1, 0, 0);
+                close(out);
+                captured = 1;
+            } else if ((cached = cgicache_fill(slot, out, size, ttl))) {//kept, or at least handed to whoever waited
+                send_captured(client_sock, cached->fd, cached->size);
+                cgicache_release(cached);
             }
+            slot = NULL;
+        }
 
-        } else { 
+        if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || captured) {//checking exiting statis
             const char *errorMsg = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
-            send(client_sock, errorMsg, strlen(errorMsg), 0);
+            outq_send(client_sock, errorMsg, strlen(errorMsg));
         }
 
-    } else {
-       
-        const char *notFound = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-        send(client_sock, notFound, strlen(notFound), 0);
+    } else { 
+        const char *errorMsg = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        outq_send(client_sock, errorMsg, strlen(errorMsg));
+    }
+    if (slot) {//the fork failed
+        cgicache_fill(slot, -1, 0, 0);
+        close(out);
     }
+
+    free(envp);
+    docroot_put(script);
 }
 
 void send_response(int client_sock, const char *header, const char *content_type, const char *body, int body_length) {
+    trace_phase(TRACE_SEND);
     char responseHead[1024]; //buffer for response header
 
     
@@ -288,28 +952,34 @@ void send_response(int client_sock, const char *header, const char *content_type
                                  header, content_type, body_length);
 
     
-    send(client_sock, responseHead, headLength, 0);//sending header
+    struct outq q;
+    outq_init(&q, client_sock);
+    outq_copy(&q, responseHead, headLength);//header and body leave in one writev
 
-    
     if (body && body_length > 0) {//sending body to client and is greater than 0
-        send(client_sock, body, body_length, 0);
+        outq_mem(&q, body, body_length, NULL, NULL);
     }
+    outq_finish(&q);
 }
 
-const char* get_mime_type(const char *filename) {
-    const char *p = strrchr(filename, '.'); //grabbing file extensio
-
-    if (!p || p == filename) {//making sure its not null
-        return NULL;
+int get_header(const char *headers, const char *name, char *out, size_t outlen) {
+    size_t nameLen = strlen(name);
+    const char *line = headers;
+
+    while (line && *line && *line != '\r' && *line != '\n') {//stop at the blank line ending the headers
+        if (strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':') {
+            const char *v = line + nameLen + 1;
+            while (*v == ' ' || *v == '\t') v++;//skip optional whitespace
+
+            size_t len = strcspn(v, "\r\n");
+            while (len > 0 && (v[len - 1] == ' ' || v[len - 1] == '\t')) len--;
+            if (len >= outlen) len = outlen - 1;
+            memcpy(out, v, len);
+            out[len] = '\0';
+            return 1;
+        }
+        line = strchr(line, '\n');
+        if (line) line++;
     }
-
-   
-    if (strcmp(p, ".html") == 0) return "text/html";
-    else if (strcmp(p, ".css") == 0) return "text/css";
-    else if (strcmp(p, ".js") == 0) return "application/javascript";
-    else if (strcmp(p, ".png") == 0) return "image/png";
-    else if (strcmp(p, ".jpeg") == 0 || strcmp(p, ".jpg") == 0) return "image/jpeg";
-    else if (strcmp(p, ".gif") == 0) return "image/gif";
-    else if (strcmp(p, ".txt") == 0) return "text/plain";
-    else return NULL; //returning null if not there 
+    return 0;
 }
@@ -2,13 +2,40 @@
 #define HTTPSERVE_H
 
 #include <stdio.h>  // For size_t
+#include <sys/types.h>  // For off_t
+
+// Build: gcc -o httpserve httpserve.c mime.c range.c docroot.c urlpath.c pack.c uring.c pool.c prefork.c handoff.c admit.c ratelimit.c wheel.c gate.c outq.c hpack.c h2.c tls.c proxy.c cgicache.c template.c router.c session.c co.c upload.c profile.c trace.c numa.c accesslog.c autoindex.c fileinfo.c -pthread -lssl -lcrypto -ldl
+//        gcc -o mkpack mkpack.c mime.c -lz
+//        gcc -o replay replay.c -pthread
+//        gcc -o inspect help.c fileinfo.c
 
 // Server configuration constants
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 16384
+#define REQUEST_SIZE 4096       // request line plus headers, read in one go
+#define STATIC_HEADER_SIZE 768  // response header of a plain static file
+
+struct docroot_entry;
+struct pack;
+
+// A plain 200 for a static file, ready for an engine to put on the wire:
+// header, then size bytes of fd starting at offset. entry or pack holds
+// the reference that keeps fd open until close_static_file().
+struct static_file {
+    int fd;
+    off_t offset;
+    off_t size;                         // 0 for HEAD
+    char header[STATIC_HEADER_SIZE];
+    int headLength;
+    struct docroot_entry *entry;
+    struct pack *pack;
+};
 
 // Function prototypes for server operations
 
+// Log a line to stdout
+void logMsg(const char *msg);
+
 // Start the server on a specified port
 void start_server(int port);
 
@@ -21,14 +48,45 @@ void handle_connections(int server_sock);
 // Process incoming HTTP requests
 void process_request(int client_sock);
 
+// Handle a request already read into buff (len bytes, room for a terminator) and close the socket
+void dispatch_request(int client_sock, char *buff, int len);
+
+// Run fn(arg) on a detached thread with every signal blocked, so signals keep
+// going to the thread that runs the engine. Returns 0 or an errno value.
+int spawn_detached(void *(*fn)(void *), void *arg);
+
+// dispatch_request() on a thread of its own, for requests that would hold an
+// engine's thread for long (HTTP/2, proxied requests, uploads, profiles).
+// buff is copied and the calling thread's trace record goes along; done()
+// runs once the request has finished. Returns -1, the trace record still on
+// the calling thread, if no thread could be started.
+int dispatch_detached(int client_sock, const char *buff, int len, void (*done)(void));
+
+// Resolve a GET/HEAD that needs nothing but a plain 200 from a file or the pack.
+// buff is a scratch copy of the request and is tokenized. Returns 1 if sf is
+// ready, 0 if the request has to go through dispatch_request().
+int open_static_file(char *buff, struct static_file *sf);
+void close_static_file(struct static_file *sf);
+
+// Housekeeping between connections (pack reloads); engines call it when woken by a signal.
+// Returns 1 if a reload was requested since the last call.
+int server_tick(void);
+
+// Set once SIGQUIT asked for a graceful stop: engines stop accepting, finish
+// the connections they have and return
+int server_draining(void);
+
 // Handle GET requests
-void handle_get_request(int client_sock, const char* path);
+void handle_get_request(int client_sock, const char* path, const char* headers);
 
 // Handle HEAD requests
-void handle_head_request(int client_sock, const char* path);
+void handle_head_request(int client_sock, const char* path, const char* headers);
 
 // Handle POST requests
-void handle_post_request(int client_sock, const char* path);
+void handle_post_request(int client_sock, const char* path, const char* headers);
+
+// Copy the value of a request header (case-insensitive name) into out; returns 1 if present
+int get_header(const char *headers, const char *name, char *out, size_t outlen);
 
 // Send an HTTP response to the client
 void send_response(int client_sock, const char *header, const char *content_type, const char *body, int body_length);
@@ -0,0 +1,20 @@
+#include <string.h>
+#include "httpserve.h"
+
+const char* get_mime_type(const char *filename) {
+    const char *p = strrchr(filename, '.'); //grabbing file extensio
+
+    if (!p || p == filename) {//making sure its not null
+        return NULL;
+    }
+
+   
+    if (strcmp(p, ".html") == 0) return "text/html";
+    else if (strcmp(p, ".css") == 0) return "text/css";
+    else if (strcmp(p, ".js") == 0) return "application/javascript";
+    else if (strcmp(p, ".png") == 0) return "image/png";
+    else if (strcmp(p, ".jpeg") == 0 || strcmp(p, ".jpg") == 0) return "image/jpeg";
+    else if (strcmp(p, ".gif") == 0) return "image/gif";
+    else if (strcmp(p, ".txt") == 0) return "text/plain";
+    else return NULL; //returning null if not there 
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "httpserve.h"
+#include "pack.h"
+
+// Packs a www/ tree into one indexed file for httpserve --pack.
+// Build: gcc -o mkpack mkpack.c mime.c -lz
+// Usage: mkpack <www_dir> <out.pack>
+
+#define MAX_STRING 4096
+
+struct source {
+    char path[MAX_STRING];    // request path, "/sub/a.txt"
+    char file[MAX_STRING];    // where it lives on disk
+    const char *mime;
+    time_t mtime;
+};
+
+static struct source *sources;
+static size_t sourceCount, sourceCap;
+
+__attribute__((format(printf, 3, 4)))
+static void path_format(char *out, size_t size, const char *fmt, ...) {//a cut path would be packed or opened under the wrong name
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(out, size, fmt, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= size) {
+        fprintf(stderr, "path too long: %s...\n", out);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void add_source(const char *root, const char *rel, const struct stat *st) {
+    const char *mime = get_mime_type(rel);
+    if (!mime) {//the server would answer 415 for it anyway
+        fprintf(stderr, "skipping %s: unknown type\n", rel);
+        return;
+    }
+    if (sourceCount == sourceCap) {
+        sourceCap = sourceCap ? sourceCap * 2 : 64;
+        sources = realloc(sources, sourceCap * sizeof(*sources));
+        if (!sources) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct source *s = &sources[sourceCount++];
+    path_format(s->path, sizeof(s->path), "/%s", rel);
+    path_format(s->file, sizeof(s->file), "%s/%s", root, rel);
+    s->mime = mime;
+    s->mtime = st->st_mtime;
+}
+
+static void walk(const char *root, const char *rel) {//collect every regular file below root
+    char dirPath[MAX_STRING];
+    path_format(dirPath, sizeof(dirPath), "%s/%s", root, rel);
+
+    DIR *dir = opendir(dirPath);
+    if (!dir) {
+        perror(dirPath);
+        exit(EXIT_FAILURE);
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;//dotfiles are never published
+
+        char childRel[MAX_STRING], childPath[MAX_STRING];
+        struct stat st;
+        path_format(childRel, sizeof(childRel), "%s%s%s", rel, *rel ? "/" : "", entry->d_name);
+        path_format(childPath, sizeof(childPath), "%s/%s", root, childRel);
+
+        if (stat(childPath, &st) != 0) {
+            fprintf(stderr, "Failed to get stats for %s: %s\n", childPath, strerror(errno));
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) walk(root, childRel);
+        else if (S_ISREG(st.st_mode)) add_source(root, childRel, &st);
+    }
+    closedir(dir);
+}
+
+static int cmp_source(const void *a, const void *b) {
+    return strcmp(((const struct source *)a)->path, ((const struct source *)b)->path);
+}
+
+static uint64_t align_up(uint64_t v) {
+    return (v + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+}
+
+static int compressible(const char *mime) {
+    return strncmp(mime, "text/", 5) == 0 || strcmp(mime, "application/javascript") == 0;
+}
+
+static unsigned char *read_file(const char *file, size_t *len) {
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(file);
+        exit(EXIT_FAILURE);
+    }
+    unsigned char *data = malloc(st.st_size ? st.st_size : 1);
+    if (!data) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + got, st.st_size - got);
+        if (n <= 0) {
+            perror(file);
+            exit(EXIT_FAILURE);
+        }
+        got += n;
+    }
+    close(fd);
+    *len = got;
+    return data;
+}
+
+static unsigned char *gzip_buffer(const unsigned char *in, size_t len, size_t *outLen) {
+    z_stream zs = {0};
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;//+16: gzip wrapper
+
+    size_t cap = deflateBound(&zs, len);
+    unsigned char *out = malloc(cap);
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = cap;
+    if (!out || deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *outLen = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+static void write_at(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+static uint64_t fnv64(const unsigned char *data, size_t len) {//content hash for the ETag
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: mkpack <www_dir> <out.pack>\n");
+        return 1;
+    }
+    const char *root = argv[1];
+    const char *outPath = argv[2];
+
+    walk(root, "");
+    qsort(sources, sourceCount, sizeof(*sources), cmp_source);
+
+    size_t stringsSize = 1;//offset 0 is the empty string
+    for (size_t i = 0; i < sourceCount; i++) {
+        stringsSize += strlen(sources[i].path) + 1 + strlen(sources[i].mime) + 1 + PACK_ETAG_LEN + 1;
+    }
+
+    struct pack_header head = {0};
+    memcpy(head.magic, PACK_MAGIC, 8);
+    head.version = PACK_VERSION;
+    head.count = sourceCount;
+    head.stringsOffset = sizeof(head) + sourceCount * sizeof(struct pack_entry);
+    head.stringsSize = stringsSize;
+
+    struct pack_entry *entries = calloc(sourceCount ? sourceCount : 1, sizeof(*entries));
+    char *strings = calloc(stringsSize, 1);
+    if (!entries || !strings) {
+        perror("calloc");
+        return 1;
+    }
+
+    char tmpPath[MAX_STRING];//built beside the target and renamed over it, so servers never see half a pack
+    path_format(tmpPath, sizeof(tmpPath), "%s.tmp.%d", outPath, (int)getpid());
+    int out = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror(tmpPath);
+        return 1;
+    }
+
+    size_t strOff = 1;
+    uint64_t dataOff = align_up(head.stringsOffset + stringsSize);
+    size_t gzCount = 0;
+
+    for (size_t i = 0; i < sourceCount; i++) {
+        struct source *s = &sources[i];
+        struct pack_entry *e = &entries[i];
+        size_t len, gzLen = 0;
+        unsigned char *data = read_file(s->file, &len);
+
+        e->pathOffset = strOff;
+        strOff += sprintf(strings + strOff, "%s", s->path) + 1;
+        e->mimeOffset = strOff;
+        strOff += sprintf(strings + strOff, "%s", s->mime) + 1;
+        e->etagOffset = strOff;
+        strOff += sprintf(strings + strOff, "\"%016llx\"", (unsigned long long)fnv64(data, len)) + 1;
+        e->mtime = s->mtime;
+
+        e->offset = dataOff;
+        e->size = len;
+        write_at(out, data, len, dataOff);
+        dataOff = align_up(dataOff + len);
+
+        unsigned char *gz = compressible(s->mime) ? gzip_buffer(data, len, &gzLen) : NULL;
+        if (gz && gzLen < len - len / 10) {//only worth keeping if it saves at least 10%
+            e->gzOffset = dataOff;
+            e->gzSize = gzLen;
+            write_at(out, gz, gzLen, dataOff);
+            dataOff = align_up(dataOff + gzLen);
+            gzCount++;
+        }
+        free(gz);
+        free(data);
+    }
+
+    if (ftruncate(out, dataOff) < 0) {
+        perror("ftruncate");
+        return 1;
+    }
+    head.fileSize = dataOff;
+    write_at(out, &head, sizeof(head), 0);
+    write_at(out, entries, sourceCount * sizeof(*entries), sizeof(head));
+    write_at(out, strings, stringsSize, head.stringsOffset);
+
+    if (fsync(out) < 0 || close(out) < 0 || rename(tmpPath, outPath) < 0) {
+        perror(outPath);
+        unlink(tmpPath);
+        return 1;
+    }
+
+    printf("%s: %zu files (%zu gzip variants), %llu bytes\n", outPath, sourceCount, gzCount, (unsigned long long)dataOff);
+    free(entries);
+    free(strings);
+    free(sources);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "numa.h"
+
+struct node {
+    int id;                 // as sysfs numbers it, for memory policies
+    cpu_set_t cpus;         // those this process may use
+};
+
+static struct node nodes[NUMA_MAX_NODES];
+static int nodeCount = 1;
+static int enabled;
+static short cpuNode[CPU_SETSIZE];  // index into nodes, -1 for CPUs we may not use
+
+static int parse_cpulist(const char *list, cpu_set_t *set) {//"0-3,8-11"
+    CPU_ZERO(set);
+    for (const char *p = list; *p && *p != '\n';) {
+        char *e;
+        long lo = strtol(p, &e, 10), hi = lo;
+        if (e == p) return -1;
+        if (*e == '-') {
+            p = e + 1;
+            hi = strtol(p, &e, 10);
+            if (e == p) return -1;
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+        p = *e == ',' ? e + 1 : e;
+    }
+    return 0;
+}
+
+int numa_init(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return 1;
+
+    int count = 0;
+    for (int id = 0; id < NUMA_MAX_NODES; id++) {//numbered from 0, with gaps where a node has no CPUs
+        char path[128], list[1024];
+        snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", id);
+        FILE *f = fopen(path, "re");
+        if (!f) continue;
+        int ok = fgets(list, sizeof(list), f) != NULL;
+        fclose(f);
+
+        struct node *n = &nodes[count];
+        if (!ok || parse_cpulist(list, &n->cpus) < 0) continue;
+        CPU_AND(&n->cpus, &n->cpus, &allowed);//a numactl --cpunodebind leaves the rest out
+        if (CPU_COUNT(&n->cpus) == 0) continue;
+        n->id = id;
+        count++;
+    }
+    if (count <= 1) return 1;
+
+    memset(cpuNode, -1, sizeof(cpuNode));
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &nodes[i].cpus)) cpuNode[c] = i;
+        }
+    }
+    nodeCount = count;
+    enabled = 1;
+    return count;
+}
+
+int numa_nodes(void) {
+    return nodeCount;
+}
+
+static void prefer(int node) {//this thread's future pages from node, others when it is full
+    unsigned long mask = 1UL << nodes[node].id;
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1);
+}
+
+void numa_restrict(int node) {
+    if (!enabled || node < 0 || node >= nodeCount) return;
+    sched_setaffinity(0, sizeof(nodes[node].cpus), &nodes[node].cpus);
+    prefer(node);
+    nodes[0] = nodes[node];
+    nodeCount = 1;
+}
+
+void numa_bind_thread(int node) {
+    if (!enabled || node < 0 || node >= nodeCount) return;
+    pthread_setaffinity_np(pthread_self(), sizeof(nodes[node].cpus), &nodes[node].cpus);
+    prefer(node);
+}
+
+int numa_socket_node(int sock) {
+    if (nodeCount == 1) return 0;
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+    return cpuNode[cpu];
+}
+
+void *numa_alloc(size_t size, int node) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    if (enabled && node >= 0 && node < nodeCount) {//before the first touch, which is what places a page
+        unsigned long mask = 1UL << nodes[node].id;
+        syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+    return p;
+}
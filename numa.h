@@ -0,0 +1,41 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+
+// NUMA placement from sysfs, without libnuma. Once enabled, the pool pins
+// each worker to the CPUs of one node, keeps its queues in that node's
+// memory, and queues every connection for the node whose CPU took its
+// packets off the NIC. Prefork workers each take a whole node. Until
+// numa_init() there is a single node and every call here is a no-op.
+
+#define NUMA_MAX_NODES 64
+
+// Topology root; a copy with fewer or more nodeN/cpulist files emulates
+// another machine
+#ifndef NUMA_SYSFS
+#define NUMA_SYSFS "/sys/devices/system/node"
+#endif
+
+// Read the nodes holding CPUs this process may run on. Returns how many,
+// 1 when the machine (or the sysfs view of it) is not NUMA.
+int numa_init(void);
+
+// Nodes in use: 1 before numa_init() or after numa_restrict()
+int numa_nodes(void);
+
+// Keep this process to node index (0 to numa_nodes() - 1) from now on, CPUs
+// and memory; threads started later inherit it
+void numa_restrict(int node);
+
+// Run the calling thread on node's CPUs and take its memory from there. Call
+// first thing in a new thread, before its stack and buffers are touched.
+void numa_bind_thread(int node);
+
+// Node (index) whose CPU last received packets for sock, -1 if unknown
+int numa_socket_node(int sock);
+
+// Zeroed memory preferring node's pages, never freed; NULL on failure
+void *numa_alloc(size_t size, int node);
+
+#endif // NUMA_H
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "gate.h"
+#include "co.h"
+#include "outq.h"
+#include "trace.h"
+
+void outq_init(struct outq *q, int sock) {
+    memset(q, 0, offsetof(struct outq, arena));//the arena is only read where it was written
+    q->sock = sock;
+    q->flags = fcntl(sock, F_GETFL);
+    if (q->flags < 0) q->failed = 1;
+    else if (!(q->flags & O_NONBLOCK)) fcntl(sock, F_SETFL, q->flags | O_NONBLOCK);
+}
+
+static struct outq_seg *seg_at(struct outq *q, int i) {
+    return &q->segs[(q->head + i) % OUTQ_SEGS];
+}
+
+static void pop(struct outq *q) {
+    struct outq_seg *s = seg_at(q, 0);
+    if (s->done) s->done(s->arg);
+    q->head = (q->head + 1) % OUTQ_SEGS;
+    q->count--;
+}
+
+static int fail(struct outq *q) {//the client is gone or stuck, drop what is left
+    if (errno != EPIPE && errno != ECONNRESET && errno != ETIMEDOUT) perror("sending response");
+    while (q->count > 0) pop(q);
+    q->queued = 0;
+    q->failed = 1;
+    return -1;
+}
+
+static void advance(struct outq *q, size_t n) {//n bytes went out from the front
+    q->queued -= n;
+    while (n > 0) {
+        struct outq_seg *s = seg_at(q, 0);
+        size_t step = n < s->len ? n : s->len;
+        trace_sent(s->data, step);
+        if (s->data) s->data += step;
+        else s->offset += step;
+        s->len -= step;
+        n -= step;
+        if (s->len == 0) pop(q);
+    }
+}
+
+static int write_some(struct outq *q) {//1 on progress, 0 if the socket is full, -1 once failed
+    struct outq_seg *s = seg_at(q, 0);
+    ssize_t n;
+
+    if (s->data) {//every memory piece up to the next file in one call
+        struct iovec iov[OUTQ_SEGS];
+        int cnt = 0;
+        while (cnt < q->count && seg_at(q, cnt)->data) {
+            iov[cnt].iov_base = (void *)seg_at(q, cnt)->data;
+            iov[cnt].iov_len = seg_at(q, cnt)->len;
+            cnt++;
+        }
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+        int more = cnt < q->count ? MSG_MORE : 0;//a file follows: let the header share its first packet
+        n = sendmsg(q->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | more);
+    } else {
+        off_t offset = s->offset;
+        size_t chunk = s->len > 0x7ffff000 ? 0x7ffff000 : s->len;//sendfile caps a single call anyway
+        n = sendfile(q->sock, s->fd, &offset, chunk);
+        if (n == 0) {//file shrank under us
+            errno = EIO;
+            n = -1;
+        }
+    }
+
+    if (n < 0) {
+        if (errno == EINTR) return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return fail(q);
+    }
+    advance(q, n);
+    return 1;
+}
+
+static int drain(struct outq *q, size_t low) {//send until at most low bytes and a free slot remain
+    while (!q->failed && q->count > 0 && (q->queued > low || q->count == OUTQ_SEGS)) {
+        int r = write_some(q);
+        if (r < 0) return -1;
+        if (r > 0) continue;
+
+        int ready = co_wait(q->sock, POLLOUT, GATE_WRITE_SECS * 1000);//the write deadline restarts with every bit of progress; a coroutine yields meanwhile
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready == 0) errno = ETIMEDOUT;
+        if (ready <= 0) return fail(q);
+    }
+    return q->failed ? -1 : 0;
+}
+
+static int push(struct outq *q, const struct outq_seg *seg) {
+    if (q->failed || seg->len == 0) {
+        if (seg->done) seg->done(seg->arg);
+        return q->failed ? -1 : 0;
+    }
+    if (q->count == OUTQ_SEGS && drain(q, SIZE_MAX) < 0) {
+        if (seg->done) seg->done(seg->arg);
+        return -1;
+    }
+
+    *seg_at(q, q->count) = *seg;
+    q->count++;
+    q->queued += seg->len;
+    if (q->queued > OUTQ_HIGH) return drain(q, OUTQ_LOW);//backpressure on whoever is producing
+    return 0;
+}
+
+int outq_mem(struct outq *q, const void *data, size_t len, void (*done)(void *), void *arg) {
+    struct outq_seg seg = {data, -1, 0, len, done, arg};
+    return push(q, &seg);
+}
+
+int outq_file(struct outq *q, int fd, off_t offset, size_t len, void (*done)(void *), void *arg) {
+    struct outq_seg seg = {NULL, fd, offset, len, done, arg};
+    return push(q, &seg);
+}
+
+int outq_copy(struct outq *q, const void *data, size_t len) {
+    if (q->arenaUsed + len > OUTQ_ARENA && outq_flush(q) < 0) return -1;
+    if (len > OUTQ_ARENA) {//too big to copy: send it before the caller's buffer goes away
+        if (outq_mem(q, data, len, NULL, NULL) < 0) return -1;
+        return outq_flush(q);
+    }
+    if (q->count == OUTQ_SEGS && drain(q, SIZE_MAX) < 0) return -1;//push must not drain behind the copy
+
+    char *p = q->arena + q->arenaUsed;
+    memcpy(p, data, len);
+    q->arenaUsed += len;
+    return outq_mem(q, p, len, NULL, NULL);
+}
+
+int outq_flush(struct outq *q) {
+    if (drain(q, 0) < 0) return -1;
+    q->arenaUsed = 0;//nothing queued points into it any more
+    return 0;
+}
+
+int outq_finish(struct outq *q) {
+    int rc = outq_flush(q);
+    if (q->flags >= 0 && !(q->flags & O_NONBLOCK)) fcntl(q->sock, F_SETFL, q->flags);
+    return rc;
+}
+
+int outq_send(int sock, const void *data, size_t len) {
+    struct outq q;
+    outq_init(&q, sock);
+    outq_mem(&q, data, len, NULL, NULL);
+    return outq_finish(&q);
+}
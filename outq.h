@@ -0,0 +1,66 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Segments one response can have queued before the oldest must go out
+#define OUTQ_SEGS 16
+
+// Inline room for copied headers and other small pieces
+#define OUTQ_ARENA 2048
+
+// Backpressure: once more than OUTQ_HIGH bytes are queued, producing stops
+// until the client has taken all but OUTQ_LOW of them
+#define OUTQ_HIGH (256 * 1024)
+#define OUTQ_LOW (64 * 1024)
+
+// One piece of a response: data bytes from memory, or len bytes of fd from
+// offset when data is NULL. done(arg), if set, runs once the piece has gone
+// out or been discarded, so a segment can hold a buffer or cache reference.
+struct outq_seg {
+    const char *data;
+    int fd;
+    off_t offset;
+    size_t len;
+    void (*done)(void *arg);
+    void *arg;
+};
+
+// Output queue of a connection. The socket is non-blocking while a queue is
+// open on it; pieces go out with sendmsg() and sendfile(), short writes
+// resume where they stopped, and a client that takes no data for
+// GATE_WRITE_SECS, or has gone away, fails the queue and the rest is dropped.
+struct outq {
+    int sock;
+    int flags;              // file status flags to put back
+    int failed;
+    int head, count;
+    size_t queued;          // bytes not yet sent
+    size_t arenaUsed;
+    struct outq_seg segs[OUTQ_SEGS];
+    char arena[OUTQ_ARENA];
+};
+
+void outq_init(struct outq *q, int sock);
+
+// Queue len bytes the caller keeps alive until they are sent
+int outq_mem(struct outq *q, const void *data, size_t len, void (*done)(void *), void *arg);
+
+// Queue a copy of a small piece (headers, part boundaries)
+int outq_copy(struct outq *q, const void *data, size_t len);
+
+// Queue len bytes of fd starting at offset, sent with sendfile()
+int outq_file(struct outq *q, int fd, off_t offset, size_t len, void (*done)(void *), void *arg);
+
+// Send everything queued, waiting for writability as needed
+int outq_flush(struct outq *q);
+
+// Flush, then give the socket its blocking mode back. All of these return
+// 0, or -1 once the queue has failed.
+int outq_finish(struct outq *q);
+
+// One buffer, start to finish
+int outq_send(int sock, const void *data, size_t len);
+
+#endif // OUTQ_H
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pack.h"
+
+struct pack {
+    int fd;
+    const char *map;                 // whole file, read-only
+    size_t size;
+    const struct pack_header *head;
+    const struct pack_entry *entries;
+    int refs;                        // current-pack reference plus one per request
+};
+
+static struct pack *current;
+static char *packPath;
+static pthread_mutex_t packLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void pack_free(struct pack *pack) {
+    munmap((void *)pack->map, pack->size);
+    close(pack->fd);
+    free(pack);
+}
+
+static int valid_string(const struct pack_header *head, uint32_t offset) {//offset inside the table and terminated there
+    return offset < head->stringsSize;
+}
+
+static int pack_validate(const struct pack *pack) {//never trust offsets coming off disk
+    const struct pack_header *head = pack->head;
+    const char *strings = pack->map + head->stringsOffset;
+
+    if (memcmp(head->magic, PACK_MAGIC, 8) != 0 || head->version != PACK_VERSION) return -1;
+    if (head->fileSize != pack->size) return -1;
+    if ((uint64_t)head->count * sizeof(struct pack_entry) > pack->size - sizeof(*head)) return -1;
+    if (head->stringsOffset < sizeof(*head) + (uint64_t)head->count * sizeof(struct pack_entry)) return -1;
+    if (head->stringsOffset > pack->size || head->stringsSize > pack->size - head->stringsOffset) return -1;
+    if (head->stringsSize == 0 || strings[head->stringsSize - 1] != '\0') return -1;
+
+    for (uint32_t i = 0; i < head->count; i++) {
+        const struct pack_entry *e = &pack->entries[i];
+
+        if (!valid_string(head, e->pathOffset) || !valid_string(head, e->mimeOffset) || !valid_string(head, e->etagOffset)) return -1;
+        if (strnlen(strings + e->etagOffset, PACK_ETAG_LEN + 1) != PACK_ETAG_LEN) return -1;//the server copies it into fixed buffers
+        if (e->offset > pack->size || e->size > pack->size - e->offset) return -1;
+        if (e->gzOffset > pack->size || e->gzSize > pack->size - e->gzOffset) return -1;
+        if (i > 0 && strcmp(strings + pack->entries[i - 1].pathOffset, strings + e->pathOffset) >= 0) return -1;//must be sorted for the binary search
+    }
+    return 0;
+}
+
+static struct pack *pack_map(const char *path) {
+    struct pack *pack = calloc(1, sizeof(*pack));
+    struct stat st;
+
+    if (!pack) return NULL;
+    pack->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pack->fd < 0 || fstat(pack->fd, &st) < 0 || (size_t)st.st_size < sizeof(struct pack_header)) {
+        if (pack->fd >= 0) close(pack->fd);
+        free(pack);
+        return NULL;
+    }
+
+    pack->size = st.st_size;
+    pack->map = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, pack->fd, 0);
+    if (pack->map == MAP_FAILED) {
+        close(pack->fd);
+        free(pack);
+        return NULL;
+    }
+    pack->head = (const struct pack_header *)pack->map;
+    pack->entries = (const struct pack_entry *)(pack->map + sizeof(struct pack_header));
+    pack->refs = 1;
+
+    if (pack_validate(pack) < 0) {
+        fprintf(stderr, "%s: not a valid pack file\n", path);
+        errno = EINVAL;
+        pack_free(pack);
+        return NULL;
+    }
+
+    madvise((void *)pack->map, pack->head->stringsOffset + pack->head->stringsSize, MADV_WILLNEED);//index and strings are hot from the first request
+    posix_fadvise(pack->fd, 0, 0, POSIX_FADV_WILLNEED);//start pulling payloads into the page cache
+    return pack;
+}
+
+int pack_load(const char *path) {
+    free(packPath);
+    packPath = strdup(path);
+    return packPath ? pack_reload() : -1;
+}
+
+int pack_reload(void) {
+    struct pack *fresh = pack_map(packPath);
+    if (!fresh) return -1;
+
+    pthread_mutex_lock(&packLock);
+    struct pack *old = current;
+    current = fresh;
+    if (old && --old->refs == 0) pack_free(old);
+    pthread_mutex_unlock(&packLock);
+    return 0;
+}
+
+struct pack *pack_acquire(void) {
+    pthread_mutex_lock(&packLock);
+    struct pack *pack = current;
+    if (pack) pack->refs++;
+    pthread_mutex_unlock(&packLock);
+    return pack;
+}
+
+void pack_release(struct pack *pack) {
+    pthread_mutex_lock(&packLock);
+    if (--pack->refs == 0) pack_free(pack);
+    pthread_mutex_unlock(&packLock);
+}
+
+const struct pack_entry *pack_find(const struct pack *pack, const char *path) {
+    const char *strings = pack->map + pack->head->stringsOffset;
+    uint32_t lo = 0, hi = pack->head->count;
+
+    if (strcmp(path, "/") == 0) path = "/index.html";
+
+    while (lo < hi) {//binary search over the sorted index
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(path, strings + pack->entries[mid].pathOffset);
+        if (cmp == 0) return &pack->entries[mid];
+        if (cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return NULL;
+}
+
+const char *pack_string(const struct pack *pack, uint32_t offset) {
+    return pack->map + pack->head->stringsOffset + offset;
+}
+
+int pack_fd(const struct pack *pack) {
+    return pack->fd;
+}
@@ -0,0 +1,59 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+// On-disk layout of a www/ pack built by mkpack:
+//
+//   pack_header | pack_entry[count] sorted by path | string table | payloads
+//
+// Payloads start on page boundaries so they can go out with sendfile()
+// straight from the pack descriptor. All integers are little-endian.
+
+#define PACK_MAGIC "WWWPACK1"
+#define PACK_VERSION 1
+#define PACK_ALIGN 4096
+#define PACK_ETAG_LEN 18   // "\"" + 16 hex digits + "\"", NUL terminated in the table
+
+struct pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;        // number of entries
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t fileSize;     // total size, checked against the file on load
+};
+
+struct pack_entry {
+    uint32_t pathOffset;   // NUL-terminated request path, e.g. "/css/site.css"
+    uint32_t mimeOffset;   // NUL-terminated MIME type
+    uint32_t etagOffset;   // NUL-terminated strong ETag of the identity payload
+    uint32_t reserved;
+    uint64_t mtime;        // source file mtime, for Last-Modified and If-Range
+    uint64_t offset;       // identity payload
+    uint64_t size;
+    uint64_t gzOffset;     // gzip payload, gzSize == 0 when there is none
+    uint64_t gzSize;
+};
+
+struct pack;
+
+// Map the pack at path and make it current. Returns 0 on success, -1 on error.
+int pack_load(const char *path);
+
+// Map the pack file again (after a deploy renamed a new one into place) and
+// swap it in. Requests holding the old pack keep it until they release it.
+int pack_reload(void);
+
+// Current pack with a reference held, or NULL when no pack is loaded
+struct pack *pack_acquire(void);
+void pack_release(struct pack *pack);
+
+// Look up a canonical request path ("/" means "/index.html")
+const struct pack_entry *pack_find(const struct pack *pack, const char *path);
+
+// String table access and the descriptor payloads are sent from
+const char *pack_string(const struct pack *pack, uint32_t offset);
+int pack_fd(const struct pack *pack);
+
+#endif // PACK_H
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "httpserve.h"
+#include "pool.h"
+#include "prefork.h"
+#include "admit.h"
+#include "ratelimit.h"
+#include "gate.h"
+#include "outq.h"
+#include "h2.h"
+#include "proxy.h"
+#include "upload.h"
+#include "profile.h"
+#include "trace.h"
+#include "numa.h"
+
+// The acceptor owns a Chase-Lev deque and only ever pushes accepted
+// sockets onto it. Workers steal batches from its top into their own
+// deques, pop from their own bottom, and steal from each other when both
+// run dry, so one slow request never strands the connections queued behind
+// it. Anything that may block for long (CGI, a file not in the page cache)
+// is moved to a small bounded pool so it never holds a worker hostage.
+// Connections that live as long as the client or a backend wants (HTTP/2,
+// proxied requests, uploads, profiles) get a thread of their own instead,
+// so a few idle ones cannot take up that pool.
+//
+// On a NUMA machine there is an acceptor deque per node. A connection goes
+// to the node whose CPU its packets arrived on, and workers (pinned there,
+// their deques in that node's memory) look at home before stealing across.
+
+#define EMPTY -1
+#define ABORT -2
+
+struct deque {
+    long top;               // thieves take from here
+    long bottom;            // owner pushes and pops here
+    int slots[POOL_QUEUE];
+};
+
+struct worker {
+    pthread_t thread;
+    struct deque dq;
+    unsigned seed;          // victim selection
+    int node;
+};
+
+struct blocking_task {
+    int client_sock;
+    int len;
+    struct trace_record *trace;     // the request's, if sampled
+    char buff[REQUEST_SIZE];
+};
+
+static struct {
+    struct deque **accepted;          // by node, owned by the acceptor
+    struct worker **workers;          // each in its node's memory
+    int count;
+    int nodes;
+    int nextNode;                     // for connections numa_socket_node() cannot place
+    int idle;                         // workers asleep on wake
+    int inflight;                     // accepted and not yet closed
+    uint64_t *acceptedAt;             // by descriptor, when the acceptor took it
+    int maxFd;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} P = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+static struct {
+    struct blocking_task *ring[POOL_BLOCKING_QUEUE];
+    int head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} B = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+// Chase-Lev deque, C11 memory model version (Le et al., PPoPP 2013)
+
+static int dq_push(struct deque *d, int x) {//owner only; -1 when full
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= POOL_QUEUE) return -1;
+    __atomic_store_n(&d->slots[b & (POOL_QUEUE - 1)], x, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int dq_take(struct deque *d) {//owner only
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b) {//was empty
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return EMPTY;
+    }
+    int x = __atomic_load_n(&d->slots[b & (POOL_QUEUE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {//last one, race the thieves for it
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) x = EMPTY;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return x;
+}
+
+static int dq_steal(struct deque *d) {//any thread; ABORT when it lost a race
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) return EMPTY;
+    int x = __atomic_load_n(&d->slots[t & (POOL_QUEUE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return ABORT;
+    return x;
+}
+
+static long dq_size(struct deque *d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    return b > t ? b - t : 0;
+}
+
+static void wake_one(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);//pairs with the idle count bump in worker_sleep()
+    if (__atomic_load_n(&P.idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&P.lock);
+        pthread_cond_signal(&P.wake);
+        pthread_mutex_unlock(&P.lock);
+    }
+}
+
+static int work_visible(void) {
+    for (int n = 0; n < P.nodes; n++) {
+        if (dq_size(P.accepted[n]) > 0) return 1;
+    }
+    for (int i = 0; i < P.count; i++) {
+        if (dq_size(&P.workers[i]->dq) > 0) return 1;
+    }
+    return 0;
+}
+
+static void worker_sleep(void) {
+    pthread_mutex_lock(&P.lock);
+    __atomic_fetch_add(&P.idle, 1, __ATOMIC_SEQ_CST);
+    if (!work_visible()) pthread_cond_wait(&P.wake, &P.lock);//a push after the check signals under this lock
+    __atomic_fetch_sub(&P.idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&P.lock);
+}
+
+static int steal_accepted(struct worker *self, struct deque *from) {
+    long want = (dq_size(from) + 1) / 2;//half of the backlog, the rest is left for other thieves
+    if (want > POOL_STEAL_BATCH) want = POOL_STEAL_BATCH;
+
+    int first = EMPTY;
+    for (long i = 0; i < want; i++) {
+        int x = dq_steal(from);
+        if (x == ABORT) {
+            i--;
+            continue;
+        }
+        if (x == EMPTY) break;
+        if (first == EMPTY) first = x;
+        else dq_push(&self->dq, x);//cannot fill up, only this thread pushes and it takes first
+    }
+    if (first != EMPTY && dq_size(&self->dq) > 0) wake_one();//let a sleeping peer steal the surplus
+    return first;
+}
+
+static int steal_peer(struct worker *self, int local) {//from a random victim on this node, or on any other
+    int start = rand_r(&self->seed) % P.count;
+    for (int i = 0; i < P.count; i++) {
+        struct worker *victim = P.workers[(start + i) % P.count];
+        if (victim == self || (victim->node == self->node) != local) continue;
+
+        int x;
+        while ((x = dq_steal(&victim->dq)) == ABORT) {
+        }
+        if (x != EMPTY) return x;
+    }
+    return EMPTY;
+}
+
+static int steal_work(struct worker *self) {//nearest first: sockets and buffers on this node stay there
+    int x = steal_accepted(self, P.accepted[self->node]);
+    if (x == EMPTY) x = steal_peer(self, 1);
+    for (int n = 1; n < P.nodes && x == EMPTY; n++) x = steal_accepted(self, P.accepted[(self->node + n) % P.nodes]);
+    if (x == EMPTY && P.nodes > 1) x = steal_peer(self, 0);
+    return x;
+}
+
+static void connection_done(void) {
+    admit_done();
+    __atomic_fetch_sub(&P.inflight, 1, __ATOMIC_RELEASE);
+    score_done();
+}
+
+static int blocking_submit(int client_sock, const char *buff, int len) {//-1 when the blocking pool is full
+    struct blocking_task *task = malloc(sizeof(*task));
+    if (!task) return -1;
+    task->client_sock = client_sock;
+    task->len = len;
+    memcpy(task->buff, buff, len);
+    task->trace = trace_detach();
+
+    pthread_mutex_lock(&B.lock);
+    if (B.count == POOL_BLOCKING_QUEUE) {
+        pthread_mutex_unlock(&B.lock);
+        trace_attach(task->trace);//stays with this thread, which runs it after all
+        free(task);
+        return -1;
+    }
+    B.ring[(B.head + B.count++) % POOL_BLOCKING_QUEUE] = task;
+    pthread_cond_signal(&B.ready);
+    pthread_mutex_unlock(&B.lock);
+    return 0;
+}
+
+static void *blocking_main(void *arg) {
+    numa_bind_thread((int)(intptr_t)arg);
+    for (;;) {
+        pthread_mutex_lock(&B.lock);
+        while (B.count == 0) pthread_cond_wait(&B.ready, &B.lock);
+        struct blocking_task *task = B.ring[B.head];
+        B.head = (B.head + 1) % POOL_BLOCKING_QUEUE;
+        B.count--;
+        pthread_mutex_unlock(&B.lock);
+
+        trace_attach(task->trace);
+        dispatch_request(task->client_sock, task->buff, task->len);
+        free(task);
+        connection_done();
+    }
+    return NULL;
+}
+
+static int detach(int client_sock, char *buff, int len) {//0 once running on a thread of its own, 1 if it ran here
+    if (dispatch_detached(client_sock, buff, len, connection_done) == 0) return 0;
+    dispatch_request(client_sock, buff, len);//no thread to be had: run it here, that is the backpressure
+    return 1;
+}
+
+static int page_cold(int fd, off_t offset) {//first page of the body not cached, sendfile would wait on the disk
+    char byte;
+    struct iovec iov = {&byte, 1};
+    return preadv2(fd, &iov, 1, offset, RWF_NOWAIT) < 0 && errno == EAGAIN;
+}
+
+static int hand_off(int client_sock, char *buff, int len) {//0 once queued on the blocking pool, 1 if it ran here
+    if (blocking_submit(client_sock, buff, len) == 0) return 0;
+    dispatch_request(client_sock, buff, len);//full: run it here, that is the backpressure
+    return 1;
+}
+
+static void release_static(void *arg) {
+    close_static_file(arg);
+}
+
+static int run_connection(int client_sock) {//1 when the connection is finished, 0 when another thread has it
+    char buff[REQUEST_SIZE], scratch[REQUEST_SIZE];
+
+    if (client_sock < P.maxFd && admit_dequeue(P.acceptedAt[client_sock]) < 0) {//queue standing for too long
+        admit_shed(client_sock);
+        return 1;
+    }
+
+    trace_begin(client_sock);
+    trace_phase(TRACE_READ);
+    int len = read(client_sock, buff, sizeof(buff) - 1);
+    if (len <= 0) {
+        trace_drop();
+        close(client_sock);
+        return 1;
+    }
+
+    buff[len] = '\0';
+    if (h2_wanted(buff, len) || proxy_wanted(buff) || upload_wanted(buff) || profile_wanted(buff)) {//an HTTP/2 connection lives as long as the client keeps it, a backend answers when it can, an upload as fast as the client sends, a profile when its time is up
+        return detach(client_sock, buff, len);
+    }
+    if (len >= 5 && memcmp(buff, "POST ", 5) == 0) {//CGI forks and waits for the script
+        return hand_off(client_sock, buff, len);
+    }
+
+    struct static_file sf;
+    memcpy(scratch, buff, len);
+    scratch[len] = '\0';
+    trace_phase(TRACE_OPEN);
+    if (!open_static_file(scratch, &sf)) {//errors, ranges: cheap or rare, run them here
+        dispatch_request(client_sock, buff, len);
+        return 1;
+    }
+
+    if (sf.size > 0 && page_cold(sf.fd, sf.offset)) {//disk read ahead, move it off the request threads
+        close_static_file(&sf);
+        return hand_off(client_sock, buff, len);
+    }
+
+    trace_phase(TRACE_SEND);
+    struct outq q;
+    outq_init(&q, client_sock);
+    outq_mem(&q, sf.header, sf.headLength, NULL, NULL);
+    outq_file(&q, sf.fd, sf.offset, sf.size, release_static, &sf);//the entry or pack stays pinned until the body is out
+    outq_finish(&q);
+    close(client_sock);
+    trace_end();
+    return 1;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
+    numa_bind_thread(self->node);//before the stack below is touched
+    for (;;) {
+        int client_sock = dq_take(&self->dq);
+        if (client_sock == EMPTY) client_sock = steal_work(self);
+        if (client_sock == EMPTY) {
+            worker_sleep();
+            continue;
+        }
+        if (run_connection(client_sock)) connection_done();
+    }
+    return NULL;
+}
+
+static int pool_accepted(int client_sock, const struct sockaddr_in *client_addr) {
+    if (ratelimit_take(RATELIMIT_IP, client_addr->sin_addr.s_addr, NULL) < 0) {//before a single byte is parsed
+        ratelimit_refuse(client_sock);
+        return -1;
+    }
+    if (admit_accept() < 0) {//at the cap: answer now rather than queue work that cannot finish in time
+        admit_shed(client_sock);
+        return -1;
+    }
+
+    logMsg("New connection accepted");
+    score_accepted();
+    __atomic_fetch_add(&P.inflight, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void pool_ready(int client_sock) {
+    if (client_sock < P.maxFd) P.acceptedAt[client_sock] = admit_now();//queueing starts once the head is in; before the push publishes it
+    int node = numa_socket_node(client_sock);
+    if (node < 0) node = P.nextNode++ % P.nodes;
+    while (dq_push(P.accepted[node], client_sock) < 0) {//every worker is far behind, let the listen queue absorb it
+        wake_one();
+        nanosleep(&(struct timespec){0, 1000000}, NULL);
+    }
+    wake_one();
+}
+
+static void pool_expired(int client_sock) {
+    (void)client_sock;
+    connection_done();
+}
+
+static const struct gate_ops pool_ops = {pool_accepted, pool_ready, pool_expired, NULL, NULL};
+
+static void start_thread(void *(*fn)(void *), void *arg, pthread_t *thread) {
+    pthread_t tmp;
+    if (!thread) thread = &tmp;
+
+    sigset_t all, saved;//signals go to the acceptor, whose epoll_wait() they are meant to interrupt
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int err = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void pool_serve(int server_sock, int workers) {
+    signal(SIGPIPE, SIG_IGN);//a client hanging up must not take every thread with it
+
+    P.count = workers;
+    P.nodes = numa_nodes();
+    P.accepted = calloc(P.nodes, sizeof(*P.accepted));
+    P.workers = calloc(workers, sizeof(*P.workers));
+    P.maxFd = sysconf(_SC_OPEN_MAX) > 0 ? sysconf(_SC_OPEN_MAX) : 1024;
+    P.acceptedAt = calloc(P.maxFd, sizeof(*P.acceptedAt));
+    if (!P.accepted || !P.workers || !P.acceptedAt) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int n = 0; n < P.nodes; n++) {
+        if (!(P.accepted[n] = numa_alloc(sizeof(struct deque), n))) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < workers; i++) {//spread over the nodes, neighbours in the array on different ones
+        struct worker *w = numa_alloc(sizeof(struct worker), i % P.nodes);
+        if (!w) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        w->seed = i + 1;
+        w->node = i % P.nodes;
+        P.workers[i] = w;
+    }
+    for (int i = 0; i < workers; i++) start_thread(worker_main, P.workers[i], &P.workers[i]->thread);//every victim in place before the first steal
+    for (int i = 0; i < POOL_BLOCKING_THREADS; i++) start_thread(blocking_main, (void *)(intptr_t)(i % P.nodes), NULL);
+
+    char lgbuff[96];
+    snprintf(lgbuff, sizeof(lgbuff), "work-stealing pool: %d workers, %d blocking, %d NUMA nodes", workers, POOL_BLOCKING_THREADS, P.nodes);
+    logMsg(lgbuff);
+
+    if (gate_serve(server_sock, &pool_ops) < 0) return;//slow clients wait on epoll, not on a worker
+
+    while (__atomic_load_n(&P.inflight, __ATOMIC_ACQUIRE) > 0) {//let the workers finish what they hold
+        nanosleep(&(struct timespec){0, 10000000}, NULL);
+    }
+    logMsg("drained");
+}
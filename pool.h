@@ -0,0 +1,20 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Slots in each work-stealing deque (power of two)
+#define POOL_QUEUE 1024
+
+// Most connections an idle worker takes from the acceptor in one steal
+#define POOL_STEAL_BATCH 8
+
+// Threads and queue slots of the pool that runs blocking work (CGI, cold files)
+#define POOL_BLOCKING_THREADS 8
+#define POOL_BLOCKING_QUEUE 64
+
+// Serve server_sock with one acceptor (the calling thread) feeding
+// `workers` request threads that steal connections from it and from each
+// other. Returns if accept() fails, or once every accepted connection has
+// been finished after server_draining() turned on.
+void pool_serve(int server_sock, int workers);
+
+#endif // POOL_H
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "httpserve.h"
+#include "prefork.h"
+#include "numa.h"
+
+static struct score_slot *board;      // shared with every worker
+static struct score_slot *mine;       // this worker's slot, NULL in the master or without prefork
+static volatile sig_atomic_t stopping;
+
+void score_accepted(void) {
+    if (!mine) return;
+    __atomic_fetch_add(&mine->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mine->active, 1, __ATOMIC_RELAXED);
+}
+
+void score_done(void) {
+    if (mine) __atomic_fetch_sub(&mine->active, 1, __ATOMIC_RELAXED);
+}
+
+static void on_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static void on_child(int sig) {//only here to cut the master's sleep short
+    (void)sig;
+}
+
+static void spawn(int slot, int server_sock, void (*serve)(int)) {
+    struct score_slot *s = &board[slot];
+    __atomic_store_n(&s->state, SCORE_STARTING, __ATOMIC_RELAXED);
+    s->started = time(NULL);
+    s->generation++;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);//CGI waits on its own child, the master's handlers would interrupt it
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        static char lineBuffer[BUFSIZ];//a fresh buffer: glibc keeps flushing the old one in full blocks
+        setvbuf(stdout, lineBuffer, _IOLBF, sizeof(lineBuffer));//workers are stopped by signal, nothing may sit in a buffer
+        if (numa_nodes() > 1) numa_restrict(slot % numa_nodes());//a node per worker: its threads, sockets and memory stay there
+        mine = s;
+        __atomic_store_n(&mine->active, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&mine->requests, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&mine->state, SCORE_SERVING, __ATOMIC_RELEASE);
+        serve(server_sock);
+        exit(server_draining() ? EXIT_SUCCESS : EXIT_FAILURE);//otherwise accept() broke; the master starts a fresh one
+    }
+    if (pid < 0) {
+        perror("fork");
+        __atomic_store_n(&s->state, SCORE_EMPTY, __ATOMIC_RELAXED);
+        return;
+    }
+    s->pid = pid;
+}
+
+static void report(unsigned long retired, int workers) {
+    unsigned long requests = retired;
+    int active = 0, up = 0;
+
+    for (int i = 0; i < workers; i++) {
+        requests += __atomic_load_n(&board[i].requests, __ATOMIC_RELAXED);
+        active += __atomic_load_n(&board[i].active, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&board[i].state, __ATOMIC_ACQUIRE) == SCORE_SERVING) up++;
+    }
+
+    char lgbuff[128];
+    snprintf(lgbuff, sizeof(lgbuff), "scoreboard: %d/%d workers up, %d active, %lu requests", up, workers, active, requests);
+    logMsg(lgbuff);
+}
+
+void prefork_serve(int server_sock, int workers, void (*serve)(int server_sock)) {
+    board = mmap(NULL, workers * sizeof(*board), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    time_t *respawnAt = calloc(workers, sizeof(*respawnAt));
+    if (board == MAP_FAILED || !respawnAt) {
+        perror("scoreboard");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction sa = {0};//no SA_RESTART: every one of these should wake the master
+    sa.sa_handler = on_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = on_child;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    fflush(stdout);//or every worker would repeat whatever is still buffered
+    for (int i = 0; i < workers; i++) spawn(i, server_sock, serve);
+
+    char lgbuff[128];
+    snprintf(lgbuff, sizeof(lgbuff), "prefork master %d: %d workers", (int)getpid(), workers);
+    logMsg(lgbuff);
+
+    unsigned long retired = 0, lastRequests = 0;//requests of workers already reaped
+    time_t nextReport = time(NULL) + PREFORK_REPORT_SECS;
+
+    while (!stopping) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < workers; i++) {
+                struct score_slot *s = &board[i];
+                if (s->pid != pid) continue;
+
+                if (WIFSIGNALED(status)) snprintf(lgbuff, sizeof(lgbuff), "worker %d killed by signal %d", (int)pid, WTERMSIG(status));
+                else snprintf(lgbuff, sizeof(lgbuff), "worker %d exited with status %d", (int)pid, WEXITSTATUS(status));
+                logMsg(lgbuff);
+
+                retired += __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->requests, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->active, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->state, SCORE_EMPTY, __ATOMIC_RELAXED);
+                s->pid = 0;
+                respawnAt[i] = time(NULL) + (time(NULL) - s->started < PREFORK_MIN_UPTIME ? 1 : 0);
+            }
+        }
+
+        time_t now = time(NULL);
+        int alive = 0;
+        for (int i = 0; i < workers; i++) {
+            if (!server_draining() && board[i].state == SCORE_EMPTY && respawnAt[i] <= now) {
+                fflush(stdout);
+                spawn(i, server_sock, serve);
+            }
+            if (board[i].pid > 0) {
+                alive++;
+                if (server_draining()) kill(board[i].pid, SIGQUIT);//every round, a worker may miss the first one mid-syscall
+            }
+        }
+        if (server_draining() && alive == 0) break;
+
+        if (server_tick()) {//the master remaps too, so respawned workers start on the new pack
+            for (int i = 0; i < workers; i++) {
+                if (board[i].pid > 0) kill(board[i].pid, SIGHUP);
+            }
+        }
+
+        if (now >= nextReport) {//only when something happened since the last summary
+            unsigned long requests = retired;
+            for (int i = 0; i < workers; i++) requests += __atomic_load_n(&board[i].requests, __ATOMIC_RELAXED);
+            if (requests != lastRequests) report(retired, workers);
+            lastRequests = requests;
+            nextReport = now + PREFORK_REPORT_SECS;
+        }
+        fflush(stdout);
+
+        sleep(1);//SIGCHLD, SIGHUP, SIGQUIT and SIGTERM cut it short
+    }
+
+    if (!stopping) logMsg("workers drained");
+    else logMsg("stopping workers");
+    for (int i = 0; i < workers; i++) {
+        if (board[i].pid > 0) kill(board[i].pid, SIGTERM);
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    for (int i = 0; i < workers; i++) __atomic_store_n(&board[i].state, SCORE_EMPTY, __ATOMIC_RELAXED);
+    report(retired, workers);
+    free(respawnAt);
+    munmap(board, workers * sizeof(*board));
+}
@@ -0,0 +1,39 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <sys/types.h>
+#include <time.h>
+
+// Seconds between scoreboard summaries in the master's log
+#define PREFORK_REPORT_SECS 10
+
+// A worker that dies sooner than this after being forked is respawned
+// after a pause instead of straight away, so a crash at startup cannot spin
+#define PREFORK_MIN_UPTIME 1
+
+enum score_state { SCORE_EMPTY, SCORE_STARTING, SCORE_SERVING };
+
+// One worker's slot in the shared scoreboard. The worker only adds to its
+// own counters and the master only reads them, so nothing is locked; a slot
+// fills a cache line so workers never contend on each other's.
+struct score_slot {
+    pid_t pid;
+    int state;                   // enum score_state
+    int active;                  // connections being handled right now
+    unsigned generation;         // times this slot has been (re)spawned
+    unsigned long requests;      // connections accepted since the fork
+    time_t started;
+} __attribute__((aligned(64)));
+
+// Master side: fork `workers` processes that each run serve(server_sock),
+// respawn any that exit, forward SIGHUP and SIGQUIT to them and log
+// scoreboard totals. Returns after SIGTERM or SIGINT once every worker has
+// been stopped, or after SIGQUIT once every worker has drained.
+void prefork_serve(int server_sock, int workers, void (*serve)(int server_sock));
+
+// Worker side: engines call these when a connection is accepted and when it
+// is closed. Both are no-ops outside a prefork worker.
+void score_accepted(void);
+void score_done(void);
+
+#endif // PREFORK_H
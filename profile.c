@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "httpserve.h"
+#include "outq.h"
+#include "router.h"
+#include "co.h"
+#include "profile.h"
+
+struct ring {
+    int fd;
+    struct perf_event_mmap_page *meta;  // first page, head and tail
+    char *data;
+    size_t size;
+};
+
+struct stack {
+    uint64_t hash;
+    unsigned count;
+    int depth;
+    uint64_t ips[PROFILE_MAX_DEPTH];    // leaf first
+};
+
+#define SLOTS (PROFILE_MAX_STACKS * 2)  // open addressing, never more than half full
+
+struct profile {
+    struct ring rings[PROFILE_MAX_THREADS];
+    int ringCount;
+    int stackCount;
+    unsigned dropped;                   // lost by the kernel, or no room for the stack
+    int slots[SLOTS];                   // index into stacks + 1, 0 if free
+    struct stack stacks[PROFILE_MAX_STACKS];
+};
+
+struct symbol {
+    uintptr_t start, end;
+    const char *name;
+};
+
+static int busy;                        // one profile at a time, they would only sample each other
+static size_t pageSize;
+
+// Function symbols of the executable itself: dladdr() only knows exported
+// ones, and most of the server is static functions
+static pthread_once_t symbolsOnce = PTHREAD_ONCE_INIT;
+static struct symbol *symbols;
+static int symbolCount;
+static uintptr_t exeLow, exeHigh;
+
+static void serve(const struct request *req, void *arg);
+
+int profile_mount(const char *path) {
+    return router_add(ROUTER_GET, path, serve, NULL);
+}
+
+int profile_wanted(const char *buff) {
+    return router_peek(buff) == serve;
+}
+
+static int by_start(const void *a, const void *b) {
+    const struct symbol *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int main_object(struct dl_phdr_info *info, size_t size, void *arg) {
+    (void)size;
+    *(uintptr_t *)arg = info->dlpi_addr;//the executable comes first
+    return 1;
+}
+
+static void load_symbols(void) {
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    const char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);//kept: the names point into it
+    close(fd);
+    if (image == MAP_FAILED) return;
+
+    const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)image;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_shoff + (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > (size_t)st.st_size) return;
+    const ElfW(Shdr) *sections = (const ElfW(Shdr) *)(image + eh->e_shoff), *table = NULL;
+    for (int i = 0; i < eh->e_shnum; i++) {//the full table if not stripped, else what is exported
+        if (sections[i].sh_type == SHT_SYMTAB || (!table && sections[i].sh_type == SHT_DYNSYM)) table = &sections[i];
+    }
+    if (!table || table->sh_link >= eh->e_shnum) return;
+    const ElfW(Shdr) *strings = &sections[table->sh_link];
+    if (table->sh_offset + table->sh_size > (size_t)st.st_size || strings->sh_offset + strings->sh_size > (size_t)st.st_size) return;
+
+    const ElfW(Sym) *syms = (const ElfW(Sym) *)(image + table->sh_offset);
+    size_t count = table->sh_size / sizeof(*syms);
+    if (!(symbols = malloc(count * sizeof(*symbols)))) return;
+    uintptr_t base = 0;
+    dl_iterate_phdr(main_object, &base);
+    for (size_t i = 0; i < count; i++) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || !syms[i].st_value || syms[i].st_name >= strings->sh_size) continue;
+        struct symbol *s = &symbols[symbolCount++];
+        s->start = base + syms[i].st_value;
+        s->end = s->start + (syms[i].st_size ? syms[i].st_size : 1);
+        s->name = image + strings->sh_offset + syms[i].st_name;
+    }
+    qsort(symbols, symbolCount, sizeof(*symbols), by_start);
+    if (symbolCount) {
+        exeLow = symbols[0].start;
+        exeHigh = symbols[symbolCount - 1].end;
+    }
+}
+
+static const char *symbolize(uintptr_t ip, char *scratch, size_t size) {
+    if (ip >= exeLow && ip < exeHigh) {
+        int lo = 0, hi = symbolCount - 1;
+        while (lo < hi) {//last symbol starting at or below ip
+            int mid = (lo + hi + 1) / 2;
+            if (symbols[mid].start <= ip) lo = mid;
+            else hi = mid - 1;
+        }
+        if (ip < symbols[lo].end) return symbols[lo].name;
+    }
+    Dl_info info;
+    int found = dladdr((void *)ip, &info);//0 leaves info unwritten: JIT code, anonymous mappings
+    if (found && info.dli_sname) return info.dli_sname;
+    if (found && info.dli_fname) {
+        const char *slash = strrchr(info.dli_fname, '/');
+        snprintf(scratch, size, "[%s]", slash ? slash + 1 : info.dli_fname);
+    } else {
+        snprintf(scratch, size, "[%#lx]", (unsigned long)ip);
+    }
+    return scratch;
+}
+
+static int open_ring(struct ring *r, pid_t tid) {
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = PERF_TYPE_SOFTWARE,
+        .config = PERF_COUNT_SW_TASK_CLOCK,//time on a CPU, so waiting threads cost nothing
+        .freq = 1,
+        .sample_freq = PROFILE_HZ,
+        .sample_type = PERF_SAMPLE_CALLCHAIN,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .exclude_callchain_kernel = 1,
+        .sample_max_stack = PROFILE_MAX_DEPTH,
+    };
+    r->fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (r->fd < 0) return -1;
+    r->size = PROFILE_RING_PAGES * pageSize;
+    void *m = mmap(NULL, pageSize + r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (m == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->meta = m;
+    r->data = (char *)m + pageSize;
+    return 0;
+}
+
+static void close_ring(struct ring *r) {
+    munmap(r->meta, pageSize + r->size);
+    close(r->fd);
+}
+
+static int open_rings(struct profile *p) {//one per thread but this one; errno of the last failure if none opened
+    DIR *d = opendir("/proc/self/task");
+    if (!d) return -1;
+    pid_t self = syscall(SYS_gettid);
+    int err = 0;
+    for (struct dirent *e; (e = readdir(d)) && p->ringCount < PROFILE_MAX_THREADS;) {
+        pid_t tid = atoi(e->d_name);
+        if (tid <= 0 || tid == self) continue;
+        if (open_ring(&p->rings[p->ringCount], tid) == 0) p->ringCount++;
+        else if (errno != ESRCH) err = errno;//a thread that ended meanwhile is no failure
+    }
+    closedir(d);
+    errno = err;
+    return p->ringCount > 0 ? 0 : -1;
+}
+
+static void copy_out(const struct ring *r, uint64_t pos, void *dst, size_t len) {//records may wrap around the ring's end
+    size_t off = pos & (r->size - 1), first = r->size - off < len ? r->size - off : len;
+    memcpy(dst, r->data + off, first);
+    memcpy((char *)dst + first, r->data, len - first);
+}
+
+static void add_stack(struct profile *p, const uint64_t *chain, uint64_t nr) {
+    uint64_t ips[PROFILE_MAX_DEPTH], hash = 14695981039346656037ULL;
+    int depth = 0;
+    for (uint64_t i = 0; i < nr && depth < PROFILE_MAX_DEPTH; i++) {
+        if (chain[i] >= (uint64_t)PERF_CONTEXT_MAX) continue;//context markers, not addresses
+        ips[depth++] = chain[i];
+        hash = (hash ^ chain[i]) * 1099511628211ULL;
+    }
+    if (depth == 0) return;
+
+    for (unsigned i = hash & (SLOTS - 1);; i = (i + 1) & (SLOTS - 1)) {
+        if (!p->slots[i]) {
+            if (p->stackCount == PROFILE_MAX_STACKS) {
+                p->dropped++;
+                return;
+            }
+            struct stack *s = &p->stacks[p->stackCount++];
+            s->hash = hash;
+            s->count = 1;
+            s->depth = depth;
+            memcpy(s->ips, ips, depth * sizeof(*ips));
+            p->slots[i] = p->stackCount;
+            return;
+        }
+        struct stack *s = &p->stacks[p->slots[i] - 1];
+        if (s->hash == hash && s->depth == depth && memcmp(s->ips, ips, depth * sizeof(*ips)) == 0) {
+            s->count++;
+            return;
+        }
+    }
+}
+
+static void drain(struct profile *p, struct ring *r) {
+    uint64_t head = __atomic_load_n(&r->meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->meta->data_tail;
+    uint64_t record[PROFILE_MAX_DEPTH + 16];
+    while (tail < head) {
+        struct perf_event_header h;
+        copy_out(r, tail, &h, sizeof(h));
+        if (h.size < sizeof(h)) break;
+        if (h.type == PERF_RECORD_SAMPLE && h.size <= sizeof(record)) {//header, nr, then nr addresses
+            copy_out(r, tail, record, h.size);
+            uint64_t nr = record[1];
+            if (nr <= (uint64_t)(h.size - 16) / 8) add_stack(p, record + 2, nr);
+        } else if (h.type == PERF_RECORD_LOST && h.size >= 24) {//header, id, count
+            copy_out(r, tail, record, 24);
+            p->dropped += record[2];
+        }
+        tail += h.size;
+    }
+    __atomic_store_n(&r->meta->data_tail, tail, __ATOMIC_RELEASE);//the kernel may reuse the space
+}
+
+struct text {
+    char *p;
+    size_t len, cap;
+};
+
+static void append(struct text *t, const char *s, size_t len) {
+    if (!t->p) return;//ran out of memory earlier
+    if (t->len + len > t->cap) {
+        size_t cap = t->cap * 2 > t->len + len ? t->cap * 2 : t->len + len;
+        char *grown = realloc(t->p, cap);
+        if (!grown) {
+            free(t->p);
+            t->p = NULL;
+            return;
+        }
+        t->p = grown;
+        t->cap = cap;
+    }
+    memcpy(t->p + t->len, s, len);
+    t->len += len;
+}
+
+static void fold(const struct profile *p, struct text *t) {//root first, as flame graph tools want them
+    char scratch[64], count[32];
+    for (int i = 0; i < p->stackCount; i++) {
+        const struct stack *s = &p->stacks[i];
+        for (int d = s->depth - 1; d >= 0; d--) {
+            uintptr_t ip = d == 0 ? s->ips[d] : s->ips[d] - 1;//callers' entries are return addresses, one past the call
+            const char *name = symbolize(ip, scratch, sizeof(scratch));
+            append(t, name, strlen(name));
+            if (d) append(t, ";", 1);
+        }
+        append(t, count, snprintf(count, sizeof(count), " %u\n", s->count));
+    }
+    if (p->dropped) append(t, count, snprintf(count, sizeof(count), "[dropped] %u\n", p->dropped));
+}
+
+static int seconds_from(const char *query) {//0 if malformed
+    int secs = PROFILE_DEFAULT_SECS;
+    for (const char *q = query; q && *q;) {
+        if (strncmp(q, "seconds=", 8) == 0) {
+            char *e;
+            long v = strtol(q + 8, &e, 10);
+            if (e == q + 8 || (*e && *e != '&') || v < 1 || v > PROFILE_MAX_SECS) return 0;
+            secs = v;
+        }
+        q = strchr(q, '&');
+        if (q) q++;
+    }
+    return secs;
+}
+
+static void respond(int client_sock, const char *status, const char *message) {
+    char response[256];
+    int len = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s",
+                       status, strlen(message), message);
+    outq_send(client_sock, response, len);
+}
+
+static void serve(const struct request *req, void *arg) {
+    (void)arg;
+    int secs = seconds_from(req->query);
+    if (!secs) {
+        char message[64];
+        snprintf(message, sizeof(message), "seconds must be 1 to %d\n", PROFILE_MAX_SECS);
+        respond(req->sock, "400 Bad Request", message);
+        return;
+    }
+    if (__atomic_exchange_n(&busy, 1, __ATOMIC_ACQUIRE)) {
+        respond(req->sock, "409 Conflict", "a profile is already running\n");
+        return;
+    }
+    if (!pageSize) pageSize = sysconf(_SC_PAGESIZE);
+    pthread_once(&symbolsOnce, load_symbols);
+
+    struct profile *p = calloc(1, sizeof(*p));
+    if (!p || open_rings(p) < 0) {
+        char message[160];
+        if (!p) snprintf(message, sizeof(message), "out of memory\n");
+        else if (!errno) snprintf(message, sizeof(message), "no other thread to sample, the blocking engine runs on this one\n");
+        else snprintf(message, sizeof(message), "perf_event_open: %s (see kernel.perf_event_paranoid)\n", strerror(errno));
+        respond(req->sock, "503 Service Unavailable", message);
+        free(p);
+        __atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    for (int waited = 0; waited < secs * 1000; waited += PROFILE_DRAIN_MS) {
+        co_sleep(PROFILE_DRAIN_MS);
+        for (int i = 0; i < p->ringCount; i++) drain(p, &p->rings[i]);
+    }
+    for (int i = 0; i < p->ringCount; i++) {
+        drain(p, &p->rings[i]);
+        close_ring(&p->rings[i]);
+    }
+
+    struct text body = {malloc(65536), 0, 65536};
+    fold(p, &body);
+    free(p);
+    __atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+    if (!body.p) {
+        respond(req->sock, "500 Internal Server Error", "out of memory\n");
+        return;
+    }
+
+    char head[256];
+    int headLen = snprintf(head, sizeof(head),
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/plain\r\n"
+                           "Content-Length: %zu\r\n"
+                           "Cache-Control: no-store\r\n"
+                           "\r\n",
+                           body.len);
+    struct outq q;
+    outq_init(&q, req->sock);
+    outq_copy(&q, head, headLen);
+    outq_mem(&q, body.p, body.len, free, body.p);
+    outq_finish(&q);
+}
@@ -0,0 +1,36 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Sampling profiler: GET <path>?seconds=N samples the user space stacks of
+// every thread of the process while it runs on a CPU, with perf_event_open(),
+// and answers with folded stacks ("outer;inner;leaf count" lines) ready for
+// flamegraph.pl or speedscope. Nothing is set up until a request asks, so
+// the server pays nothing between profiles. Stacks are walked by frame
+// pointer: build with -fno-omit-frame-pointer for whole ones. Threads
+// started during the window are not sampled.
+
+// Samples per second and thread, off the round 100 so as not to beat with timers
+#define PROFILE_HZ 99
+
+#define PROFILE_DEFAULT_SECS 10
+#define PROFILE_MAX_SECS 60
+
+// Threads sampled at once, and distinct stacks kept
+#define PROFILE_MAX_THREADS 256
+#define PROFILE_MAX_STACKS 4096
+#define PROFILE_MAX_DEPTH 64
+
+// Data pages of each thread's sample ring (a power of two), and how often
+// the rings are emptied
+#define PROFILE_RING_PAGES 8
+#define PROFILE_DRAIN_MS 100
+
+// Serve profiles at path (GET). Mount it where only operators reach it.
+// Returns 0, or -1 if the route could not be added.
+int profile_mount(const char *path);
+
+// 1 if the request in buff (NUL-terminated) asks for a profile. It waits for
+// seconds, so engines move it off their fast paths.
+int profile_wanted(const char *buff);
+
+#endif // PROFILE_H
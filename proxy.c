@@ -0,0 +1,562 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "httpserve.h"
+#include "urlpath.h"
+#include "outq.h"
+#include "ratelimit.h"
+#include "tls.h"
+#include "router.h"
+#include "proxy.h"
+#include "gate.h"
+
+struct backend {
+    char name[128];             // as configured, for logs
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    int outstanding;            // requests in flight, the balancing metric
+    int fails;                  // consecutive failures
+    int ejected;                // out of rotation until a health check passes
+    pthread_mutex_t lock;       // guards the idle pool
+    int idleCount;
+    int idle[PROXY_IDLE];
+    time_t idleSince[PROXY_IDLE];
+};
+
+struct route {
+    char prefix[URLPATH_MAX];
+    size_t prefixLen;
+    unsigned next;              // rotates the first pick among equally loaded backends
+    int count;
+    struct backend backends[PROXY_MAX_BACKENDS];
+};
+
+static struct route routes[PROXY_MAX_ROUTES];
+static int routeCount;
+
+static void serve(const struct request *req, void *arg);
+
+// How an exchange with a backend went
+enum { UP_OK, UP_STALE, UP_FAILED, UP_TIMEOUT, CLIENT_FAILED, CLIENT_TIMEOUT };
+
+// Response bodies in chunked coding are decoded on the way through, the
+// client gets them close-delimited
+enum { CHUNK_SIZE, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNK_DONE };
+
+struct chunked {
+    int state;
+    int digits;
+    int lineLen;
+    uint64_t left;
+};
+
+static int resolve(struct backend *b, const char *spec, size_t len) {
+    if (len >= sizeof(b->name)) return -1;
+    memcpy(b->name, spec, len);
+    b->name[len] = '\0';
+
+    if (strncmp(b->name, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&b->addr;
+        if (!b->name[5] || strlen(b->name + 5) >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, b->name + 5);
+        b->addrLen = sizeof(*un);
+        return 0;
+    }
+
+    char *colon = strrchr(b->name, ':');
+    if (!colon || colon == b->name) return -1;
+    *colon = '\0';
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *res;
+    int err = getaddrinfo(b->name, colon + 1, &hints, &res);//once, at startup
+    *colon = ':';
+    if (err) return -1;
+    memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+    b->addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int proxy_add(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (spec[0] != '/' || !eq || routeCount == PROXY_MAX_ROUTES) return -1;
+
+    struct route *r = &routes[routeCount];
+    memset(r, 0, sizeof(*r));
+    size_t prefixLen = eq - spec;
+    while (prefixLen > 1 && spec[prefixLen - 1] == '/') prefixLen--;//"/api/" is the same route as "/api"
+    if (prefixLen >= sizeof(r->prefix)) return -1;
+    memcpy(r->prefix, spec, prefixLen);
+    r->prefixLen = prefixLen;
+
+    for (const char *p = eq + 1; *p;) {
+        size_t n = strcspn(p, ",");
+        if (n == 0 || r->count == PROXY_MAX_BACKENDS || resolve(&r->backends[r->count], p, n) < 0) return -1;
+        pthread_mutex_init(&r->backends[r->count++].lock, NULL);
+        p += n;
+        if (*p == ',') p++;
+    }
+    if (r->count == 0) return -1;
+
+    char below[URLPATH_MAX + 2];//"/api" and everything under "/api/", every method
+    snprintf(below, sizeof(below), "%s/*", prefixLen > 1 ? r->prefix : "");
+    if (router_add(ROUTER_ANY, below, serve, r) < 0 || (prefixLen > 1 && router_add(ROUTER_ANY, r->prefix, serve, r) < 0)) return -1;
+    routeCount++;
+    return 0;
+}
+
+int proxy_wanted(const char *buff) {
+    return routeCount > 0 && router_peek(buff) == serve;
+}
+
+static void set_limits(int fd, int secs) {
+    struct timeval limit = {secs, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+}
+
+static int connect_backend(const struct backend *b, int secs) {//blocking socket with per-call limits, or -1
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (const struct sockaddr *)&b->addr, b->addrLen) < 0) {
+        struct pollfd p = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (errno != EINPROGRESS || poll(&p, 1, secs * 1000) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            close(fd);
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    if (b->addr.ss_family != AF_UNIX) {//heads go out whole, Nagle would only hold them back
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    set_limits(fd, secs);
+    return fd;
+}
+
+static int take_idle(struct backend *b) {//a pooled connection the backend has not closed, or -1
+    time_t now = time(NULL);
+    pthread_mutex_lock(&b->lock);
+    while (b->idleCount > 0) {
+        int i = --b->idleCount;//newest first, the least likely to have timed out on the backend
+        int fd = b->idle[i];
+        char byte;
+        if (now - b->idleSince[i] < PROXY_IDLE_SECS && recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+            pthread_mutex_unlock(&b->lock);
+            return fd;
+        }
+        close(fd);//closed, too old, or sent something nobody asked for
+    }
+    pthread_mutex_unlock(&b->lock);
+    return -1;
+}
+
+static void give_idle(struct backend *b, int fd) {
+    pthread_mutex_lock(&b->lock);
+    if (b->idleCount < PROXY_IDLE && !__atomic_load_n(&b->ejected, __ATOMIC_RELAXED)) {
+        b->idle[b->idleCount] = fd;
+        b->idleSince[b->idleCount++] = time(NULL);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&b->lock);
+    if (fd >= 0) close(fd);
+}
+
+static void flush_idle(struct backend *b) {
+    pthread_mutex_lock(&b->lock);
+    while (b->idleCount > 0) close(b->idle[--b->idleCount]);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void note(struct backend *b, int ok) {//passive health: requests count like checks
+    if (ok) {
+        __atomic_store_n(&b->fails, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    if (__atomic_add_fetch(&b->fails, 1, __ATOMIC_RELAXED) >= PROXY_EJECT_FAILS && !__atomic_exchange_n(&b->ejected, 1, __ATOMIC_RELAXED)) {
+        char msg[192];
+        snprintf(msg, sizeof(msg), "backend %s ejected", b->name);
+        logMsg(msg);
+        flush_idle(b);
+    }
+}
+
+static struct backend *pick(struct route *r) {//least outstanding requests among the healthy ones
+    unsigned start = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+    struct backend *best = NULL;
+    int bestLoad = 0;
+    for (int i = 0; i < r->count; i++) {
+        struct backend *b = &r->backends[(start + i) % r->count];
+        if (__atomic_load_n(&b->ejected, __ATOMIC_RELAXED)) continue;
+        int load = __atomic_load_n(&b->outstanding, __ATOMIC_RELAXED);
+        if (!best || load < bestLoad) {
+            best = b;
+            bestLoad = load;
+        }
+    }
+    if (best) __atomic_fetch_add(&best->outstanding, 1, __ATOMIC_RELAXED);
+    return best;
+}
+
+static void done_with(struct backend *b) {
+    __atomic_fetch_sub(&b->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+static int probe(struct backend *b) {//1 if the backend answers HEAD / with anything but a 5xx
+    int fd = connect_backend(b, PROXY_CHECK_SECS);
+    if (fd < 0) return 0;
+
+    char req[256], resp[16];
+    int len = snprintf(req, sizeof(req), "HEAD / HTTP/1.1\r\nHost: %s\r\nUser-Agent: httpserve-health\r\nConnection: close\r\n\r\n",
+                       b->addr.ss_family == AF_UNIX ? "localhost" : b->name);
+    size_t got = 0;
+    if (send(fd, req, len, MSG_NOSIGNAL) == len) {
+        ssize_t n;
+        while (got < 12 && (n = recv(fd, resp + got, 12 - got, 0)) > 0) got += n;
+    }
+    close(fd);
+    return got == 12 && strncmp(resp, "HTTP/1.", 7) == 0 && resp[9] >= '1' && resp[9] <= '4';
+}
+
+static void *check_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep(PROXY_CHECK_SECS);
+        for (int i = 0; i < routeCount; i++) {
+            for (int j = 0; j < routes[i].count; j++) {
+                struct backend *b = &routes[i].backends[j];
+                int ok = probe(b);
+                if (ok && __atomic_exchange_n(&b->ejected, 0, __ATOMIC_RELAXED)) {
+                    char msg[192];
+                    snprintf(msg, sizeof(msg), "backend %s back in rotation", b->name);
+                    logMsg(msg);
+                }
+                note(b, ok);
+            }
+        }
+    }
+    return NULL;
+}
+
+void proxy_start(void) {
+    if (routeCount == 0) return;
+
+    if (spawn_detached(check_main, NULL) != 0) logMsg("no health checks for the proxy backends");
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int listed(const char *list, const char *name, size_t nameLen) {//name is one of the comma-separated tokens
+    for (const char *p = list; *p;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        size_t n = strcspn(p, ", \t");
+        if (n == nameLen && strncasecmp(p, name, n) == 0) return 1;
+        p += n;
+    }
+    return 0;
+}
+
+static int hop_by_hop(const char *name, size_t nameLen, const char *connection) {
+    static const char *const names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade",
+                                        "Transfer-Encoding", "Expect", "HTTP2-Settings"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == nameLen && strncasecmp(name, names[i], nameLen) == 0) return 1;
+    }
+    return listed(connection, name, nameLen);
+}
+
+static int copy_headers(char *out, size_t room, const char *headers, const char *connection) {//end-to-end headers only; length or -1
+    size_t len = 0;
+    for (const char *line = headers; *line && *line != '\r' && *line != '\n';) {
+        size_t lineLen = strcspn(line, "\r\n");
+        const char *colon = memchr(line, ':', lineLen);
+        if (colon && !hop_by_hop(line, colon - line, connection)) {
+            if (len + lineLen + 2 >= room) return -1;
+            memcpy(out + len, line, lineLen);
+            memcpy(out + len + lineLen, "\r\n", 2);
+            len += lineLen + 2;
+        }
+        line += lineLen;
+        if (*line == '\r') line++;
+        if (*line == '\n') line++;
+    }
+    return len;
+}
+
+static int send_request(int up, int client_sock, const char *head, size_t headLen, const char *body, size_t have, long long length) {
+    if (send_all(up, head, headLen) < 0 || send_all(up, body, have) < 0) return UP_STALE;
+
+    char buf[BUFFER_SIZE];//the rest of the body, a buffer at a time
+    struct gate_body b;
+    gate_body_start(&b);
+    for (long long left = length - have; left > 0;) {
+        int ready = gate_body_wait(&b, client_sock);
+        if (ready == 0) return CLIENT_TIMEOUT;
+        if (ready < 0) return CLIENT_FAILED;
+        ssize_t n = read(client_sock, buf, left < (long long)sizeof(buf) ? left : (long long)sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return CLIENT_FAILED;
+        if (send_all(up, buf, n) < 0) return errno == EAGAIN ? UP_TIMEOUT : UP_FAILED;
+        b.got += n;
+        left -= n;
+    }
+    return UP_OK;
+}
+
+static int read_head(int up, char *buf, size_t *got, size_t *headLen) {//adds to the *got bytes in buf until the blank line
+    for (;;) {
+        const char *end = memmem(buf, *got, "\r\n\r\n", 4);
+        if (end) {
+            *headLen = end + 4 - buf;
+            return *headLen >= 16 && strncmp(buf, "HTTP/1.", 7) == 0 && isdigit((unsigned char)buf[9]) ? UP_OK : UP_FAILED;
+        }
+        if (*got == PROXY_HEAD_MAX) return UP_FAILED;
+        ssize_t n = recv(up, buf + *got, PROXY_HEAD_MAX - *got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return UP_TIMEOUT;
+        if (n <= 0) return *got == 0 ? UP_STALE : UP_FAILED;//nothing at all: closed while it sat in the pool
+        *got += n;
+    }
+}
+
+static int dechunk(struct chunked *ch, const char *p, size_t len, struct outq *q) {//bytes used, or -1 on a malformed body
+    size_t i = 0;
+    while (i < len && ch->state != CHUNK_DONE) {
+        char c = p[i];
+        switch (ch->state) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)c)) {
+                if (ch->left >> 56) return -1;
+                ch->left = ch->left * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10));
+                ch->digits++;
+                i++;
+            } else if (ch->digits == 0) {
+                return -1;
+            } else {
+                ch->state = CHUNK_EXT;
+            }
+            break;
+        case CHUNK_EXT://extensions are ignored up to the end of the line
+            i++;
+            if (c == '\n') {
+                ch->state = ch->left ? CHUNK_DATA : CHUNK_TRAILER;
+                ch->digits = 0;
+                ch->lineLen = 0;
+            }
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i < ch->left ? len - i : ch->left;
+            outq_mem(q, p + i, n, NULL, NULL);
+            i += n;
+            ch->left -= n;
+            if (ch->left == 0) ch->state = CHUNK_DATA_END;
+            break;
+        }
+        case CHUNK_DATA_END:
+            i++;
+            if (c == '\n') ch->state = CHUNK_SIZE;
+            else if (c != '\r') return -1;
+            break;
+        case CHUNK_TRAILER://trailers are dropped, the client has no framing to carry them
+            i++;
+            if (c == '\n') {
+                if (ch->lineLen == 0) ch->state = CHUNK_DONE;
+                ch->lineLen = 0;
+            } else if (c != '\r') {
+                ch->lineLen++;
+            }
+            break;
+        }
+    }
+    return i;
+}
+
+static int relay_response(int up, int client_sock, const char *method, char *buf, size_t got, size_t headLen) {//1 if up can be reused
+    const char *headers = strchr(buf, '\n') + 1;
+    int status = atoi(buf + 9);
+    char value[256], connection[256] = "";
+    get_header(headers, "Connection", connection, sizeof(connection));
+
+    int reusable = buf[7] == '1' && !listed(connection, "close", 5);
+    int chunked = get_header(headers, "Transfer-Encoding", value, sizeof(value)) && listed(value, "chunked", 7);
+    long long length = -1;
+    if (!chunked && get_header(headers, "Content-Length", value, sizeof(value))) length = atoll(value);
+    if (strcmp(method, "HEAD") == 0 || status == 204 || status == 304) length = 0;
+    if (length < 0 && !chunked) reusable = 0;//ends when the backend closes
+
+    char head[PROXY_HEAD_MAX + 64];
+    size_t statusLen = headers - buf;
+    memcpy(head, buf, statusLen);
+    int copied = copy_headers(head + statusLen, sizeof(head) - statusLen - 32, headers, connection);
+    if (copied < 0) return 0;
+    size_t len = statusLen + copied;
+    len += snprintf(head + len, sizeof(head) - len, "Connection: close\r\n\r\n");//one request per client connection, as always
+
+    struct outq q;
+    outq_init(&q, client_sock);
+    outq_mem(&q, head, len, NULL, NULL);
+
+    struct chunked ch = {CHUNK_SIZE, 0, 0, 0};
+    char *data = buf + headLen;
+    size_t dataLen = got - headLen;
+    for (;;) {
+        if (chunked) {
+            int used = dechunk(&ch, data, dataLen, &q);
+            if (used < 0 || (ch.state == CHUNK_DONE && (size_t)used < dataLen)) reusable = 0;//malformed, or more than the body
+            if (used < 0 || ch.state == CHUNK_DONE) break;
+        } else if (length >= 0) {
+            size_t take = (long long)dataLen < length ? dataLen : (size_t)length;
+            outq_mem(&q, data, take, NULL, NULL);
+            length -= take;
+            if (take < dataLen) reusable = 0;
+            if (length == 0) break;
+        } else {
+            outq_mem(&q, data, dataLen, NULL, NULL);
+        }
+        if (outq_flush(&q) < 0) {//client gone, the rest of the response is still on the connection
+            reusable = 0;
+            break;
+        }
+
+        ssize_t n = recv(up, buf, BUFFER_SIZE, 0);
+        if (n < 0 && errno == EINTR) {
+            dataLen = 0;
+            continue;
+        }
+        if (n <= 0) {//fine for a close-delimited body, truncated for the others
+            reusable = 0;
+            break;
+        }
+        data = buf;
+        dataLen = n;
+    }
+    if (outq_finish(&q) < 0) reusable = 0;
+    return reusable;
+}
+
+static void refuse(int client_sock, const char *response) {
+    outq_send(client_sock, response, strlen(response));
+}
+
+static void serve(const struct request *req, void *arg) {
+    struct route *r = arg;
+    int client_sock = req->sock;
+    const char *method = req->methodName, *target = req->target, *headers = req->headers, *end = req->end;
+
+    char value[64], connection[256] = "";
+    long long length = 0;
+    get_header(headers, "Connection", connection, sizeof(connection));
+    if (get_header(headers, "Transfer-Encoding", value, sizeof(value))) {//a chunked upload would need decoding both ways
+        refuse(client_sock, "HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\n\r\n");
+        return;
+    }
+    if (get_header(headers, "Content-Length", value, sizeof(value))) {
+        char *e;
+        length = strtoll(value, &e, 10);
+        if (*e || length < 0 || e == value) {
+            refuse(client_sock, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+            return;
+        }
+    }
+    const char *body = router_body(req);
+    size_t have = end - body;
+    if ((long long)have > length) have = length;//pipelined bytes past the body are not ours to forward
+
+    char head[REQUEST_SIZE + 256];
+    int headLen = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\n", method, target);
+    int n = copy_headers(head + headLen, sizeof(head) - headLen - 128, headers, connection);
+    if (n < 0) {
+        refuse(client_sock, "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\n\r\n");
+        return;
+    }
+    headLen += n;
+    uint32_t peer = ratelimit_peer(client_sock);//none over a socketpair (HTTP/2 streams, relayed TLS)
+    if (peer) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer, ip, sizeof(ip));
+        headLen += snprintf(head + headLen, sizeof(head) - headLen, "X-Forwarded-For: %s\r\n", ip);
+    }
+    headLen += snprintf(head + headLen, sizeof(head) - headLen, "X-Forwarded-Proto: %s\r\nConnection: keep-alive\r\n\r\n",
+                        tls_enabled() ? "https" : "http");
+
+    if (have < (size_t)length && get_header(headers, "Expect", value, sizeof(value)) && strcasecmp(value, "100-continue") == 0) {
+        refuse(client_sock, "HTTP/1.1 100 Continue\r\n\r\n");//answered here, the backend never sees the Expect
+    }
+
+    char buf[BUFFER_SIZE];
+    size_t got = 0, respHead = 0;
+    struct backend *b = NULL;
+    int up = -1, rc = UP_FAILED;
+    for (int attempts = r->count + 1; attempts > 0; attempts--) {//every backend once, plus a pooled connection that went stale
+        if (!b && !(b = pick(r))) break;
+        int reused = (up = take_idle(b)) >= 0;
+        if (!reused && (up = connect_backend(b, PROXY_TIMEOUT_SECS)) < 0) {
+            note(b, 0);
+            done_with(b);
+            b = NULL;
+            continue;
+        }
+        set_limits(up, PROXY_TIMEOUT_SECS);
+
+        rc = send_request(up, client_sock, head, headLen, body, have, length);
+        got = 0;
+        if (rc == UP_OK) rc = read_head(up, buf, &got, &respHead);
+        while (rc == UP_OK && buf[9] == '1' && atoi(buf + 9) != 101) {//interim responses: our own 100 went out already
+            got -= respHead;
+            memmove(buf, buf + respHead, got);
+            rc = read_head(up, buf, &got, &respHead);
+        }
+        if (rc == UP_OK) break;
+
+        close(up);
+        up = -1;
+        if (rc == UP_STALE && reused && have == (size_t)length) continue;//closed while idle: the whole request is still in hand
+        if (rc == UP_STALE) rc = UP_FAILED;
+        break;
+    }
+
+    if (rc != UP_OK || atoi(buf + 9) == 101) {//we never asked to switch protocols
+        if (up >= 0) close(up);
+        if (b) {
+            if (rc != CLIENT_FAILED && rc != CLIENT_TIMEOUT) note(b, 0);
+            done_with(b);
+        }
+        if (rc == CLIENT_TIMEOUT) refuse(client_sock, "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        else if (rc == UP_TIMEOUT) refuse(client_sock, "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n");
+        else if (rc != CLIENT_FAILED) refuse(client_sock, "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n");
+        return;
+    }
+
+    buf[respHead - 1] = '\0';//get_header() stops at the blank line anyway
+    if (relay_response(up, client_sock, method, buf, got, respHead)) give_idle(b, up);
+    else close(up);
+    note(b, 1);
+    done_with(b);
+}
@@ -0,0 +1,38 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+// Reverse proxy: path prefixes forwarded to backend HTTP servers over pooled
+// keep-alive connections, balanced by least outstanding requests, with
+// backends ejected after repeated failures until a health check passes.
+
+#define PROXY_MAX_ROUTES 16
+#define PROXY_MAX_BACKENDS 8    // per route
+
+// Idle keep-alive connections kept per backend, and how long one may idle
+#define PROXY_IDLE 16
+#define PROXY_IDLE_SECS 30
+
+// Limit on connecting to, and on each read or write from, a backend
+#define PROXY_TIMEOUT_SECS 30
+
+// Seconds between health checks, and consecutive failures (checks or
+// requests) that take a backend out of rotation
+#define PROXY_CHECK_SECS 2
+#define PROXY_EJECT_FAILS 3
+
+// Longest response head a backend may send
+#define PROXY_HEAD_MAX 8192
+
+// Add a route from "/prefix=backend[,backend...]", each backend host:port
+// or unix:/path, and route every method under the prefix to it. Returns 0,
+// or -1 if the spec is malformed or unresolvable.
+int proxy_add(const char *spec);
+
+// Start health checks for this process; a no-op without routes
+void proxy_start(void);
+
+// 1 if the request in buff (NUL-terminated) goes to a backend. Engines use
+// it to move such requests, which wait on the network, off their fast paths.
+int proxy_wanted(const char *buff);
+
+#endif // PROXY_H
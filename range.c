@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "range.h"
+#include "outq.h"
+
+static int parse_offset(const char **p, off_t *out) {//digits only, no sign, no overflow
+    const char *s = *p;
+    off_t v = 0;
+
+    if (!isdigit((unsigned char)*s)) return -1;
+    while (isdigit((unsigned char)*s)) {
+        int d = *s - '0';
+        if (v > (((off_t)1 << 62) - d) / 10) return -1;
+        v = v * 10 + d;
+        s++;
+    }
+    *p = s;
+    *out = v;
+    return 0;
+}
+
+static int cmp_range(const void *a, const void *b) {
+    const struct byte_range *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+int parse_range(const char *spec, off_t size, struct byte_range *ranges, int max) {
+    struct byte_range found[MAX_RANGES * 4];//room for clients that split ranges we later merge
+    int count = 0;
+    int listed = 0;
+    const char *p = spec;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (strncasecmp(p, "bytes=", 6) != 0) return 0;//only byte ranges exist
+    p += 6;
+
+    while (*p) {
+        off_t start, end;
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') {//empty list elements are allowed
+            p++;
+            continue;
+        }
+
+        if (*p == '-') {//suffix range: last N bytes
+            p++;
+            if (parse_offset(&p, &end) < 0) return 0;
+            listed++;
+            if (end == 0 || size == 0) goto next;
+            start = end >= size ? 0 : size - end;
+            end = size - 1;
+        } else {
+            if (parse_offset(&p, &start) < 0 || *p != '-') return 0;
+            p++;
+            if (isdigit((unsigned char)*p)) {
+                if (parse_offset(&p, &end) < 0 || end < start) return 0;
+            } else {
+                end = size - 1;
+            }
+            listed++;
+            if (start >= size) goto next;//unsatisfiable on its own, others may still be fine
+            if (end >= size) end = size - 1;
+        }
+
+        if (count == (int)(sizeof(found) / sizeof(found[0]))) return 0;//abusive range list, serve the whole thing
+        found[count].start = start;
+        found[count].end = end;
+        count++;
+next:
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') p++;
+        else if (*p != '\0') return 0;
+    }
+
+    if (listed == 0) return 0;
+    if (count == 0) return -1;
+
+    qsort(found, count, sizeof(found[0]), cmp_range);//merge overlapping and adjacent ranges
+
+    int merged = 0;
+    for (int i = 1; i < count; i++) {
+        if (found[i].start <= found[merged].end + 1) {
+            if (found[i].end > found[merged].end) found[merged].end = found[i].end;
+        } else {
+            found[++merged] = found[i];
+        }
+    }
+    merged++;
+
+    if (merged > max) return 0;
+    memcpy(ranges, found, merged * sizeof(found[0]));
+    return merged;
+}
+
+int if_range_matches(const char *ifRange, const char *etag, time_t mtime) {
+    while (*ifRange == ' ' || *ifRange == '\t') ifRange++;
+
+    if (ifRange[0] == '"' || (ifRange[0] == 'W' && ifRange[1] == '/')) {//entity tag, strong comparison only
+        if (ifRange[0] == 'W') return 0;
+        size_t len = strlen(etag);
+        return strncmp(ifRange, etag, len) == 0 && (ifRange[len] == '\0' || isspace((unsigned char)ifRange[len]));
+    }
+
+    struct tm tm = {0};//otherwise it is an HTTP-date and must match exactly
+    if (!strptime(ifRange, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return 0;
+    return timegm(&tm) == mtime;
+}
+
+void make_etag(const struct stat *st, char *out, size_t len) {
+    snprintf(out, len, "\"%llx-%llx-%llx\"", (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_size, (unsigned long long)st->st_mtime);
+}
+
+void http_date(time_t t, char *out, size_t len) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+int send_file_range(int client_sock, int fd, off_t offset, off_t len) {
+    struct outq q;
+    outq_init(&q, client_sock);
+    outq_file(&q, fd, offset, len, NULL, NULL);
+    return outq_finish(&q);
+}
+
+void send_range_not_satisfiable(int client_sock, off_t size) {
+    char header[256];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                       "Content-Range: bytes */%lld\r\n"
+                       "Content-Length: 0\r\n\r\n", (long long)size);
+    outq_send(client_sock, header, len);
+}
+
+static int part_header(char *buf, size_t len, const char *boundary, const char *mime,
+                       const struct byte_range *r, off_t size) {
+    return snprintf(buf, len,
+                    "\r\n--%s\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    boundary, mime, (long long)r->start, (long long)r->end, (long long)size);
+}
+
+int send_ranges(int client_sock, int fd, off_t base, off_t size, const char *mime,
+                const char *etag, const char *lastMod, struct byte_range *ranges, int count) {
+    char header[1024];
+    int headLength;
+    struct outq q;
+    outq_init(&q, client_sock);
+
+    if (count == 1) {//single part: plain 206 straight from the file
+        off_t len = ranges[0].end - ranges[0].start + 1;
+        headLength = snprintf(header, sizeof(header),
+                              "HTTP/1.1 206 Partial Content\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %lld\r\n"
+                              "Content-Range: bytes %lld-%lld/%lld\r\n"
+                              "Accept-Ranges: bytes\r\n"
+                              "ETag: %s\r\n"
+                              "Last-Modified: %s\r\n\r\n",
+                              mime, (long long)len, (long long)ranges[0].start,
+                              (long long)ranges[0].end, (long long)size, etag, lastMod);
+        outq_copy(&q, header, headLength);
+        outq_file(&q, fd, base + ranges[0].start, len, NULL, NULL);
+        return outq_finish(&q);
+    }
+
+    char boundary[40];//boundary only has to be absent from the payload framing
+    static unsigned long long counter;
+    snprintf(boundary, sizeof(boundary), "BYTERANGE%016llx", (unsigned long long)time(NULL) ^ __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+
+    char part[512];
+    off_t total = 0;
+    for (int i = 0; i < count; i++) {//work out Content-Length before anything goes out
+        total += part_header(part, sizeof(part), boundary, mime, &ranges[i], size);
+        total += ranges[i].end - ranges[i].start + 1;
+    }
+    total += strlen(boundary) + 8;//"\r\n--" boundary "--\r\n"
+
+    headLength = snprintf(header, sizeof(header),
+                          "HTTP/1.1 206 Partial Content\r\n"
+                          "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                          "Content-Length: %lld\r\n"
+                          "Accept-Ranges: bytes\r\n"
+                          "ETag: %s\r\n"
+                          "Last-Modified: %s\r\n\r\n",
+                          boundary, (long long)total, etag, lastMod);
+    outq_copy(&q, header, headLength);
+
+    long page = sysconf(_SC_PAGESIZE);//map the span covering every part once
+    off_t mapStart = (base + ranges[0].start) & ~((off_t)page - 1);
+    size_t mapLen = (size_t)(base + ranges[count - 1].end + 1 - mapStart);
+    char *map = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, fd, mapStart);
+    if (map != MAP_FAILED) madvise(map, mapLen, MADV_SEQUENTIAL);
+
+    for (int i = 0; i < count; i++) {//parts and headers go out together, one sendmsg() per batch
+        off_t len = ranges[i].end - ranges[i].start + 1;
+        int partLength = part_header(part, sizeof(part), boundary, mime, &ranges[i], size);
+
+        outq_copy(&q, part, partLength);
+        if (map != MAP_FAILED) {
+            outq_mem(&q, map + (base + ranges[i].start - mapStart), len, NULL, NULL);
+        } else {
+            outq_file(&q, fd, base + ranges[i].start, len, NULL, NULL);
+        }
+    }
+
+    int tailLength = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+    outq_copy(&q, part, tailLength);
+    int rc = outq_finish(&q);//the map has to outlive the queue
+
+    if (map != MAP_FAILED) munmap(map, mapLen);
+    return rc;
+}
@@ -0,0 +1,44 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Most ranges we honour in one request; anything above is coalesced or refused
+#define MAX_RANGES 16
+
+// One satisfiable byte range, both ends inclusive
+struct byte_range {
+    off_t start;
+    off_t end;
+};
+
+// Parse a "bytes=..." Range value against a resource of the given size.
+// Returns the number of ranges stored, 0 if the header should be ignored
+// (malformed or unsupported unit) and -1 if no range is satisfiable.
+int parse_range(const char *spec, off_t size, struct byte_range *ranges, int max);
+
+// Check an If-Range value against the current validators. Returns 1 if the
+// range may be served, 0 if the full entity must be sent instead.
+int if_range_matches(const char *ifRange, const char *etag, time_t mtime);
+
+// Build a strong ETag from inode, size and mtime
+void make_etag(const struct stat *st, char *out, size_t len);
+
+// Format a time as an IMF-fixdate for Last-Modified / Date headers
+void http_date(time_t t, char *out, size_t len);
+
+// Send len bytes of fd starting at offset through an output queue.
+// Returns 0 on success, -1 on error.
+int send_file_range(int client_sock, int fd, off_t offset, off_t len);
+
+// Send a 206 (single range or multipart/byteranges) for the entity stored at
+// [base, base + size) of fd. Returns 0 on success, -1 on error.
+int send_ranges(int client_sock, int fd, off_t base, off_t size, const char *mime,
+                const char *etag, const char *lastMod, struct byte_range *ranges, int count);
+
+// Send a 416 with the required "Content-Range: bytes */size"
+void send_range_not_satisfiable(int client_sock, off_t size);
+
+#endif // RANGE_H
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "httpserve.h"
+#include "admit.h"
+#include "ratelimit.h"
+
+// Token buckets in one fixed, set-associative table shared by every thread.
+// A slot is two words: the key, and the bucket packed as
+//
+//   | 40 bits: last refill, ms of CLOCK_MONOTONIC_COARSE | 24 bits: millitokens |
+//
+// so taking a token is one compare-and-swap on the bucket word, and claiming
+// a slot for a new client is one on the key word. A client that loses a race
+// for a slot at worst starts from a full bucket; for a limiter that is fine.
+
+#define TIME_SHIFT 24
+#define TOKENS_MASK ((1ULL << TIME_SHIFT) - 1)
+#define MILLI 1000ULL
+
+struct slot {
+    uint64_t key;       // 0 when free
+    uint64_t bucket;
+};
+
+static struct slot table[RATELIMIT_SLOTS];
+
+static struct {
+    unsigned rate;      // tokens per second, 0 when off
+    unsigned burst;
+    unsigned long rejected;
+} limits[RATELIMIT_KINDS];
+
+static const char tooMany[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 22\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "429 Too Many Requests\n";
+
+void ratelimit_set(enum ratelimit_kind kind, unsigned rate, unsigned burst) {
+    if (burst == 0) burst = rate;
+    if (burst * MILLI > TOKENS_MASK) burst = TOKENS_MASK / MILLI;//what fits in the packed word
+    limits[kind].rate = rate;
+    limits[kind].burst = burst;
+}
+
+int ratelimit_enabled(enum ratelimit_kind kind) {
+    return limits[kind].rate > 0;
+}
+
+int ratelimit_parse(const char *spec, unsigned *rate, unsigned *burst) {
+    char *end;
+    long r = strtol(spec, &end, 10);
+    long b = 0;
+    if (end == spec || r < 0) return -1;
+    if (*end == '/') {
+        const char *p = end + 1;
+        b = strtol(p, &end, 10);
+        if (end == p || b <= 0) return -1;
+    }
+    if (*end != '\0') return -1;
+    *rate = r;
+    *burst = b;
+    return 0;
+}
+
+static uint64_t now_ms(void) {//coarse clock: a few ns, ms resolution is plenty for refills
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t mix(uint64_t x) {//splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t make_key(enum ratelimit_kind kind, uint32_t addr, const char *route) {
+    uint64_t h = ((uint64_t)kind << 32) | addr;
+    if (route) {
+        for (const unsigned char *p = (const unsigned char *)route; *p; p++) h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    h = mix(h);
+    return h ? h : 1;
+}
+
+static struct slot *find_slot(uint64_t key, uint64_t now, unsigned burst) {
+    struct slot *set = &table[key & (RATELIMIT_SLOTS - 1) & ~(uint64_t)(RATELIMIT_WAYS - 1)];
+    struct slot *oldest = &set[0];
+    uint64_t oldestTime = UINT64_MAX;
+
+    for (int i = 0; i < RATELIMIT_WAYS; i++) {
+        uint64_t k = __atomic_load_n(&set[i].key, __ATOMIC_ACQUIRE);
+        if (k == key) return &set[i];
+
+        uint64_t t = k ? __atomic_load_n(&set[i].bucket, __ATOMIC_RELAXED) >> TIME_SHIFT : 0;
+        if (t < oldestTime) {//free slots count as the oldest of all
+            oldestTime = t;
+            oldest = &set[i];
+        }
+    }
+
+    uint64_t seen = __atomic_load_n(&oldest->key, __ATOMIC_RELAXED);//approximate LRU: evict the longest idle
+    if (!__atomic_compare_exchange_n(&oldest->key, &seen, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (seen == key) return oldest;//someone else claimed it for the same client
+        return NULL;
+    }
+    __atomic_store_n(&oldest->bucket, (now << TIME_SHIFT) | (burst * MILLI), __ATOMIC_RELEASE);
+    return oldest;
+}
+
+int ratelimit_take(enum ratelimit_kind kind, uint32_t addr, const char *route) {
+    unsigned rate = limits[kind].rate;
+    if (rate == 0) return 0;
+
+    uint64_t now = now_ms();
+    uint64_t cap = limits[kind].burst * MILLI;
+    struct slot *s = find_slot(make_key(kind, addr, route), now, limits[kind].burst);
+    if (!s) return 0;//lost a race for the slot; let this one through rather than guess
+
+    uint64_t old = __atomic_load_n(&s->bucket, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t last = old >> TIME_SHIFT;
+        uint64_t tokens = old & TOKENS_MASK;
+        if (now > last) {//refill: rate tokens per second is rate millitokens per ms
+            tokens += (now - last) * rate;
+            if (tokens > cap) tokens = cap;
+            last = now;
+        }
+        if (tokens < MILLI) {
+            __atomic_fetch_add(&limits[kind].rejected, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        uint64_t next = (last << TIME_SHIFT) | (tokens - MILLI);
+        if (__atomic_compare_exchange_n(&s->bucket, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return 0;
+    }
+}
+
+uint32_t ratelimit_peer(int client_sock) {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(client_sock, (struct sockaddr *)&peer, &len) < 0 || peer.sin_family != AF_INET) return 0;
+    return peer.sin_addr.s_addr;
+}
+
+void ratelimit_refuse(int client_sock) {
+    admit_refuse(client_sock, tooMany, sizeof(tooMany) - 1);
+}
+
+void ratelimit_report(void) {
+    static unsigned long reported[RATELIMIT_KINDS];
+    static time_t next;
+    time_t now = time(NULL);
+    if (now < next) return;
+    next = now + RATELIMIT_REPORT_SECS;
+
+    unsigned long ip = __atomic_load_n(&limits[RATELIMIT_IP].rejected, __ATOMIC_RELAXED);
+    unsigned long cgi = __atomic_load_n(&limits[RATELIMIT_CGI].rejected, __ATOMIC_RELAXED);
+    if (ip == reported[RATELIMIT_IP] && cgi == reported[RATELIMIT_CGI]) return;
+    reported[RATELIMIT_IP] = ip;
+    reported[RATELIMIT_CGI] = cgi;
+
+    char lgbuff[96];
+    snprintf(lgbuff, sizeof(lgbuff), "rate limited so far: %lu connections, %lu CGI runs", ip, cgi);
+    logMsg(lgbuff);
+}
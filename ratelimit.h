@@ -0,0 +1,44 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// Buckets in the table (power of two) and slots probed per lookup. The
+// table never grows: a new client takes over the least recently used slot
+// of its set.
+#define RATELIMIT_SLOTS 65536
+#define RATELIMIT_WAYS 4
+
+// Seconds between rejection counts in the log, when there were any
+#define RATELIMIT_REPORT_SECS 10
+
+enum ratelimit_kind {
+    RATELIMIT_IP,       // every connection from an address, checked at accept
+    RATELIMIT_CGI,      // CGI runs per address and script, checked before fork
+    RATELIMIT_KINDS
+};
+
+// Allow `rate` requests per second with bursts of up to `burst` for a kind.
+// A rate of 0 (the default) turns the limit off.
+void ratelimit_set(enum ratelimit_kind kind, unsigned rate, unsigned burst);
+
+// Parse "rate[/burst]" as given on the command line; -1 if malformed
+int ratelimit_parse(const char *spec, unsigned *rate, unsigned *burst);
+
+// Whether a kind has a limit set, so callers can skip finding the peer address
+int ratelimit_enabled(enum ratelimit_kind kind);
+
+// Take one token for addr (IPv4, network order) and route (NULL for
+// RATELIMIT_IP). Returns 0 when allowed, -1 when the bucket is empty.
+int ratelimit_take(enum ratelimit_kind kind, uint32_t addr, const char *route);
+
+// Address of the peer of a connected socket, 0 if it cannot be had
+uint32_t ratelimit_peer(int client_sock);
+
+// Answer with the pre-rendered 429 and close
+void ratelimit_refuse(int client_sock);
+
+// Log rejection counts if any came in since the last report
+void ratelimit_report(void);
+
+#endif // RATELIMIT_H
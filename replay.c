@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "accesslog.h"
+
+// Plays an httpserve --access-log back against a server: every request at
+// its original offset from the first one (or speed times faster), each on a
+// connection of its own. Status and body length must match what the log
+// says was sent; latency is compared request by request. Exits 1 on any
+// mismatch or failed request, so a build can be gated on it.
+// Build: gcc -o replay replay.c -pthread
+// Usage: replay [--speed n] [--connections n] host:port log
+
+#define DEFAULT_CONNECTIONS 64
+#define REPORT_MISMATCHES 10        // printed one by one, the rest only counted
+
+struct result {
+    const struct accesslog_record *rec;
+    int status;                     // 0 when the request failed
+    uint64_t body;
+    uint64_t latency;               // ns, connect to the last byte
+    uint64_t lag;                   // ns the request went out behind schedule
+};
+
+static struct {
+    const struct accesslog_record **recs;
+    struct result *results;
+    size_t count;
+    size_t next;
+    double speed;                   // 0: no pacing, as fast as the connections go
+    uint64_t origin;                // CLOCK_MONOTONIC ns the replay started
+    struct addrinfo *addr;
+    const char *host;
+} R;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int by_start(const void *a, const void *b) {
+    const struct accesslog_record *x = *(const struct accesslog_record *const *)a;
+    const struct accesslog_record *y = *(const struct accesslog_record *const *)b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static char *load(const char *file, size_t *size) {
+    FILE *f = fopen(file, "rb");
+    if (!f) return NULL;
+    char *data = NULL;
+    size_t len = 0, cap = 0;
+    for (;;) {
+        if (len == cap) {
+            cap = cap ? cap * 2 : 1 << 20;
+            char *grown = realloc(data, cap);
+            if (!grown) {
+                free(data);
+                fclose(f);
+                errno = ENOMEM;
+                return NULL;
+            }
+            data = grown;
+        }
+        size_t n = fread(data + len, 1, cap - len, f);
+        if (n == 0) break;
+        len += n;
+    }
+    int err = ferror(f);
+    fclose(f);
+    if (err) {
+        free(data);
+        errno = EIO;
+        return NULL;
+    }
+    *size = len;
+    return data;
+}
+
+static int index_records(char *data, size_t size) {//-1 if it is not a log this build can read
+    uint32_t recSize;
+    if (size < 12 || memcmp(data, ACCESSLOG_MAGIC, 8) != 0) return -1;
+    memcpy(&recSize, data + 8, sizeof(recSize));
+    if (recSize != sizeof(struct accesslog_record)) return -1;
+
+    size_t cap = 0;
+    for (size_t at = 12; at + sizeof(struct accesslog_record) <= size;) {
+        const struct accesslog_record *r = (const void *)(data + at);
+        if (r->size < sizeof(*r) || r->size > size - at || sizeof(*r) + r->pathLen + r->headersLen > r->size) {
+            fprintf(stderr, "corrupt record at offset %zu, stopping there\n", at);
+            break;
+        }
+        if (R.count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            R.recs = realloc(R.recs, cap * sizeof(*R.recs));
+            if (!R.recs) return -1;
+        }
+        R.recs[R.count++] = r;
+        at += r->size;
+    }
+    qsort(R.recs, R.count, sizeof(*R.recs), by_start);//buffers of different threads reach the file out of order
+    return 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_request(int fd, const struct accesslog_record *r) {
+    const char *path = (const char *)(r + 1);
+    const char *headers = path + r->pathLen;
+    size_t cap = r->pathLen + r->headersLen + strlen(R.host) + 128;
+    char *head = malloc(cap);
+    if (!head) return -1;
+
+    int len = snprintf(head, cap, "%.*s %.*s HTTP/1.1\r\nHost: %s\r\n%.*s", (int)sizeof(r->method), r->method,
+                       (int)r->pathLen, path, R.host, (int)r->headersLen, headers);
+    if (r->requestBody || strcmp(r->method, "POST") == 0 || strcmp(r->method, "PUT") == 0) {
+        len += snprintf(head + len, cap - len, "Content-Length: %llu\r\n", (unsigned long long)r->requestBody);
+    }
+    len += snprintf(head + len, cap - len, "Connection: close\r\n\r\n");
+    int rc = send_all(fd, head, len);
+    free(head);
+
+    static const char filler[64 * 1024];//only the size was logged, not the bytes
+    for (uint64_t left = r->requestBody; rc == 0 && left > 0;) {
+        size_t n = left < sizeof(filler) ? left : sizeof(filler);
+        rc = send_all(fd, filler, n);
+        left -= n;
+    }
+    return rc;
+}
+
+static void read_response(int fd, struct result *res) {//status and body length, status 0 if it never came
+    char buf[64 * 1024], line[12];
+    int lineLen = 0, blank = 0;
+    uint64_t body = 0;
+
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (ssize_t i = 0; i < n; i++) {
+            if (blank == 4) {
+                body += n - i;
+                break;
+            }
+            if (lineLen < (int)sizeof(line)) line[lineLen++] = buf[i];
+            blank = buf[i] == "\r\n\r\n"[blank] ? blank + 1 : buf[i] == '\r';
+        }
+    }
+    if (blank == 4 && lineLen == sizeof(line) && memcmp(line, "HTTP/1.", 7) == 0) {
+        res->status = atoi(line + 9);
+        res->body = body;
+    }
+}
+
+static void replay_one(struct result *res) {
+    const struct accesslog_record *r = res->rec;
+    if (R.speed > 0) {//on the log's clock, scaled
+        uint64_t due = R.origin + (uint64_t)((r->start - R.recs[0]->start) / R.speed);
+        struct timespec ts = {due / 1000000000, due % 1000000000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+        uint64_t now = now_ns();
+        res->lag = now > due ? now - due : 0;
+    }
+
+    uint64_t begin = now_ns();
+    int fd = socket(R.addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, R.addr->ai_addr, R.addr->ai_addrlen) == 0 && send_request(fd, r) == 0) {
+        shutdown(fd, SHUT_WR);
+        read_response(fd, res);
+    }
+    close(fd);
+    res->latency = now_ns() - begin;
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&R.next, 1, __ATOMIC_RELAXED);//in start order, so a late worker only delays its own request
+        if (i >= R.count) return NULL;
+        replay_one(&R.results[i]);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void percentiles(const char *what, uint64_t *v, size_t n) {//v is sorted in place, ns printed as ms
+    if (n == 0) return;
+    qsort(v, n, sizeof(*v), cmp_u64);
+    printf("%-10s p50 %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f ms\n", what, v[n / 2] / 1e6, v[n * 9 / 10] / 1e6,
+           v[n * 99 / 100] / 1e6, v[n - 1] / 1e6);
+}
+
+static int report(void) {
+    size_t failed = 0, statusDiff = 0, lengthDiff = 0, checked = 0, shown = 0;
+    uint64_t *recorded = malloc(R.count * sizeof(uint64_t));
+    uint64_t *replayed = malloc(R.count * sizeof(uint64_t));
+    uint64_t *lag = malloc(R.count * sizeof(uint64_t));
+    int64_t *delta = malloc(R.count * sizeof(int64_t));
+    if (!recorded || !replayed || !lag || !delta) {
+        perror("malloc");
+        return 1;
+    }
+
+    size_t ok = 0;
+    for (size_t i = 0; i < R.count; i++) {
+        struct result *res = &R.results[i];
+        const struct accesslog_record *r = res->rec;
+        lag[i] = res->lag;
+        if (res->status == 0) {
+            failed++;
+            continue;
+        }
+        recorded[ok] = r->duration;
+        replayed[ok] = res->latency;
+        delta[ok] = (int64_t)res->latency - (int64_t)r->duration;
+        ok++;
+
+        if (r->status == 0) continue;//the log never saw that response
+        checked++;
+        int badStatus = res->status != r->status, badLength = !badStatus && res->body != r->responseBody;
+        statusDiff += badStatus;
+        lengthDiff += badLength;
+        if ((badStatus || badLength) && shown++ < REPORT_MISMATCHES) {
+            printf("mismatch: %.*s %.*s: status %u -> %d, body %llu -> %llu\n", (int)sizeof(r->method), r->method,
+                   (int)r->pathLen, (const char *)(r + 1), r->status, res->status,
+                   (unsigned long long)r->responseBody, (unsigned long long)res->body);
+        }
+    }
+
+    printf("%zu requests, %zu failed, %zu checked: %zu status and %zu length mismatches\n", R.count, failed, checked,
+           statusDiff, lengthDiff);
+    percentiles("recorded", recorded, ok);
+    percentiles("replayed", replayed, ok);
+    if (ok > 0) {//per request, so a shift in the mix does not hide behind the totals
+        qsort(delta, ok, sizeof(*delta), cmp_i64);
+        printf("%-10s p50 %+9.3f  p90 %+9.3f  p99 %+9.3f  max %+9.3f ms\n", "delta", delta[ok / 2] / 1e6,
+               delta[ok * 9 / 10] / 1e6, delta[ok * 99 / 100] / 1e6, delta[ok - 1] / 1e6);
+    }
+    if (R.speed > 0) percentiles("send lag", lag, R.count);//large: too few connections to hold the pacing
+
+    free(recorded);
+    free(replayed);
+    free(lag);
+    free(delta);
+    return failed || statusDiff || lengthDiff;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = DEFAULT_CONNECTIONS;
+    const char *target = NULL, *file = NULL;
+    R.speed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {//0 for no pacing at all
+            R.speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {//requests in flight at most
+            connections = atoi(argv[++i]);
+        } else if (!target) {
+            target = argv[i];
+        } else if (!file) {
+            file = argv[i];
+        } else {
+            target = NULL;
+            break;
+        }
+    }
+    char *colon = target ? strrchr(target, ':') : NULL;
+    if (!file || !colon || R.speed < 0 || connections <= 0) {
+        fprintf(stderr, "Usage: %s [--speed n] [--connections n] host:port log\n", argv[0]);
+        return 2;
+    }
+
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - target), target);
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int err = getaddrinfo(host, colon + 1, &hints, &R.addr);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", target, gai_strerror(err));
+        return 2;
+    }
+    R.host = target;
+
+    size_t size;
+    char *data = load(file, &size);
+    if (!data) {
+        perror(file);
+        return 2;
+    }
+    if (index_records(data, size) < 0) {
+        fprintf(stderr, "%s: not an access log of this build\n", file);
+        return 2;
+    }
+    if (R.count == 0) {
+        fprintf(stderr, "%s: no requests\n", file);
+        return 2;
+    }
+    R.results = calloc(R.count, sizeof(*R.results));
+    pthread_t *threads = calloc(connections, sizeof(*threads));
+    if (!R.results || !threads) {
+        perror("calloc");
+        return 2;
+    }
+    for (size_t i = 0; i < R.count; i++) R.results[i].rec = R.recs[i];
+
+    R.origin = now_ns();
+    int started = 0;
+    for (; started < connections && (size_t)started < R.count; started++) {
+        if ((err = pthread_create(&threads[started], NULL, worker_main, NULL)) != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    if (started == 0) return 2;
+
+    double seconds = (now_ns() - R.origin) / 1e9;
+    double span = (R.recs[R.count - 1]->start - R.recs[0]->start) / 1e9;
+    printf("replayed %.3f s of traffic in %.3f s\n", span, seconds);
+    return report();
+}
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+#include "urlpath.h"
+#include "router.h"
+
+struct target {
+    router_handler handler;
+    void *arg;
+};
+
+struct node {
+    char *label;                        // edge from the parent, compressed
+    size_t labelLen;
+    struct node **children;             // distinct first bytes, so one compare picks the edge
+    int childCount;
+    struct target exact[ROUTER_METHODS];
+    struct target below[ROUTER_METHODS];// "/prefix/*" routes ending here
+};
+
+static struct node pathRoot = {"", 0, NULL, 0, {{0}}, {{0}}};
+static struct node extRoot = {"", 0, NULL, 0, {{0}}, {{0}}};//"*.ext" routes keyed by ".ext"
+
+static const char *const methodNames[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH"};
+
+int router_method(const char *name) {
+    for (int i = 0; i < ROUTER_OTHER; i++) {
+        if (strcmp(name, methodNames[i]) == 0) return i;
+    }
+    return ROUTER_OTHER;
+}
+
+static struct node *new_node(const char *label, size_t len) {
+    struct node *n = calloc(1, sizeof(*n));
+    if (!n || !(n->label = malloc(len + 1))) {
+        free(n);
+        return NULL;
+    }
+    memcpy(n->label, label, len);
+    n->label[len] = '\0';
+    n->labelLen = len;
+    return n;
+}
+
+static int add_child(struct node *parent, struct node *child) {
+    struct node **grown = realloc(parent->children, (parent->childCount + 1) * sizeof(*grown));
+    if (!grown) return -1;
+    parent->children = grown;
+    parent->children[parent->childCount++] = child;
+    return 0;
+}
+
+static struct node *child_for(const struct node *n, char c) {
+    for (int i = 0; i < n->childCount; i++) {//at most one per byte value
+        if (n->children[i]->label[0] == c) return n->children[i];
+    }
+    return NULL;
+}
+
+static struct node *insert(struct node *n, const char *key, size_t len) {//node for key, split or created as needed
+    while (len > 0) {
+        struct node *c = child_for(n, *key);
+        if (!c) {
+            struct node *leaf = new_node(key, len);
+            if (!leaf || add_child(n, leaf) < 0) {
+                if (leaf) free(leaf->label);
+                free(leaf);
+                return NULL;
+            }
+            return leaf;
+        }
+
+        size_t common = 0;
+        while (common < c->labelLen && common < len && c->label[common] == key[common]) common++;
+        if (common < c->labelLen) {//key leaves the edge part way: split it, c keeps the tail
+            struct node *head = new_node(c->label, common);
+            if (!head || add_child(head, c) < 0) {
+                if (head) free(head->label);
+                free(head);
+                return NULL;
+            }
+            for (int i = 0; i < n->childCount; i++) {
+                if (n->children[i] == c) n->children[i] = head;
+            }
+            memmove(c->label, c->label + common, c->labelLen - common + 1);
+            c->labelLen -= common;
+            c = head;
+        }
+        n = c;
+        key += common;
+        len -= common;
+    }
+    return n;
+}
+
+static void set(struct target *targets, int method, router_handler handler, void *arg) {
+    for (int m = 0; m < ROUTER_METHODS; m++) {
+        if (method == ROUTER_ANY || method == m) targets[m] = (struct target){handler, arg};
+    }
+}
+
+int router_add(int method, const char *pattern, router_handler handler, void *arg) {
+    size_t len = strlen(pattern);
+    if (!handler || method < ROUTER_ANY || method >= ROUTER_METHODS) return -1;
+
+    if (pattern[0] == '*' && pattern[1] == '.' && len > 2 && !strchr(pattern + 1, '/')) {
+        struct node *n = insert(&extRoot, pattern + 1, len - 1);
+        if (!n) return -1;
+        set(n->exact, method, handler, arg);
+        return 0;
+    }
+    if (pattern[0] != '/') return -1;
+
+    int below = len >= 2 && pattern[len - 1] == '*' && pattern[len - 2] == '/';
+    struct node *n = insert(&pathRoot, pattern, below ? len - 1 : len);//"/api/*" ends at the node for "/api/"
+    if (!n) return -1;
+    set(below ? n->below : n->exact, method, handler, arg);
+    return 0;
+}
+
+static const struct target *lookup_ext(int method, const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(slash ? slash : path, '.');
+    if (!dot || extRoot.childCount == 0) return NULL;
+
+    const struct node *n = &extRoot;
+    while (*dot) {
+        n = child_for(n, *dot);
+        if (!n || strncmp(dot, n->label, n->labelLen) != 0) return NULL;
+        dot += n->labelLen;
+    }
+    return n->exact[method].handler ? &n->exact[method] : NULL;
+}
+
+router_handler router_match(int method, const char *path, void **arg) {
+    if (method < 0 || method >= ROUTER_METHODS) return NULL;
+
+    const struct target *best = NULL, *all = NULL;
+    const struct node *n = &pathRoot;
+    const char *p = path;
+    for (;;) {
+        if (n->below[method].handler) {
+            if (p - path > 1) best = &n->below[method];//deepest prefix so far
+            else all = &n->below[method];//"/*" only catches what nothing else takes
+        }
+        if (!*p) {
+            if (n->exact[method].handler) best = &n->exact[method];
+            break;
+        }
+        n = child_for(n, *p);
+        if (!n || strncmp(p, n->label, n->labelLen) != 0) break;
+        p += n->labelLen;
+    }
+
+    if (!best) best = lookup_ext(method, path);
+    if (!best) best = all;
+    if (!best) return NULL;
+    if (arg) *arg = best->arg;
+    return best->handler;
+}
+
+router_handler router_peek(const char *buff) {
+    const char *target = strchr(buff, ' ');
+    if (!target || target - buff >= 16) return NULL;
+    char method[16];
+    memcpy(method, buff, target - buff);
+    method[target - buff] = '\0';
+    target++;
+
+    char raw[URLPATH_MAX], canon[URLPATH_MAX];
+    size_t len = strcspn(target, " \r\n");
+    if (len >= sizeof(raw)) return NULL;
+    memcpy(raw, target, len);
+    raw[len] = '\0';
+    const char *query;
+    int flags;
+    if (normalize_target(raw, canon, sizeof(canon), &query, &flags) < 0) return NULL;
+    return router_match(router_method(method), canon, NULL);
+}
+
+const char *router_body(const struct request *req) {//just past the blank line, or end
+    const char *headers = req->headers, *end = req->end;
+    for (const char *p = headers; p < end; p++) {
+        if (*p != '\n') continue;
+        if (p + 1 < end && p[1] == '\n') return p + 2;
+        if (p + 2 < end && p[1] == '\r' && p[2] == '\n') return p + 3;
+    }
+    if (headers < end && (*headers == '\n' || (*headers == '\r' && headers + 1 < end && headers[1] == '\n'))) {//no headers at all
+        return headers + (*headers == '\r' ? 2 : 1);
+    }
+    return end;
+}
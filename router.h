@@ -0,0 +1,53 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+// Request router: a compressed radix tree from method and path to handlers.
+// Patterns are "/exact", "/prefix/*" (everything below) or "*.ext" (any path
+// ending in it). An exact route wins, then the longest prefix, then an
+// extension, then the catch-all "/*". Matching walks the path once, however
+// many routes there are. Routes are added at startup, before any request.
+
+enum router_method {
+    ROUTER_GET, ROUTER_HEAD, ROUTER_POST, ROUTER_PUT, ROUTER_DELETE, ROUTER_OPTIONS, ROUTER_PATCH,
+    ROUTER_OTHER,           // any other token, only ROUTER_ANY routes take it
+    ROUTER_METHODS
+};
+
+// Method argument of router_add() that registers every method
+#define ROUTER_ANY -1
+
+// A parsed request as handlers see it. sock is closed by the dispatcher.
+struct request {
+    int sock;
+    int method;             // enum router_method
+    const char *methodName; // as sent
+    const char *target;     // raw request target, query included
+    const char *path;       // decoded and normalized
+    const char *query;      // after '?', NULL if none
+    const char *headers;    // header block, CRLF lines
+    const char *end;        // end of what has been read, body bytes may precede it
+};
+
+typedef void (*router_handler)(const struct request *req, void *arg);
+
+// enum router_method for a method token
+int router_method(const char *name);
+
+// Route method (or ROUTER_ANY) requests matching pattern to handler(req, arg).
+// A later route for the same method and pattern replaces an earlier one.
+// Returns 0, or -1 if the pattern is malformed or memory ran out.
+int router_add(int method, const char *pattern, router_handler handler, void *arg);
+
+// Handler for a request, with its arg in *arg if arg is not NULL; NULL if no
+// route matches
+router_handler router_match(int method, const char *path, void **arg);
+
+// Handler the raw request in buff (NUL-terminated) will go to, NULL if none
+// or if the request line does not parse. Engines use it to decide where a
+// request should run before it is dispatched.
+router_handler router_peek(const char *buff);
+
+// Start of the body bytes read along with the head, req->end if none were
+const char *router_body(const struct request *req);
+
+#endif // ROUTER_H
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "httpserve.h"
+#include "outq.h"
+#include "router.h"
+#include "template.h"
+#include "session.h"
+
+struct session {
+    char id[SESSION_ID_LENGTH + 1];
+    char userData[32];
+};
+
+static struct session sessions[SESSION_MAX];//ring, the next slot is the oldest
+static unsigned created;
+static pthread_mutex_t sessionLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const pageSlots[] = {"session", "user", NULL};//values are passed in this order
+static const char pageDefault[] = "<h1>Welcome to the WEB site!</h1><p>Your session ID: {{session}}</p>";
+static struct template *page;//compiled once, swapped when the file changes
+
+static void generate_id(char *id) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    unsigned char random[SESSION_ID_LENGTH];
+    if (getrandom(random, sizeof(random), 0) != sizeof(random)) {//ids are guessable otherwise
+        for (int i = 0; i < SESSION_ID_LENGTH; i++) random[i] = rand();
+    }
+    for (int i = 0; i < SESSION_ID_LENGTH; i++) id[i] = chars[random[i] % (sizeof(chars) - 1)];
+    id[SESSION_ID_LENGTH] = '\0';
+}
+
+static int cookie_id(const char *headers, char *id) {//1 if the request carries a well-formed sessionId cookie
+    char cookies[1024];
+    if (!get_header(headers, "Cookie", cookies, sizeof(cookies))) return 0;
+    for (char *saveptr, *c = strtok_r(cookies, ";", &saveptr); c; c = strtok_r(NULL, ";", &saveptr)) {
+        while (*c == ' ') c++;
+        if (strncmp(c, "sessionId=", 10) != 0 || strlen(c + 10) != SESSION_ID_LENGTH) continue;
+        memcpy(id, c + 10, SESSION_ID_LENGTH + 1);
+        return 1;
+    }
+    return 0;
+}
+
+static void find_or_create(const char *headers, struct session *out) {//copies the session, the ring may reuse its slot
+    char id[SESSION_ID_LENGTH + 1];
+    int known = cookie_id(headers, id);
+
+    pthread_mutex_lock(&sessionLock);
+    for (int i = 0; known && i < SESSION_MAX; i++) {
+        if (strcmp(sessions[i].id, id) == 0) {
+            *out = sessions[i];
+            pthread_mutex_unlock(&sessionLock);
+            return;
+        }
+    }
+    struct session *s = &sessions[created % SESSION_MAX];
+    generate_id(s->id);
+    created++;
+    snprintf(s->userData, sizeof(s->userData), "User%u", created);
+    *out = *s;
+    pthread_mutex_unlock(&sessionLock);
+}
+
+static void serve_page(const struct request *req, void *arg) {
+    (void)arg;
+    struct session session;
+    find_or_create(req->headers, &session);
+
+    struct template *t = template_acquire(&page);
+    const char *values[] = {session.id, session.userData};
+    struct template_output body;
+    if (template_render(t, values, &body) < 0) {
+        template_release(t);
+        const char *response = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        outq_send(req->sock, response, strlen(response));
+        return;
+    }
+
+    char head[512];
+    int headLen = snprintf(head, sizeof(head),
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/html\r\n"
+                           "Content-Length: %zu\r\n"
+                           "Cache-Control: private, no-store\r\n"
+                           "Set-Cookie: sessionId=%s; Path=/; HttpOnly\r\n"
+                           "\r\n",
+                           body.len, session.id);
+
+    struct outq q;//head and page leave together, literals straight from the template
+    outq_init(&q, req->sock);
+    outq_copy(&q, head, headLen);
+    for (int i = 0; req->method != ROUTER_HEAD && i < body.iovCount; i++) {
+        outq_mem(&q, body.iov[i].iov_base, body.iov[i].iov_len, NULL, NULL);
+    }
+    outq_finish(&q);
+    template_release(t);
+}
+
+int session_mount(const char *path) {
+    if (!page) page = template_load(SESSION_TEMPLATE, pageSlots);
+    if (!page) page = template_compile(pageDefault, strlen(pageDefault), pageSlots);//no page of our own
+    if (!page) return -1;
+    if (router_add(ROUTER_GET, path, serve_page, NULL) < 0 || router_add(ROUTER_HEAD, path, serve_page, NULL) < 0) return -1;
+    return 0;
+}
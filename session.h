@@ -0,0 +1,20 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "docroot.h"
+
+// Session welcome page: a visitor without a known sessionId cookie is given
+// a new session, and every visit renders the page template with its id.
+
+// Sessions remembered; past that the oldest is forgotten
+#define SESSION_MAX 1024
+#define SESSION_ID_LENGTH 16
+
+// Page template, slots {{session}} and {{user}}; a built-in page without it
+#define SESSION_TEMPLATE DOCROOT_DIR "/welcome.tpl"
+
+// Serve the page for GET and HEAD at path. Returns 0, or -1 if the route
+// or the template could not be set up.
+int session_mount(const char *path);
+
+#endif // SESSION_H
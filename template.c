@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "template.h"
+
+static pthread_mutex_t reloadLock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static int find_slot(const char *const slots[], const char *name, size_t len) {
+    for (int i = 0; slots[i]; i++) {
+        if (strlen(slots[i]) == len && memcmp(slots[i], name, len) == 0) return i;
+    }
+    return -1;
+}
+
+static int compile_error(const char *where, const char *what, const char *text, const char *at) {
+    int line = 1;
+    for (const char *p = text; p < at; p++) line += *p == '\n';
+    fprintf(stderr, "template %s:%d: %s\n", where ? where : "(string)", line, what);
+    return -1;
+}
+
+static int parse(struct template *t) {//splits t->text into segments, -1 if it does not compile
+    const char *p = t->text, *end = t->text + strlen(t->text);
+    struct template_segment seg[TEMPLATE_MAX_SEGMENTS];
+    int n = 0;
+
+    while (p < end) {
+        const char *open = strstr(p, "{{");
+        const char *literalEnd = open ? open : end;
+        if (literalEnd > p) {
+            if (n == TEMPLATE_MAX_SEGMENTS) return compile_error(t->path, "too many segments", t->text, p);
+            seg[n++] = (struct template_segment){p, literalEnd - p, -1, 0};
+        }
+        if (!open) break;
+
+        int raw = open[2] == '{';//{{{name}}}
+        const char *name = open + 2 + raw;
+        const char *close = strstr(name, raw ? "}}}" : "}}");
+        if (!close) return compile_error(t->path, "unterminated {{", t->text, open);
+        const char *nameEnd = close;
+        while (name < nameEnd && (*name == ' ' || *name == '\t')) name++;
+        while (nameEnd > name && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) nameEnd--;
+
+        int slot = find_slot(t->slots, name, nameEnd - name);
+        if (slot < 0) return compile_error(t->path, "unknown slot", t->text, open);
+        if (n == TEMPLATE_MAX_SEGMENTS) return compile_error(t->path, "too many segments", t->text, open);
+        seg[n++] = (struct template_segment){NULL, 0, slot, raw};
+        p = close + 2 + raw;
+    }
+
+    if (!(t->segments = malloc((n ? n : 1) * sizeof(*seg)))) return -1;
+    memcpy(t->segments, seg, n * sizeof(*seg));
+    t->segmentCount = n;
+    return 0;
+}
+
+static void destroy(struct template *t) {
+    free(t->segments);
+    free(t->text);
+    free(t);
+}
+
+static struct template *build(char *text, const char *path, const char *const slots[]) {//takes text
+    struct template *t = calloc(1, sizeof(*t));
+    if (!t) {
+        free(text);
+        return NULL;
+    }
+    t->text = text;
+    t->path = path;
+    t->slots = slots;
+    t->refs = 1;
+    if (parse(t) < 0) {
+        destroy(t);
+        return NULL;
+    }
+    return t;
+}
+
+struct template *template_compile(const char *text, size_t len, const char *const slots[]) {
+    char *copy = strndup(text, len);
+    return copy ? build(copy, NULL, slots) : NULL;
+}
+
+struct template *template_load(const char *path, const char *const slots[]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    char *text = malloc(st.st_size + 1);
+    ssize_t got = 0;
+    while (text && got < st.st_size) {
+        ssize_t n = pread(fd, text + got, st.st_size - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    if (!text || got != st.st_size) {
+        free(text);
+        return NULL;
+    }
+    text[got] = '\0';
+
+    struct template *t = build(text, path, slots);
+    if (t) {
+        t->st = st;
+        t->checked = now_secs();
+    }
+    return t;
+}
+
+struct template *template_acquire(struct template **current) {
+    time_t now = now_secs();
+    pthread_mutex_lock(&reloadLock);
+    struct template *t = *current;
+    if (t->path && now - t->checked >= TEMPLATE_RECHECK_SECS) {//the one syscall a second
+        struct stat st;
+        t->checked = now;
+        if (stat(t->path, &st) == 0 && !same_file(&st, &t->st)) {
+            struct template *fresh = template_load(t->path, t->slots);
+            if (fresh) {//requests still rendering the old one keep it until they are done
+                *current = fresh;
+                template_release(t);
+                t = fresh;
+            } else {
+                t->st = st;//not again until it changes once more
+            }
+        }
+    }
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&reloadLock);
+    return t;
+}
+
+void template_release(struct template *t) {
+    if (t && __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0) destroy(t);
+}
+
+static const char *escape_of(char c) {
+    switch (c) {
+    case '&': return "&amp;";
+    case '<': return "&lt;";
+    case '>': return "&gt;";
+    case '"': return "&quot;";
+    case '\'': return "&#39;";
+    default: return NULL;
+    }
+}
+
+int template_render(const struct template *t, const char *const values[], struct template_output *out) {
+    out->iovCount = 0;
+    out->len = 0;
+    out->scratchUsed = 0;
+
+    for (int i = 0; i < t->segmentCount; i++) {
+        const struct template_segment *seg = &t->segments[i];
+        const char *data = seg->text;
+        size_t len = seg->len;
+
+        if (!data) {
+            data = values[seg->slot] ? values[seg->slot] : "";
+            len = strlen(data);
+            if (!seg->raw && strpbrk(data, "&<>\"'")) {//only values that need it are copied
+                char *dst = out->scratch + out->scratchUsed;
+                size_t room = TEMPLATE_SCRATCH - out->scratchUsed, used = 0;
+                for (size_t j = 0; j < len; j++) {
+                    const char *entity = escape_of(data[j]);
+                    size_t n = entity ? strlen(entity) : 1;
+                    if (used + n > room) return -1;
+                    memcpy(dst + used, entity ? entity : &data[j], n);
+                    used += n;
+                }
+                out->scratchUsed += used;
+                data = dst;
+                len = used;
+            }
+            if (len == 0) continue;
+        }
+
+        out->iov[out->iovCount++] = (struct iovec){(void *)data, len};
+        out->len += len;
+    }
+    return 0;
+}
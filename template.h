@@ -0,0 +1,69 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// HTML templates compiled once into literal segments and slot references.
+// {{name}} inserts a value HTML-escaped, {{{name}}} inserts it as is. Slot
+// names are fixed by the caller at compile time, so rendering never looks a
+// name up and never copies a literal.
+
+// Segments one template may compile to, and so iovecs one render may produce
+#define TEMPLATE_MAX_SEGMENTS 256
+
+// Room for the escaped copies of values one render may need
+#define TEMPLATE_SCRATCH 4096
+
+// Seconds a loaded template is trusted before its file is checked again
+#define TEMPLATE_RECHECK_SECS 1
+
+struct template_segment {
+    const char *text;       // literal bytes, NULL for a slot
+    size_t len;
+    int slot;               // index into the slot names
+    int raw;                // inserted without escaping
+};
+
+struct template {
+    char *text;             // source; literals point into it
+    struct template_segment *segments;
+    int segmentCount;
+    const char *path;       // file it was loaded from, NULL for a string
+    const char *const *slots;
+    struct stat st;         // of that file when it was compiled
+    time_t checked;         // last look at the file, monotonic seconds
+    int refs;
+};
+
+// One rendered page: iov[0..iovCount) holds len bytes, pointing into the
+// template, into scratch and into the values (unescaped values are not
+// copied), so all three must stay alive until it has been sent.
+struct template_output {
+    struct iovec iov[TEMPLATE_MAX_SEGMENTS];
+    int iovCount;
+    size_t len;
+    size_t scratchUsed;
+    char scratch[TEMPLATE_SCRATCH];
+};
+
+// Compile text, or the file at path, against the NULL-terminated slot names
+// (which must outlive the template). Returns a template holding one
+// reference, or NULL after printing why it does not compile.
+struct template *template_compile(const char *text, size_t len, const char *const slots[]);
+struct template *template_load(const char *path, const char *const slots[]);
+
+// Reference the template at *current, first recompiling it if its file has
+// changed. A file that no longer compiles leaves the last good one in place.
+struct template *template_acquire(struct template **current);
+
+// Drop a reference
+void template_release(struct template *t);
+
+// Render with values[i] (NULL for empty) filling slot i. Returns 0, or -1 if
+// the escaped values do not fit in the scratch space.
+int template_render(const struct template *t, const char *const values[], struct template_output *out);
+
+#endif // TEMPLATE_H
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "httpserve.h"
+#include "tls.h"
+
+struct tls {
+    SSL *ssl;
+    int sock;
+    int pair;               // relay's end of the handlers' socketpair
+};
+
+static SSL_CTX *ctx;
+static int relays;          // relay threads still running
+
+static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outLen,
+                           const unsigned char *in, unsigned int inLen, void *arg) {//ALPN, in our order of preference
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, outLen, protocols, sizeof(protocols) - 1, in, inLen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;//no ALPN in common: carry on with HTTP/1.1
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(const char *certFile, const char *keyFile) {
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return -1;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);//stateless tickets: a returning client skips the key exchange
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");//GCM first, the kernel takes those
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_alpn_select_cb(ctx, select_protocol, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1 || SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int tls_enabled(void) {
+    return ctx != NULL;
+}
+
+int tls_handshake(int sock, struct tls **state) {
+    struct tls *t = *state;
+    if (!t) {
+        if (!(t = calloc(1, sizeof(*t))) || !(t->ssl = SSL_new(ctx)) || SSL_set_fd(t->ssl, sock) != 1) {
+            if (t) SSL_free(t->ssl);
+            free(t);
+            return -1;
+        }
+        t->sock = sock;
+        t->pair = -1;
+        SSL_set_accept_state(t->ssl);
+        *state = t;
+    }
+
+    ERR_clear_error();
+    int rc = SSL_do_handshake(t->ssl);
+    if (rc == 1) return 1;
+    int err = SSL_get_error(t->ssl, rc);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return 0;
+    tls_drop(t);//scanners, plaintext clients, unknown CAs: nothing worth logging
+    *state = NULL;
+    return -1;
+}
+
+static int kernel_records(struct tls *t) {
+    return BIO_get_ktls_send(SSL_get_wbio(t->ssl)) && BIO_get_ktls_recv(SSL_get_rbio(t->ssl));
+}
+
+ssize_t tls_peek(int sock, struct tls *t, char *buf, size_t len) {
+    if (kernel_records(t)) return recv(sock, buf, len, MSG_PEEK | MSG_DONTWAIT);
+
+    ERR_clear_error();
+    int n = SSL_peek(t->ssl, buf, len);//decrypts at most the next record into OpenSSL's buffer
+    if (n > 0) return n;
+    int err = SSL_get_error(t->ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+    errno = ECONNRESET;
+    return -1;
+}
+
+void tls_drop(struct tls *t) {
+    if (!t) return;
+    SSL_free(t->ssl);//never closes the socket
+    free(t);
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *relay_main(void *arg) {//client records <-> plaintext socketpair, until the handler closes its end
+    struct tls *t = arg;
+    char buf[BUFFER_SIZE];
+    struct pollfd fds[2] = {{t->sock, POLLIN, 0}, {t->pair, POLLIN, 0}};
+
+    for (;;) {
+        if (fds[0].fd >= 0 && SSL_pending(t->ssl) > 0) {//decrypted already, poll would not see it
+            fds[0].revents = POLLIN;
+            fds[1].revents = 0;
+        } else if (poll(fds, 2, -1) < 0) {//the handler's own deadlines bound the wait
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[0].revents) {
+            int n = SSL_read(t->ssl, buf, sizeof(buf));
+            if (n <= 0) {//close_notify, reset or timeout: the handler sees the end of the request
+                shutdown(t->pair, SHUT_WR);
+                fds[0].fd = -1;
+            } else if (write_all(t->pair, buf, n) < 0) {
+                break;
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(t->pair, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {//response complete
+                SSL_shutdown(t->ssl);
+                break;
+            }
+            if (SSL_write(t->ssl, buf, n) <= 0) break;
+        }
+    }
+
+    close(t->pair);
+    close(t->sock);
+    tls_drop(t);
+    __atomic_fetch_sub(&relays, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static int start_relay(int sock, struct tls *t) {//-1 if no thread could be started
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) return -1;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);//the relay blocks, within the socket's deadlines
+    t->pair = pair[1];
+
+    __atomic_fetch_add(&relays, 1, __ATOMIC_RELAXED);
+    if (spawn_detached(relay_main, t) != 0) {
+        __atomic_fetch_sub(&relays, 1, __ATOMIC_RELAXED);
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    return pair[0];
+}
+
+int tls_release(int sock, struct tls *t) {
+    int kernel = kernel_records(t);
+    char msg[96];
+    snprintf(msg, sizeof(msg), "%s handshake%s%s", SSL_get_version(t->ssl), SSL_session_reused(t->ssl) ? ", resumed" : "",
+             kernel ? ", kernel TLS" : "");
+    logMsg(msg);
+
+    if (kernel) {//the socket carries plaintext now, sendfile() included
+        tls_drop(t);
+        return sock;
+    }
+    int fd = start_relay(sock, t);
+    if (fd < 0) tls_drop(t);
+    return fd;
+}
+
+void tls_drain(void) {
+    while (__atomic_load_n(&relays, __ATOMIC_RELAXED) > 0) nanosleep(&(struct timespec){0, 10000000}, NULL);
+}
@@ -0,0 +1,42 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+// TLS termination. Handshakes run in user space with OpenSSL; once they are
+// done the records are handed to the kernel (kTLS) where it can take them,
+// so read(), write() and sendfile() on the socket carry plaintext and the
+// handlers serve TLS exactly as they serve cleartext.
+
+struct tls;
+
+// Load the server certificate chain and key (PEM) for every connection:
+// TLS 1.2 and 1.3, ALPN h2 and http/1.1, session tickets for resumption.
+// Call before forking so every worker shares the ticket keys. 0 or -1.
+int tls_init(const char *certFile, const char *keyFile);
+
+// 1 once tls_init() succeeded
+int tls_enabled(void);
+
+// Advance the handshake on a non-blocking socket; *state starts NULL.
+// Returns 1 when it is complete, 0 while it waits for the socket, and -1
+// when it failed, with *state freed and the socket left to the caller.
+int tls_handshake(int sock, struct tls **state);
+
+// Peek at the decrypted request like recv(MSG_PEEK | MSG_DONTWAIT): bytes
+// available, 0 once the client closed, -1 with errno set otherwise
+ssize_t tls_peek(int sock, struct tls *state, char *buf, size_t len);
+
+// The descriptor the handlers get for a finished handshake: the socket
+// itself when the kernel does the records in both directions, otherwise one
+// end of a socketpair that a thread relays through OpenSSL. Takes state;
+// -1 if neither could be set up, with the socket left to the caller.
+int tls_release(int sock, struct tls *state);
+
+// Forget a connection that never got to the handlers
+void tls_drop(struct tls *state);
+
+// Wait for relays still sending the end of a response, before exiting
+void tls_drain(void);
+
+#endif // TLS_H
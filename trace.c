@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "httpserve.h"
+#include "outq.h"
+#include "router.h"
+#include "co.h"
+#include "trace.h"
+#include "accesslog.h"
+
+struct ring {
+    pthread_mutex_t lock;           // against the export, the owner is the only writer
+    int used;                       // a live thread writes here
+    unsigned next, count;
+    struct ring *link;
+    struct trace_record records[TRACE_RING];
+};
+
+// A request being followed: sampled for the rings, for the access log, or both
+struct live {
+    struct trace_record rec;        // first, trace_detach() hands out its address
+    int sampled;
+    struct accesslog_record *log;   // once described, with the access log on
+    int status;                     // of the response, 0 until seen, -1 if it cannot be
+    char line[12];                  // "HTTP/1.1 200", the status line as it goes out
+    int lineLen;
+    int blank;                      // bytes of the blank line ending the header seen, 4 once it is out
+    uint64_t body;                  // bytes sent after it
+};
+
+// Older accept stamps were left by connections closed before they were read
+#define STALE_NS (60ULL * 1000000000)
+
+static int enabled;
+static int logging;                 // every request is followed, not just the sampled ones
+static int64_t realOffset;          // CLOCK_REALTIME minus CLOCK_MONOTONIC, for the access log
+static uint64_t threshold;          // sampled if a 32-bit random number is below it
+static uint64_t *acceptedAt;        // by descriptor, ns
+static int maxFd;
+static unsigned lastId;
+
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings;          // every ring ever made, rings are reused but never freed
+static pthread_key_t ringKey;       // gives a ring back when its thread ends
+static __thread struct ring *mine;
+static __thread uint32_t seed;
+
+static const char *const phaseNames[TRACE_PHASES] = {"queued", "read", "route", "handler", "open", "cgi fork", "cgi run", "send", "done"};
+
+static void serve(const struct request *req, void *arg);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void give_back(void *arg) {
+    struct ring *r = arg;
+    __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);//its records stay for the export
+}
+
+static int enable(void) {
+    if (enabled) return 0;
+    maxFd = sysconf(_SC_OPEN_MAX) > 0 ? sysconf(_SC_OPEN_MAX) : 1024;
+    if (!(acceptedAt = calloc(maxFd, sizeof(*acceptedAt))) || pthread_key_create(&ringKey, give_back) != 0) return -1;
+    enabled = 1;
+    return 0;
+}
+
+int trace_mount(const char *path, double percent) {
+    if (percent < 0 || percent > 100) return -1;
+    if (router_add(ROUTER_GET, path, serve, NULL) < 0) return -1;
+    threshold = (uint64_t)(percent / 100 * 4294967296.0);
+    return percent == 0 ? 0 : enable();
+}
+
+int trace_follow_all(void) {
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    realOffset = (int64_t)((uint64_t)real.tv_sec * 1000000000 + real.tv_nsec - now_ns());
+    logging = 1;
+    return enable();
+}
+
+void trace_accepted(int client_sock) {
+    if (enabled && client_sock < maxFd) acceptedAt[client_sock] = now_ns();
+}
+
+void trace_moved(int from, int to) {
+    if (!enabled || from >= maxFd || to >= maxFd || from == to) return;
+    acceptedAt[to] = acceptedAt[from];
+    acceptedAt[from] = 0;
+}
+
+static int sampled(void) {
+    if (!seed) seed = (uint32_t)syscall(SYS_gettid) * 2654435761u | 1;
+    seed ^= seed << 13;//xorshift32, no lock and no syscall
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed < threshold;
+}
+
+void trace_begin(int client_sock) {
+    if (!enabled) return;
+    void **slot = co_local();
+    if (*slot) return;
+
+    uint64_t accepted = 0;
+    if (client_sock >= 0 && client_sock < maxFd) {//taken either way, a socketpair may reuse the number later
+        accepted = acceptedAt[client_sock];
+        acceptedAt[client_sock] = 0;
+    }
+    int sample = sampled();
+    if (!sample && !logging) return;
+    uint64_t now = now_ns();
+    if (accepted && now - accepted > STALE_NS) accepted = 0;
+
+    struct live *l = calloc(1, sizeof(*l));
+    if (!l) return;
+    struct trace_record *r = &l->rec;
+    l->sampled = sample;
+    r->id = __atomic_add_fetch(&lastId, 1, __ATOMIC_RELAXED);
+    r->tid = syscall(SYS_gettid);
+    r->start = accepted ? accepted : now;
+    if (accepted) {
+        r->phase[0] = TRACE_QUEUED;
+        r->marks = 1;
+    }
+    *slot = l;
+}
+
+static void release(struct live *l) {
+    if (!l) return;
+    free(l->log);
+    free(l);
+}
+
+static void mark(struct trace_record *r, int phase, int last) {
+    uint64_t now = now_ns();
+    if (r->marks == TRACE_MAX_MARKS) {
+        if (!last) return;
+        r->marks--;//the end always makes it in
+    }
+    r->phase[r->marks] = phase;
+    r->at[r->marks] = now - r->start;
+    r->marks++;
+}
+
+void trace_phase(int phase) {
+    if (!enabled) return;
+    struct live *l = *co_local();
+    if (l && l->sampled) mark(&l->rec, phase, 0);
+}
+
+void trace_describe(const char *method, const char *path, const char *target, const char *headers) {
+    if (!enabled) return;
+    struct live *l = *co_local();
+    if (!l) return;
+    if (l->sampled) snprintf(l->rec.what, sizeof(l->rec.what), "%s %s", method, path);
+    if (logging) {//again on the general route after a fast path gave up
+        free(l->log);
+        l->log = accesslog_request(method, target, headers);
+    }
+}
+
+void trace_sent(const void *data, size_t len) {
+    if (!enabled) return;
+    struct live *l = *co_local();
+    if (!l || !l->log || l->status < 0) return;
+
+    const char *p = data;
+    while (len > 0 && l->blank < 4) {//the header, a byte at a time: it may arrive in pieces
+        if (!p) {//inside a file, a CGI response kept whole
+            l->status = -1;
+            return;
+        }
+        char c = *p++;
+        len--;
+        if (l->lineLen < (int)sizeof(l->line)) {
+            l->line[l->lineLen++] = c;
+            if (l->lineLen == sizeof(l->line)) {
+                l->status = memcmp(l->line, "HTTP/1.", 7) == 0 ? atoi(l->line + 9) : -1;
+                if (l->status <= 0) {
+                    l->status = -1;
+                    return;
+                }
+            }
+        }
+        l->blank = c == "\r\n\r\n"[l->blank] ? l->blank + 1 : c == '\r';
+        if (l->blank == 4 && l->status < 200) {//100 Continue, the real response follows
+            l->status = 0;
+            l->lineLen = 0;
+            l->blank = 0;
+        }
+    }
+    l->body += len;
+}
+
+struct trace_record *trace_detach(void) {
+    if (!enabled) return NULL;
+    void **slot = co_local();
+    struct live *l = *slot;
+    *slot = NULL;
+    return l ? &l->rec : NULL;
+}
+
+void trace_attach(struct trace_record *r) {
+    if (!r) return;
+    void **slot = co_local();
+    release(*slot);
+    r->tid = syscall(SYS_gettid);
+    *slot = r;//the record is the first member of its live
+}
+
+static struct ring *my_ring(void) {//claimed from a thread that ended, or new
+    if (mine) return mine;
+    pthread_mutex_lock(&ringsLock);
+    for (struct ring *r = rings; r && !mine; r = r->link) {
+        if (__atomic_exchange_n(&r->used, 1, __ATOMIC_ACQUIRE) == 0) mine = r;
+    }
+    if (!mine && (mine = calloc(1, sizeof(*mine)))) {
+        pthread_mutex_init(&mine->lock, NULL);
+        mine->used = 1;
+        mine->link = rings;
+        rings = mine;
+    }
+    pthread_mutex_unlock(&ringsLock);
+    if (mine) pthread_setspecific(ringKey, mine);
+    return mine;
+}
+
+static void log_request(struct live *l) {
+    struct accesslog_record *a = l->log;
+    uint64_t now = now_ns();
+    a->start = l->rec.start + realOffset;
+    a->duration = now - l->rec.start;
+    a->status = l->status > 0 && l->blank == 4 ? l->status : 0;//a header cut short says nothing
+    a->responseBody = a->status ? l->body : 0;
+    accesslog_write(a);
+}
+
+void trace_end(void) {
+    struct live *l = (struct live *)trace_detach();
+    if (!l) return;
+    if (l->log) log_request(l);
+    if (!l->sampled) {
+        release(l);
+        return;
+    }
+    struct trace_record *r = &l->rec;
+    mark(r, TRACE_DONE, 1);
+
+    struct ring *ring = my_ring();
+    if (ring) {
+        pthread_mutex_lock(&ring->lock);
+        ring->records[ring->next] = *r;
+        ring->next = (ring->next + 1) % TRACE_RING;
+        if (ring->count < TRACE_RING) ring->count++;
+        pthread_mutex_unlock(&ring->lock);
+    }
+    release(l);
+}
+
+void trace_drop(void) {
+    release((struct live *)trace_detach());
+}
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void json_event(FILE *out, const char *ph, const char *name, uint64_t ns, const struct trace_record *r, int pid) {
+    fprintf(out, ",\n{\"ph\":\"%s\",\"cat\":\"http\",\"id\":%u,\"name\":", ph, r->id);
+    json_string(out, name);
+    fprintf(out, ",\"ts\":%.3f,\"pid\":%d,\"tid\":%u}", ns / 1000.0, pid, r->tid);
+}
+
+// Async begin/end pairs keyed by request id rather than complete events on
+// the thread: coroutines interleave requests on one thread, and complete
+// events there would have to nest
+static void json_record(FILE *out, const struct trace_record *r, int pid) {
+    const char *name = r->what[0] ? r->what : "request";
+    json_event(out, "b", name, r->start, r, pid);
+    for (int i = 0; i + 1 < r->marks; i++) {
+        json_event(out, "b", phaseNames[r->phase[i]], r->start + r->at[i], r, pid);
+        json_event(out, "e", phaseNames[r->phase[i]], r->start + r->at[i + 1], r, pid);
+    }
+    json_event(out, "e", name, r->start + r->at[r->marks - 1], r, pid);
+}
+
+static void serve(const struct request *req, void *arg) {
+    (void)arg;
+    int binary = req->query && strstr(req->query, "format=binary") != NULL;
+    char *body = NULL;
+    size_t bodyLen = 0;
+    FILE *out = open_memstream(&body, &bodyLen);
+    struct trace_record *copy = malloc(TRACE_RING * sizeof(*copy));
+    if (!out || !copy) {
+        if (out) fclose(out);
+        free(body);
+        free(copy);
+        const char *response = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        outq_send(req->sock, response, strlen(response));
+        return;
+    }
+
+    int pid = getpid();
+    if (binary) {
+        uint32_t size = sizeof(struct trace_record);
+        fwrite("HSTRACE1", 1, 8, out);
+        fwrite(&size, sizeof(size), 1, out);
+    } else {
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"httpserve\"}}", pid);
+    }
+    pthread_mutex_lock(&ringsLock);
+    for (struct ring *ring = rings; ring; ring = ring->link) {
+        pthread_mutex_lock(&ring->lock);//copied out, the owner waits no longer than a memcpy
+        unsigned count = ring->count, oldest = (ring->next + TRACE_RING - count) % TRACE_RING;
+        for (unsigned i = 0; i < count; i++) copy[i] = ring->records[(oldest + i) % TRACE_RING];
+        pthread_mutex_unlock(&ring->lock);
+
+        if (binary) fwrite(copy, sizeof(*copy), count, out);
+        else for (unsigned i = 0; i < count; i++) json_record(out, &copy[i], pid);
+    }
+    pthread_mutex_unlock(&ringsLock);
+    if (!binary) fputs("\n]}\n", out);
+    free(copy);
+    if (fclose(out) != 0) {
+        free(body);
+        const char *response = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        outq_send(req->sock, response, strlen(response));
+        return;
+    }
+
+    char head[256];
+    int headLen = snprintf(head, sizeof(head),
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: %s\r\n"
+                           "Content-Length: %zu\r\n"
+                           "Cache-Control: no-store\r\n"
+                           "\r\n",
+                           binary ? "application/octet-stream" : "application/json", bodyLen);
+    struct outq q;
+    outq_init(&q, req->sock);
+    outq_copy(&q, head, headLen);
+    outq_mem(&q, body, bodyLen, free, body);
+    outq_finish(&q);
+}
@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-request phase tracing. A sampled request carries a record of when
+// each phase began (CLOCK_MONOTONIC, nanoseconds); when it ends the record
+// goes into a ring of the thread that served it, overwriting the oldest.
+// GET <path> exports every ring as Chrome trace-event JSON (chrome://tracing,
+// Perfetto), GET <path>?format=binary as a compact file of raw records.
+// Requests not sampled cost a random number and a few branches; with tracing
+// off, one load of a global per call.
+//
+// The same record carries a request for the access log (accesslog.h): with
+// trace_follow_all() every request gets one, and the sampled ones also go
+// to the rings.
+
+// Phases, in the order a request usually passes through them. Each mark ends
+// the phase before it.
+enum trace_phase {
+    TRACE_QUEUED,           // accepted, waiting for its bytes and a thread
+    TRACE_READ,             // reading the request
+    TRACE_ROUTE,            // parsing and routing
+    TRACE_HANDLER,          // a handler without phases of its own
+    TRACE_OPEN,             // finding and opening the file
+    TRACE_CGI_FORK,         // setting up and forking the script
+    TRACE_CGI_RUN,          // the script running
+    TRACE_SEND,             // writing the response
+    TRACE_DONE,
+    TRACE_PHASES
+};
+
+// Marks kept per request, later ones are dropped
+#define TRACE_MAX_MARKS 12
+
+// Records kept per thread
+#define TRACE_RING 1024
+
+// Written as is by the binary export, after an 8-byte "HSTRACE1" magic and
+// the record size as a uint32_t, host byte order
+struct trace_record {
+    uint64_t start;                     // CLOCK_MONOTONIC ns of the first mark
+    uint32_t tid;
+    uint32_t id;                        // per process, in the order requests began
+    uint8_t marks;
+    uint8_t phase[TRACE_MAX_MARKS];
+    char what[43];                      // method and path, cut to fit
+    uint64_t at[TRACE_MAX_MARKS];       // ns after start each phase began
+};
+
+// Sample percent (0 to 100) of requests and export the rings at path.
+// Returns 0, or -1 if the route could not be added or memory ran out.
+int trace_mount(const char *path, double percent);
+
+// Follow every request and hand it to the access log when it ends; -1 if
+// memory ran out
+int trace_follow_all(void);
+
+// The engine took client_sock; the queued phase of its trace starts here.
+// trace_moved() carries that over to the descriptor the request will be read
+// from, when TLS puts a relay in between.
+void trace_accepted(int client_sock);
+void trace_moved(int from, int to);
+
+// Maybe start tracing the request on client_sock in this thread (or
+// coroutine); a no-op if one is already being traced here
+void trace_begin(int client_sock);
+
+// The traced request, if any, enters phase now
+void trace_phase(int phase);
+
+// Method and path of the traced request, for the export; the raw target and
+// the headers for the access log
+void trace_describe(const char *method, const char *path, const char *target, const char *headers);
+
+// len bytes of the response went out, data NULL when they came from a file:
+// the access log takes the status from the header and counts the body
+void trace_sent(const void *data, size_t len);
+
+// The traced request is done: keep its record, or drop it (a connection
+// handed to HTTP/2 is many requests, each traced on its own)
+void trace_end(void);
+void trace_drop(void);
+
+// Carry the traced request to the thread that finishes it: detach where it
+// is handed off (NULL if none), attach there
+struct trace_record *trace_detach(void);
+void trace_attach(struct trace_record *r);
+
+#endif // TRACE_H
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include "httpserve.h"
+#include "urlpath.h"
+#include "outq.h"
+#include "router.h"
+#include "upload.h"
+#include "gate.h"
+
+struct mount {
+    char prefix[URLPATH_MAX];
+    size_t prefixLen;
+    int dir;                    // directory files land in, opened once
+};
+
+static struct mount mounts[UPLOAD_MAX_MOUNTS];
+static int mountCount;
+
+static void serve(const struct request *req, void *arg);
+
+int upload_add(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (spec[0] != '/' || !eq || !eq[1] || mountCount == UPLOAD_MAX_MOUNTS) return -1;
+
+    struct mount *m = &mounts[mountCount];
+    size_t prefixLen = eq - spec;
+    while (prefixLen > 1 && spec[prefixLen - 1] == '/') prefixLen--;//"/up/" is the same mount as "/up"
+    if (prefixLen >= sizeof(m->prefix)) return -1;
+    memcpy(m->prefix, spec, prefixLen);
+    m->prefix[prefixLen] = '\0';
+    m->prefixLen = prefixLen == 1 ? 0 : prefixLen;
+    if ((m->dir = open(eq + 1, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return -1;
+
+    char below[URLPATH_MAX + 2];
+    snprintf(below, sizeof(below), "%.*s/*", (int)m->prefixLen, m->prefix);
+    if (router_add(ROUTER_PUT, below, serve, m) < 0 || router_add(ROUTER_POST, below, serve, m) < 0) {
+        close(m->dir);
+        return -1;
+    }
+    mountCount++;
+    return 0;
+}
+
+int upload_wanted(const char *buff) {
+    return mountCount > 0 && router_peek(buff) == serve;
+}
+
+static void respond(int client_sock, const char *status) {
+    char response[128];
+    int len = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n", status);
+    outq_send(client_sock, response, len);
+}
+
+static const char *disk_error(void) {
+    return errno == ENOSPC || errno == EDQUOT ? "507 Insufficient Storage" : "500 Internal Server Error";
+}
+
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// How receiving the body went
+enum { BODY_OK, BODY_CLIENT, BODY_TIMEOUT, BODY_DISK };
+
+static int body_ready(struct gate_body *b, int client_sock) {//BODY_OK once there is more to read
+    int ready = gate_body_wait(b, client_sock);
+    return ready > 0 ? BODY_OK : ready == 0 ? BODY_TIMEOUT : BODY_CLIENT;
+}
+
+static int copy_read(struct gate_body *b, int client_sock, int fd, long long left) {//where splice() does not reach: through a buffer
+    char buf[BUFFER_SIZE];
+    while (left > 0) {
+        int rc = body_ready(b, client_sock);
+        if (rc != BODY_OK) return rc;
+        ssize_t n = read(client_sock, buf, left < (long long)sizeof(buf) ? left : (long long)sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return BODY_TIMEOUT;
+        if (n <= 0) return BODY_CLIENT;
+        if (write_all(fd, buf, n) < 0) return BODY_DISK;
+        b->got += n;
+        left -= n;
+    }
+    return BODY_OK;
+}
+
+static int copy_splice(struct gate_body *b, int client_sock, int fd, long long left) {//socket to pipe to file, the data stays in the kernel
+    int pipes[2];
+    if (pipe2(pipes, O_CLOEXEC) < 0) return copy_read(b, client_sock, fd, left);
+    long chunk = fcntl(pipes[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);//may be capped by pipe-max-size, the default still works
+    if (chunk <= 0) chunk = fcntl(pipes[1], F_GETPIPE_SZ);
+    if (chunk <= 0) chunk = 65536;
+
+    int rc = BODY_OK, first = 1;
+    while (left > 0) {
+        if ((rc = body_ready(b, client_sock)) != BODY_OK) break;
+        ssize_t in = splice(client_sock, NULL, pipes[1], NULL, left < chunk ? left : chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && errno == EINVAL && first) {//a descriptor splice() cannot read, nothing consumed yet
+            rc = copy_read(b, client_sock, fd, left);
+            break;
+        }
+        if (in < 0 && errno == EAGAIN) rc = BODY_TIMEOUT;
+        else if (in <= 0) rc = BODY_CLIENT;
+        if (in <= 0) break;
+        first = 0;
+        b->got += in;
+        left -= in;
+
+        while (in > 0) {
+            ssize_t out = splice(pipes[0], NULL, fd, NULL, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                rc = BODY_DISK;
+                break;
+            }
+            in -= out;
+        }
+        if (rc != BODY_OK) break;
+    }
+    close(pipes[0]);
+    close(pipes[1]);
+    return rc;
+}
+
+static int open_temp(int dir, char *name, size_t size) {//new file under a name nobody asks for, or -1
+    for (int tries = 0; tries < 4; tries++) {
+        unsigned random[2];
+        if (getrandom(random, sizeof(random), GRND_NONBLOCK) != sizeof(random)) {
+            random[0] = rand();
+            random[1] = rand();
+        }
+        snprintf(name, size, ".upload-%08x%08x", random[0], random[1]);
+        int fd = openat(dir, name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST) return fd;
+    }
+    return -1;
+}
+
+static int place(int dir, const char *temp, const char *name, int replace) {//0, or -1 with errno (EEXIST if it may not replace)
+    if (replace) return renameat(dir, temp, dir, name);
+    if (renameat2(dir, temp, dir, name, RENAME_NOREPLACE) == 0) return 0;
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+    if (linkat(dir, temp, dir, name, 0) < 0) return -1;//no RENAME_NOREPLACE on this filesystem: a link fails the same way
+    unlinkat(dir, temp, 0);
+    return 0;
+}
+
+static void serve(const struct request *req, void *arg) {
+    struct mount *m = arg;
+    int client_sock = req->sock;
+    const char *name = req->path + m->prefixLen;
+    if (*name == '/') name++;
+    if (!*name || *name == '.' || strchr(name, '/')) {//one plain file per upload, nothing hidden and no subdirectories
+        respond(client_sock, "400 Bad Request");
+        return;
+    }
+
+    char value[64];
+    if (get_header(req->headers, "Transfer-Encoding", value, sizeof(value)) ||
+        !get_header(req->headers, "Content-Length", value, sizeof(value))) {//the file is sized before the body arrives
+        respond(client_sock, "411 Length Required");
+        return;
+    }
+    char *e;
+    long long length = strtoll(value, &e, 10);
+    if (*e || e == value || length < 0) {
+        respond(client_sock, "400 Bad Request");
+        return;
+    }
+    if (length > UPLOAD_MAX_BYTES) {
+        respond(client_sock, "413 Content Too Large");
+        return;
+    }
+
+    char temp[32];
+    int fd = open_temp(m->dir, temp, sizeof(temp));
+    if (fd < 0) {
+        respond(client_sock, disk_error());
+        return;
+    }
+    if (length > 0 && fallocate(fd, 0, 0, length) < 0 && errno != EOPNOTSUPP) {//out of space shows now, not halfway through
+        respond(client_sock, disk_error());
+        close(fd);
+        unlinkat(m->dir, temp, 0);
+        return;
+    }
+
+    const char *body = router_body(req);
+    size_t have = req->end - body;
+    if ((long long)have > length) have = length;//pipelined bytes past the body are not part of the file
+    if (have < (size_t)length && get_header(req->headers, "Expect", value, sizeof(value)) && strcasecmp(value, "100-continue") == 0) {
+        const char *proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+        outq_send(client_sock, proceed, strlen(proceed));
+    }
+
+    struct gate_body b;//from here on the rest has to keep coming
+    gate_body_start(&b);
+    int rc = write_all(fd, body, have) < 0 ? BODY_DISK : copy_splice(&b, client_sock, fd, length - have);
+    if (rc == BODY_OK && fdatasync(fd) < 0) rc = BODY_DISK;//on disk before it has the name
+    const char *failed = rc == BODY_DISK ? disk_error() : NULL;
+    close(fd);
+
+    if (rc == BODY_OK) {
+        int existed = faccessat(m->dir, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+        if (place(m->dir, temp, name, req->method == ROUTER_PUT) == 0) {
+            fsync(m->dir);//and the name on disk before the client hears so
+            respond(client_sock, existed ? "204 No Content" : "201 Created");
+            return;
+        }
+        failed = errno == EEXIST ? "409 Conflict" : disk_error();
+    }
+
+    unlinkat(m->dir, temp, 0);
+    if (rc == BODY_TIMEOUT) respond(client_sock, "408 Request Timeout");
+    else if (failed) respond(client_sock, failed);
+}
@@ -0,0 +1,29 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+// Uploads: PUT and POST bodies under a path prefix stream from the socket
+// into a directory through a pipe with splice(), never through a user space
+// buffer, so memory stays flat whatever the size. The file is preallocated
+// from Content-Length, written under a temporary name and renamed into place
+// once the whole body is on disk; a reader never sees half a file.
+
+#define UPLOAD_MAX_MOUNTS 8
+
+// Pipe between the socket and the file; larger pipes mean fewer splice calls
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+
+// Largest body accepted
+#define UPLOAD_MAX_BYTES (16LL << 30)
+
+// Mount "/prefix=dir": PUT /prefix/name creates or replaces dir/name, POST
+// creates it only if it does not exist yet. Names are a single path segment
+// not starting with a dot. Returns 0, or -1 if the spec is malformed or the
+// directory cannot be opened.
+int upload_add(const char *spec);
+
+// 1 if the request in buff (NUL-terminated) is an upload. Engines use it to
+// move such requests, which wait on the client and the disk, off their fast
+// paths.
+int upload_wanted(const char *buff);
+
+#endif // UPLOAD_H
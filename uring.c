@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "httpserve.h"
+#include "uring.h"
+#include "prefork.h"
+#include "admit.h"
+#include "ratelimit.h"
+#include "gate.h"
+#include "h2.h"
+#include "proxy.h"
+#include "upload.h"
+#include "profile.h"
+#include "trace.h"
+
+// Static GET/HEAD requests stay on the ring end to end: multishot accept,
+// recvs into kernel-picked provided buffers until the head is in, then one linked chain
+// send(header) -> splice(file -> pipe) -> splice(pipe -> socket) and an
+// async close, all submitted in batches with one io_uring_enter() per loop.
+// Anything else (POST/CGI, ranges, errors) is handed to dispatch_request()
+// on a thread of its own, exactly as the blocking loop would run it, so a
+// slow script or a slow reader never holds the ring.
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_CLOSE, OP_DEADLINE };//tag in the low bits of user_data
+
+struct uconn {
+    int fd;
+    int pending;            // CQEs still due for the chain in flight
+    int failed;             // something in the chain went short or wrong
+    int pipe[2];
+    int room;               // capacity of that pipe, the most one splice pair moves
+    off_t sent;             // body bytes on the wire so far
+    off_t chunk;            // body bytes in the chain in flight
+    struct static_file sf;
+    struct trace_record *trace; // of the response in flight, if sampled
+    int timer;              // the write deadline's TIMEOUT has not completed yet
+    int done;               // finished, freed when that TIMEOUT completes
+    uint64_t acceptedAt;    // admit_now() at accept, the gate's deadlines count from it
+    struct __kernel_timespec wait; // of the recv in flight, read by the kernel at submission
+    int len;                // bytes of the request head so far
+    char head[REQUEST_SIZE];
+};
+
+static struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqTailLocal, toSubmit;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufRing;
+    char *bufs;
+    unsigned short bufTail;
+    int pipes[URING_PIPE_POOL][2];
+    int pipeRoom[URING_PIPE_POOL];
+    int pipeCount;
+    int pipeSize;
+    unsigned sqEntries;
+    int serverSock;
+    int live;               // connections accepted and not yet closed
+    int offloaded;          // of those, connections running blocking handlers on their own thread
+    int draining;           // accept cancelled, waiting for live to reach 0
+} R;
+
+static int ring_enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, R.fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL;
+    R.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (R.fd < 0) return -1;
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqSize > sqSize) sqSize = cqSize;
+        cqSize = sqSize;
+    }
+
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, R.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, R.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -1;
+    }
+    R.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, R.fd, IORING_OFF_SQES);
+    if (R.sqes == MAP_FAILED) return -1;
+
+    R.sqHead = (unsigned *)(sq + p.sq_off.head);
+    R.sqTail = (unsigned *)(sq + p.sq_off.tail);
+    R.sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    R.sqArray = (unsigned *)(sq + p.sq_off.array);
+    R.sqTailLocal = *R.sqTail;
+    R.sqEntries = p.sq_entries;
+    R.cqHead = (unsigned *)(cq + p.cq_off.head);
+    R.cqTail = (unsigned *)(cq + p.cq_off.tail);
+    R.cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    R.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void recycle_buffer(unsigned short bid) {//hand a provided buffer back to the kernel
+    struct io_uring_buf *buf = &R.bufRing->bufs[R.bufTail & (URING_BUFS - 1)];
+    buf->addr = (unsigned long)(R.bufs + (size_t)bid * REQUEST_SIZE);
+    buf->len = REQUEST_SIZE - 1;//room for the terminator dispatch_request() adds
+    buf->bid = bid;
+    store_release(&R.bufRing->tail, ++R.bufTail);
+}
+
+static int buffers_setup(void) {
+    R.bufRing = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    R.bufs = malloc((size_t)URING_BUFS * REQUEST_SIZE);
+    if (R.bufRing == MAP_FAILED || !R.bufs) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)R.bufRing;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, R.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;//needs 5.19
+
+    R.bufTail = 0;
+    for (int i = 0; i < URING_BUFS; i++) recycle_buffer(i);
+    return 0;
+}
+
+static void make_room(unsigned count) {//flush queued SQEs if fewer than count slots are free
+    if (R.sqEntries - (R.sqTailLocal - load_acquire(R.sqHead)) < count) {
+        int n = ring_enter(R.toSubmit, 0, 0);
+        if (n > 0) R.toSubmit -= n;
+    }
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+    make_room(1);
+    unsigned idx = R.sqTailLocal & *R.sqMask;
+    struct io_uring_sqe *sqe = &R.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    R.sqArray[idx] = idx;
+    R.sqTailLocal++;
+    store_release(R.sqTail, R.sqTailLocal);
+    R.toSubmit++;
+    return sqe;
+}
+
+static unsigned long long tag(void *ptr, int op) {
+    return (unsigned long long)(unsigned long)ptr | op;
+}
+
+static void arm_accept(void) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = R.serverSock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+}
+
+static void arm_recv(struct uconn *c) {//the recv fails with ECANCELED past the idle deadline, or the header deadline once data came
+    uint64_t by = c->acceptedAt + (uint64_t)(c->len ? GATE_HEADER_SECS : GATE_IDLE_SECS) * 1000000000, now = admit_now();
+    uint64_t left = by > now ? by - now : 1;//already late: time out right away
+    c->wait.tv_sec = left / 1000000000;
+    c->wait.tv_nsec = left % 1000000000;
+
+    make_room(2);//a linked pair must go to the kernel in one submission
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = REQUEST_SIZE - 1 - c->len;
+    sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+    sqe->buf_group = 0;
+    sqe->user_data = tag(c, OP_RECV);
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (unsigned long)&c->wait;
+    sqe->len = 1;
+    sqe->user_data = tag(NULL, OP_CLOSE);//nobody waits for the result
+}
+
+// A client that reads nothing for GATE_WRITE_SECS gets its socket shut down,
+// which fails the chain in flight. A linked timeout cannot do it: the splices
+// block in io-wq, where cancelling them does not take. One TIMEOUT per
+// response, pushed back with every chunk as outq's deadline restarts with
+// every bit of progress.
+static void arm_deadline(struct uconn *c) {
+    static struct __kernel_timespec limit = {GATE_WRITE_SECS, 0};//read by the kernel at submission
+
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!c->timer) {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long)&limit;
+        sqe->len = 1;
+        sqe->off = 0;//no completion count, time only
+        sqe->user_data = tag(c, OP_DEADLINE);
+        c->timer = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = tag(c, OP_DEADLINE);
+    sqe->off = (unsigned long)&limit;
+    sqe->timeout_flags = IORING_TIMEOUT_UPDATE;
+    sqe->user_data = tag(NULL, OP_CLOSE);//nobody waits for the result, ENOENT once it fired
+}
+
+static void on_deadline(struct uconn *c, struct io_uring_cqe *cqe) {
+    c->timer = 0;
+    if (c->done) free(c);
+    else if (cqe->res == -ETIME) shutdown(c->fd, SHUT_RDWR);//on_chain() sees the chain fail and finishes
+}
+
+static void submit_close(int fd) {//nobody waits for the result
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = tag(NULL, OP_CLOSE);
+}
+
+static void cancel_accept(void) {//stop taking connections, the successor has the socket too
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(NULL, OP_ACCEPT);
+    sqe->user_data = tag(NULL, OP_CLOSE);
+    R.draining = 1;
+}
+
+static void connection_done(void) {//offloaded connections end on their own thread
+    __atomic_fetch_sub(&R.live, 1, __ATOMIC_RELEASE);
+    admit_done();
+    score_done();
+}
+
+static int take_pipe(int p[2]) {//returns the pipe capacity or -1
+    if (R.pipeCount > 0) {
+        R.pipeCount--;
+        p[0] = R.pipes[R.pipeCount][0];
+        p[1] = R.pipes[R.pipeCount][1];
+        return R.pipeRoom[R.pipeCount];
+    }
+    if (pipe2(p, O_CLOEXEC) < 0) return -1;
+    fcntl(p[1], F_SETPIPE_SZ, R.pipeSize);//best effort, chunks follow what we actually got
+    int room = fcntl(p[1], F_GETPIPE_SZ);
+    return room > 0 ? room : 65536;
+}
+
+static void give_pipe(int p[2], int room, int dirty) {//a pipe with bytes left in it is never reused
+    if (!dirty && R.pipeCount < URING_PIPE_POOL) {
+        R.pipes[R.pipeCount][0] = p[0];
+        R.pipes[R.pipeCount][1] = p[1];
+        R.pipeRoom[R.pipeCount] = room;
+        R.pipeCount++;
+    } else {
+        close(p[0]);
+        close(p[1]);
+    }
+    p[0] = p[1] = -1;
+}
+
+static void finish(struct uconn *c) {
+    trace_attach(c->trace);//back on the thread only while it ends, others' responses interleave
+    trace_sent(c->sf.header, c->sf.headLength);//the ring sent them, outq never saw
+    trace_sent(NULL, c->sent);
+    trace_end();
+    close_static_file(&c->sf);
+    if (c->pipe[0] >= 0) give_pipe(c->pipe, c->room, c->failed);
+    submit_close(c->fd);
+    connection_done();
+    if (!c->timer) {
+        free(c);
+        return;
+    }
+    struct io_uring_sqe *sqe = get_sqe();//the deadline still points at c, on_deadline() frees it
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = tag(c, OP_DEADLINE);
+    sqe->user_data = tag(NULL, OP_CLOSE);
+    c->done = 1;
+}
+
+static void queue_chunk(struct uconn *c, int withHeader) {//[send header ->] splice in -> splice out
+    off_t left = c->sf.size - c->sent;
+    c->chunk = left < c->room ? left : c->room;
+    c->pending = 0;
+    arm_deadline(c);
+    make_room(3);//a linked chain must go to the kernel in one submission
+
+    struct io_uring_sqe *sqe;
+    if (withHeader) {
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (unsigned long)c->sf.header;
+        sqe->len = c->sf.headLength;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_MORE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = tag(c, OP_SEND);
+        c->pending++;
+    }
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = c->sf.fd;
+    sqe->splice_off_in = c->sf.offset + c->sent;
+    sqe->fd = c->pipe[1];
+    sqe->off = (unsigned long long)-1;
+    sqe->len = c->chunk;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tag(c, OP_SPLICE_IN);
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = c->pipe[0];
+    sqe->splice_off_in = (unsigned long long)-1;
+    sqe->fd = c->fd;
+    sqe->off = (unsigned long long)-1;
+    sqe->len = c->chunk;
+    sqe->user_data = tag(c, OP_SPLICE_OUT);
+    c->pending += 2;
+}
+
+static void start_response(struct uconn *c) {
+    c->pipe[0] = c->pipe[1] = -1;
+    if (c->sf.size == 0) {//HEAD or empty file: the header is everything
+        arm_deadline(c);
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (unsigned long)c->sf.header;
+        sqe->len = c->sf.headLength;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(c, OP_SEND);
+        c->pending = 1;
+        return;
+    }
+    c->room = take_pipe(c->pipe);
+    if (c->room < 0) {
+        perror("pipe");
+        c->pipe[0] = c->pipe[1] = -1;
+        finish(c);
+        return;
+    }
+    queue_chunk(c, 1);
+}
+
+static void on_accept(struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !R.draining) arm_accept();//multishot ended (error or overflow), re-arm
+    if (cqe->res < 0) {
+        if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) fprintf(stderr, "error accepting: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    if (ratelimit_enabled(RATELIMIT_IP) && ratelimit_take(RATELIMIT_IP, ratelimit_peer(cqe->res), NULL) < 0) {//multishot accept gives no address
+        ratelimit_refuse(cqe->res);
+        return;
+    }
+    if (admit_accept() < 0) {//at the cap; a 503 this small fits any fresh socket buffer
+        admit_shed(cqe->res);
+        return;
+    }
+
+    struct uconn *c = calloc(1, sizeof(*c));
+    if (!c) {
+        admit_done();
+        close(cqe->res);
+        return;
+    }
+    c->fd = cqe->res;
+    c->acceptedAt = admit_now();
+    trace_accepted(c->fd);
+    logMsg("New connection accepted");
+    score_accepted();
+    __atomic_fetch_add(&R.live, 1, __ATOMIC_RELAXED);
+    arm_recv(c);
+}
+
+static void offload_done(void) {
+    __atomic_fetch_sub(&R.offloaded, 1, __ATOMIC_RELAXED);
+    connection_done();
+}
+
+static int offload(int fd, const char *request, int len) {//blocking handlers would hold the ring: an HTTP/2 connection for its whole life, CGI until the script exits
+    __atomic_fetch_add(&R.offloaded, 1, __ATOMIC_RELAXED);
+    if (dispatch_detached(fd, request, len, offload_done) == 0) return 0;
+    __atomic_fetch_sub(&R.offloaded, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+static void arm_tick(void) {//wakes a draining loop that is only waiting on offloaded connections
+    static struct __kernel_timespec tick = {0, 100000000};
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&tick;
+    sqe->len = 1;
+    sqe->user_data = tag(NULL, OP_CLOSE);
+}
+
+static void on_recv(struct uconn *c, struct io_uring_cqe *cqe) {
+    if (cqe->res == -ENOBUFS) {//every buffer is in use, try again next round
+        arm_recv(c);
+        return;
+    }
+    if (cqe->res == -ECANCELED) {//timed out, silent or with the head still incomplete
+        gate_timed_out(c->fd);
+        free(c);
+        connection_done();
+        return;
+    }
+    if (cqe->res < 0 || (cqe->res == 0 && c->len == 0)) {
+        submit_close(c->fd);
+        free(c);
+        connection_done();
+        return;
+    }
+
+    if (cqe->res > 0) {//gather the head across recvs, as the gate waits for it whole
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        memcpy(c->head + c->len, R.bufs + (size_t)bid * REQUEST_SIZE, cqe->res);
+        recycle_buffer(bid);
+        c->len += cqe->res;
+        if (c->len < REQUEST_SIZE - 1 && !memmem(c->head, c->len, "\r\n\r\n", 4) && !memmem(c->head, c->len, "\n\n", 2)) {
+            arm_recv(c);
+            return;
+        }
+    }//closed halfway: the handlers see what came, as after the gate
+
+    char request[REQUEST_SIZE], scratch[REQUEST_SIZE];
+    int len = c->len;
+    memcpy(request, c->head, len);
+    request[len] = '\0';
+    memcpy(scratch, request, len + 1);
+
+    if (h2_wanted(request, len) || proxy_wanted(request) || upload_wanted(request) || profile_wanted(request)) {
+        gate_limits(c->fd);
+        if (offload(c->fd, request, len) == 0) {
+            free(c);
+            return;
+        }
+    }
+    trace_begin(c->fd);
+    trace_phase(TRACE_OPEN);
+    if (open_static_file(scratch, &c->sf)) {
+        trace_phase(TRACE_SEND);
+        c->trace = trace_detach();
+        start_response(c);
+        return;
+    }
+
+    int fd = c->fd;//general route: blocking handlers, they close the socket themselves
+    free(c);
+    gate_limits(fd);
+    if (offload(fd, request, len) == 0) return;//the trace record begun here goes along
+    dispatch_request(fd, request, len);
+    connection_done();
+}
+
+static void on_chain(struct uconn *c, int op, struct io_uring_cqe *cqe) {
+    if (op == OP_SPLICE_OUT && cqe->res > 0) c->sent += cqe->res;
+    if (cqe->res < 0 || (op == OP_SEND && cqe->res != c->sf.headLength) ||
+        ((op == OP_SPLICE_IN || op == OP_SPLICE_OUT) && cqe->res != c->chunk)) {
+        c->failed = 1;
+    }
+    if (--c->pending > 0) return;
+
+    if (!c->failed && c->sent < c->sf.size) {
+        queue_chunk(c, 0);
+        return;
+    }
+    finish(c);
+}
+
+int uring_serve(int server_sock) {
+    memset(&R, 0, sizeof(R));
+    R.serverSock = server_sock;
+    R.pipeSize = 1 << 20;
+
+    if (ring_setup() < 0 || buffers_setup() < 0) {
+        if (R.fd > 0) close(R.fd);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);//splice to a reset peer must not kill the server
+    logMsg("io_uring engine started");
+    arm_accept();
+
+    while (1) {
+        if (!R.draining && server_draining()) cancel_accept();
+        if (R.draining && __atomic_load_n(&R.live, __ATOMIC_ACQUIRE) == 0) {
+            ring_enter(R.toSubmit, 0, 0);//queued closes still have to reach the kernel
+            logMsg("drained");
+            return 0;
+        }
+
+        if (R.draining && __atomic_load_n(&R.offloaded, __ATOMIC_RELAXED) > 0) arm_tick();
+        int n = ring_enter(R.toSubmit, 1, IORING_ENTER_GETEVENTS);//submit the whole batch and wait in one call
+        if (n < 0) {
+            if (errno == EINTR) {
+                server_tick();
+                continue;
+            }
+            perror("io_uring_enter");
+            return 0;
+        }
+        R.toSubmit -= n;
+
+        unsigned head = *R.cqHead;
+        unsigned tail = load_acquire(R.cqTail);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &R.cqes[head & *R.cqMask];
+            int op = cqe->user_data & 7;
+            struct uconn *c = (struct uconn *)(unsigned long)(cqe->user_data & ~7ULL);
+
+            if (op == OP_ACCEPT) on_accept(cqe);
+            else if (op == OP_RECV) on_recv(c, cqe);
+            else if (op == OP_SEND || op == OP_SPLICE_IN || op == OP_SPLICE_OUT) on_chain(c, op, cqe);
+            else if (op == OP_DEADLINE) on_deadline(c, cqe);
+
+            head++;
+            if (head == tail) {//pick up completions that arrived while we worked
+                store_release(R.cqHead, head);
+                tail = load_acquire(R.cqTail);
+            }
+        }
+        store_release(R.cqHead, head);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef URING_H
+#define URING_H
+
+// Queue depth of the submission ring
+#define URING_ENTRIES 256
+
+// Provided receive buffers (power of two), REQUEST_SIZE bytes each
+#define URING_BUFS 512
+
+// Idle pipes kept around for splicing file data to sockets
+#define URING_PIPE_POOL 64
+
+// Serve server_sock with the io_uring engine. Returns -1 straight away if
+// io_uring or provided buffer rings (5.19+) are unavailable, before anything
+// is accepted, so the caller can fall back. Returns 0 if the ring fails later
+// or once it has drained after server_draining() turned on.
+int uring_serve(int server_sock);
+
+#endif // URING_H
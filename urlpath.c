@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "urlpath.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct utf8_state {//incremental validator, table 3-7 of the Unicode standard
+    int need;
+    unsigned char lo, hi;
+};
+
+static int utf8_feed(struct utf8_state *u, unsigned char c) {//returns 0 if the byte is fine so far
+    if (u->need > 0) {
+        if (c < u->lo || c > u->hi) {
+            u->need = 0;
+            return -1;
+        }
+        u->need--;
+        u->lo = 0x80;
+        u->hi = 0xBF;
+        return 0;
+    }
+    if (c < 0x80) return 0;
+
+    u->lo = 0x80;
+    u->hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) u->need = 1;
+    else if (c == 0xE0) { u->need = 2; u->lo = 0xA0; }
+    else if (c == 0xED) { u->need = 2; u->hi = 0x9F; }//no UTF-16 surrogates
+    else if (c >= 0xE1 && c <= 0xEF) u->need = 2;
+    else if (c == 0xF0) { u->need = 3; u->lo = 0x90; }
+    else if (c >= 0xF1 && c <= 0xF3) u->need = 3;
+    else if (c == 0xF4) { u->need = 3; u->hi = 0x8F; }//nothing past U+10FFFF
+    else return -1;
+    return 0;
+}
+
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// The segment just written ends at o; drop it if it is "." and pop the one
+// before it if it is "..". Returns the new output length or -1 above the root.
+static int close_segment(char *out, int o) {
+    const char *slash = memrchr(out, '/', o);
+    int seg = (int)(slash - out);
+    int len = o - seg - 1;
+
+    if (len == 1 && out[seg + 1] == '.') return seg + 1;
+    if (len == 2 && out[seg + 1] == '.' && out[seg + 2] == '.') {
+        if (seg == 0) return -1;//would climb out of the document root
+        slash = memrchr(out, '/', seg);
+        return (int)(slash - out) + 1;
+    }
+    return o;
+}
+
+int normalize_target(const char *target, char *out, size_t outlen, const char **query, int *flags) {
+    const unsigned char *in = (const unsigned char *)target;
+    size_t n = strlen(target);
+    size_t i = 0;
+    int o = 0;
+    int limit = (int)outlen - 1;
+    struct utf8_state utf8 = {0, 0x80, 0xBF};
+
+    *query = NULL;
+    *flags = 0;
+    if (n == 0 || in[0] != '/' || limit < 1) return -1;
+    out[o++] = '/';
+    i++;
+
+    while (i < n) {
+#ifdef __SSE2__
+        // Sixteen bytes at a time: anything that is not '%', '/', '?', '#', a
+        // control character or a non-ASCII byte is copied through untouched.
+        if (utf8.need == 0 && i + 16 <= n && o + 16 <= limit) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+            __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('?')), _mm_cmpeq_epi8(v, _mm_set1_epi8('#'))));
+            special = _mm_or_si128(special, _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));//signed: also catches >= 0x80
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+
+            unsigned mask = (unsigned)_mm_movemask_epi8(special);
+            if (mask == 0) {
+                _mm_storeu_si128((__m128i *)(out + o), v);
+                i += 16;
+                o += 16;
+                continue;
+            }
+            int k = __builtin_ctz(mask);//plain run before the first special byte
+            memcpy(out + o, in + i, k);
+            i += k;
+            o += k;
+        }
+#endif
+        unsigned char c = in[i];
+
+        if (c == '?' || c == '#') {//end of the path
+            if (c == '?') *query = target + i + 1;
+            break;
+        }
+
+        if (c == '/') {
+            o = close_segment(out, o);
+            if (o < 0) return -1;
+            if (out[o - 1] != '/') {//"//" collapses
+                if (o >= limit) return -1;
+                out[o++] = '/';
+            }
+            i++;
+            continue;
+        }
+
+        if (c == '%') {
+            int hi = hex_value(in[i + 1]);//the terminator stops us reading past the end
+            int lo = hi >= 0 ? hex_value(in[i + 2]) : -1;
+            if (lo < 0) return -1;
+            c = (unsigned char)(hi << 4 | lo);
+            if (c == '\0' || c == '/') return -1;//encoded separators would change the path structure
+            i += 3;
+        } else {
+            i++;
+        }
+
+        if (c < 0x20 || c == 0x7f) return -1;
+        if (utf8_feed(&utf8, c) < 0) *flags |= URLPATH_BAD_UTF8;
+        if (o >= limit) return -1;
+        out[o++] = (char)c;
+    }
+
+    if (utf8.need > 0) *flags |= URLPATH_BAD_UTF8;
+
+    o = close_segment(out, o);//trailing "." or ".."
+    if (o < 0) return -1;
+    out[o] = '\0';
+    return o;
+}
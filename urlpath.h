@@ -0,0 +1,20 @@
+#ifndef URLPATH_H
+#define URLPATH_H
+
+#include <stddef.h>
+
+// Longest canonical path we accept, including the terminator
+#define URLPATH_MAX 1024
+
+// Flags reported by normalize_target()
+#define URLPATH_BAD_UTF8 0x1   // decoded path is not valid UTF-8
+
+// Turn a raw request target into a canonical path in one pass: the query is
+// split off, %XX escapes are decoded, "//" and "/./" collapse and ".." pops a
+// segment. out always starts with '/'. *query points just past '?' inside
+// target (or is NULL) and *flags receives URLPATH_* bits.
+// Returns the length of out, or -1 for a malformed target: bad escape,
+// encoded '/' or NUL, control characters, ".." above the root or too long.
+int normalize_target(const char *target, char *out, size_t outlen, const char **query, int *flags);
+
+#endif // URLPATH_H
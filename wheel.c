@@ -0,0 +1,45 @@
+#include <stddef.h>
+#include "wheel.h"
+
+void wheel_init(struct wheel *w, uint64_t nowMs) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) w->slots[i].next = w->slots[i].prev = &w->slots[i];
+    w->tick = nowMs / WHEEL_TICK_MS;
+}
+
+void wheel_del(struct timer *t) {
+    if (!t->next) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void wheel_add(struct wheel *w, struct timer *t, uint64_t atMs) {
+    wheel_del(t);
+    t->expires = (atMs + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (t->expires <= w->tick) t->expires = w->tick + 1;//already due: next tick
+
+    struct timer *head = &w->slots[t->expires & (WHEEL_SLOTS - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void wheel_advance(struct wheel *w, uint64_t nowMs, void (*fire)(struct timer *t)) {
+    uint64_t target = nowMs / WHEEL_TICK_MS;
+    if (target - w->tick > WHEEL_SLOTS) w->tick = target - WHEEL_SLOTS;//a long stall: one lap covers every slot
+
+    while (w->tick < target) {
+        w->tick++;
+        struct timer *head = &w->slots[w->tick & (WHEEL_SLOTS - 1)];
+        struct timer *t = head->next;
+        while (t != head) {
+            struct timer *next = t->next;
+            if (t->expires <= w->tick) {//later laps share the slot and stay
+                wheel_del(t);
+                fire(t);
+            }
+            t = next;
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+// Hashed timing wheel (Varghese & Lauck, scheme 6): timers hash into
+// WHEEL_SLOTS lists by expiry tick, so adding, cancelling and expiring are
+// O(1) per timer and nothing ever scans the set of live connections.
+#define WHEEL_SLOTS 1024        // power of two
+#define WHEEL_TICK_MS 100
+
+// Embed in whatever owns the deadline
+struct timer {
+    struct timer *next, *prev;  // NULL when not armed
+    uint64_t expires;           // tick
+};
+
+struct wheel {
+    struct timer slots[WHEEL_SLOTS];    // list heads
+    uint64_t tick;                      // last tick processed
+};
+
+void wheel_init(struct wheel *w, uint64_t nowMs);
+
+// Arm t to fire at atMs (rounded up to a tick); re-arming moves it
+void wheel_add(struct wheel *w, struct timer *t, uint64_t atMs);
+void wheel_del(struct timer *t);
+
+// Fire every timer due by nowMs; each is disarmed before fire() runs, so
+// fire() may free it or arm it again
+void wheel_advance(struct wheel *w, uint64_t nowMs, void (*fire)(struct timer *t));
+
+#endif // WHEEL_H